@@ -0,0 +1,195 @@
+/**
+ * Contention benchmark for usenet's work queue.
+ *
+ * Pushes a fixed number of items through three queue setups with a varying
+ * number of producer and consumer threads, and prints items per second:
+ *
+ *   mutex    - one mutex around a std::deque of bound std::functions, which
+ *              is what usenet used to do
+ *   ring+bfm - lock-free pushes into mpmc_ring, pops under a mutex, which is
+ *              what usenet does now (consumers need m_bfm for the lists)
+ *   ring     - mpmc_ring on its own, lock-free on both ends
+ *
+ * Build from this directory:
+ *   g++ -std=c++11 -O2 -pthread bench_dispatch.cc -o bench_dispatch
+ *
+ * Usage: bench_dispatch [items]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../../src/util/mpmc_ring.hpp"
+
+namespace
+{
+    struct article
+    {
+        size_t size;
+    };
+
+    // Same shape as usenet's work_item
+    struct work_item
+    {
+        std::shared_ptr<article> msg;
+        std::string msgid;
+    };
+
+    std::atomic<std::uint64_t> g_sink{0};
+
+    void consume(const std::shared_ptr<article>& msg)
+    {
+        g_sink.fetch_add(msg->size, std::memory_order_relaxed);
+    }
+
+    template <class Push, class Pop>
+    double run(size_t items, size_t producers, size_t consumers, Push push, Pop pop)
+    {
+        auto msg = std::make_shared<article>(article{1});
+        std::atomic<size_t> consumed{0};
+        std::vector<std::thread> threads;
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t p = 0; p < producers; ++p)
+        {
+            size_t share = items / producers + (p < items % producers ? 1 : 0);
+            threads.emplace_back([share, &push, msg]()
+                    {
+                        for (size_t i = 0; i < share; ++i)
+                        {
+                            while (!push(msg))
+                            {
+                                std::this_thread::yield();
+                            }
+                        }
+                    });
+        }
+
+        for (size_t c = 0; c < consumers; ++c)
+        {
+            threads.emplace_back([items, &consumed, &pop]()
+                    {
+                        while (consumed.load(std::memory_order_relaxed) < items)
+                        {
+                            if (pop())
+                            {
+                                consumed.fetch_add(1, std::memory_order_relaxed);
+                            }
+                            else
+                            {
+                                std::this_thread::yield();
+                            }
+                        }
+                    });
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        auto seconds = std::chrono::duration_cast<std::chrono::duration<double>>(
+                std::chrono::steady_clock::now() - start).count();
+        return items / seconds;
+    }
+
+    double bench_mutex(size_t items, size_t producers, size_t consumers)
+    {
+        std::mutex lock;
+        std::deque<std::function<void(int)>> queue;
+
+        auto push = [&](const std::shared_ptr<article>& msg)
+        {
+            std::lock_guard<std::mutex> _lock{lock};
+            queue.push_back(std::bind([](const std::shared_ptr<article>& m, int) { consume(m); },
+                        msg, std::placeholders::_1));
+            return true;
+        };
+
+        auto pop = [&]()
+        {
+            std::lock_guard<std::mutex> _lock{lock};
+            if (queue.empty())
+            {
+                return false;
+            }
+            auto command = queue.front();
+            queue.pop_front();
+            command(0);
+            return true;
+        };
+
+        return run(items, producers, consumers, push, pop);
+    }
+
+    double bench_ring(size_t items, size_t producers, size_t consumers, bool locked_pop)
+    {
+        std::mutex lock;
+        p2u::util::mpmc_ring<work_item> ring{4096};
+
+        auto push = [&](const std::shared_ptr<article>& msg)
+        {
+            work_item item;
+            item.msg = msg;
+            return ring.try_push(std::move(item));
+        };
+
+        auto pop = [&]()
+        {
+            work_item item;
+            if (locked_pop)
+            {
+                std::lock_guard<std::mutex> _lock{lock};
+                if (!ring.try_pop(item))
+                {
+                    return false;
+                }
+                consume(item.msg);
+                return true;
+            }
+
+            if (!ring.try_pop(item))
+            {
+                return false;
+            }
+            consume(item.msg);
+            return true;
+        };
+
+        return run(items, producers, consumers, push, pop);
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    size_t items = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000000;
+    const size_t threads[] = {1, 2, 4, 8};
+
+    std::cout << "items: " << items << ", Mitems/s" << std::endl;
+    std::cout << std::setw(10) << "producers" << std::setw(10) << "consumers"
+        << std::setw(10) << "mutex" << std::setw(10) << "ring+bfm" << std::setw(10) << "ring" << std::endl;
+
+    for (size_t producers : {1, 2, 4})
+    {
+        for (size_t consumers : threads)
+        {
+            std::cout << std::fixed << std::setprecision(2)
+                << std::setw(10) << producers << std::setw(10) << consumers
+                << std::setw(10) << bench_mutex(items, producers, consumers) / 1e6
+                << std::setw(10) << bench_ring(items, producers, consumers, true) / 1e6
+                << std::setw(10) << bench_ring(items, producers, consumers, false) / 1e6
+                << std::endl;
+        }
+    }
+
+    return g_sink.load() == 0;
+}
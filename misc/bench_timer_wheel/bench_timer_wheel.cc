@@ -0,0 +1,239 @@
+/**
+ * Overhead benchmark for the operation timeouts of a connection.
+ *
+ * Simulates connections on one io_service that each arm a timeout, run an
+ * operation that completes right away (a posted handler) and disarm the
+ * timeout again, which is what connection does around nearly every read and
+ * write. Prints the cost per operation and how many timer waits and
+ * handlers it took:
+ *
+ *   deadline  - one deadline_timer per connection, expires_from_now and
+ *               async_wait per operation, cancel on completion. This is what
+ *               connection used to do.
+ *   wheel     - a timer_wheel entry per connection, arm and disarm, which is
+ *               what connection does now
+ *   none      - the operations without any timeout, as the baseline
+ *
+ * The difference to "none" is what the timeouts cost.
+ *
+ * Build from this directory:
+ *   g++ -std=c++11 -O2 -pthread bench_timer_wheel.cc ../../src/util/timer_wheel.cc \
+ *       -o bench_timer_wheel -lboost_system
+ *
+ * Usage: bench_timer_wheel [operations]
+ */
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "../../src/util/timer_wheel.hpp"
+
+namespace
+{
+    // How long the timeouts are, they never expire during the benchmark
+    const std::chrono::milliseconds TIMEOUT{30000};
+
+    struct result
+    {
+        double ns_per_op = 0;
+        std::uint64_t waits = 0;
+        std::uint64_t handlers = 0;
+    };
+
+    // Runs ops operations spread over conns connections. Arm is called before
+    // each operation, disarm once it completed.
+    template <class Connection>
+    result run(size_t ops, std::vector<std::unique_ptr<Connection>>& conns,
+               boost::asio::io_service& iosvc)
+    {
+        size_t started = 0;
+        size_t finished = 0;
+        std::uint64_t handlers = 0;
+        std::chrono::steady_clock::time_point end;
+
+        std::function<void(Connection&)> next = [&](Connection& conn)
+        {
+            if (started == ops)
+            {
+                return;
+            }
+            ++started;
+
+            conn.arm();
+            iosvc.post([&ops, &finished, &handlers, &end, &next, &conn]()
+                    {
+                        ++handlers;
+                        conn.disarm();
+                        if (++finished == ops)
+                        {
+                            // Not when run() returns, the wheel may tick
+                            // once more before it notices it is done
+                            end = std::chrono::steady_clock::now();
+                        }
+                        next(conn);
+                    });
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        for (auto& conn : conns)
+        {
+            next(*conn);
+        }
+        iosvc.run();
+        auto elapsed = std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(
+                end - start).count();
+
+        result r;
+        r.ns_per_op = elapsed / ops;
+        r.handlers = handlers;
+        for (auto& conn : conns)
+        {
+            r.waits += conn->waits;
+            r.handlers += conn->handlers;
+        }
+        return r;
+    }
+
+    struct deadline_connection
+    {
+        boost::asio::deadline_timer timer;
+        std::uint64_t waits = 0;
+        std::uint64_t handlers = 0;
+
+        explicit deadline_connection(boost::asio::io_service& iosvc)
+            : timer{iosvc}
+        {
+
+        }
+
+        void arm()
+        {
+            ++waits;
+            timer.expires_from_now(boost::posix_time::milliseconds(TIMEOUT.count()));
+            timer.async_wait([this](const boost::system::error_code&)
+                    {
+                        // Runs for every wait, cancelled or not
+                        ++handlers;
+                    });
+        }
+
+        void disarm()
+        {
+            boost::system::error_code ignored;
+            timer.cancel(ignored);
+        }
+    };
+
+    struct wheel_connection
+    {
+        p2u::asio::timer_wheel::entry entry;
+        std::uint64_t waits = 0;
+        std::uint64_t handlers = 0;
+
+        explicit wheel_connection(p2u::asio::timer_wheel& wheel)
+            : entry{wheel, [](){}}
+        {
+
+        }
+
+        void arm()
+        {
+            entry.arm(TIMEOUT);
+        }
+
+        void disarm()
+        {
+            entry.disarm();
+        }
+    };
+
+    struct bare_connection
+    {
+        std::uint64_t waits = 0;
+        std::uint64_t handlers = 0;
+
+        void arm()
+        {
+
+        }
+
+        void disarm()
+        {
+
+        }
+    };
+
+    result bench_deadline(size_t ops, size_t num_conns)
+    {
+        boost::asio::io_service iosvc;
+        std::vector<std::unique_ptr<deadline_connection>> conns;
+        for (size_t i = 0; i < num_conns; ++i)
+        {
+            conns.emplace_back(new deadline_connection{iosvc});
+        }
+        return run(ops, conns, iosvc);
+    }
+
+    result bench_wheel(size_t ops, size_t num_conns)
+    {
+        boost::asio::io_service iosvc;
+        p2u::asio::timer_wheel wheel{iosvc};
+        std::vector<std::unique_ptr<wheel_connection>> conns;
+        for (size_t i = 0; i < num_conns; ++i)
+        {
+            conns.emplace_back(new wheel_connection{wheel});
+        }
+
+        auto r = run(ops, conns, iosvc);
+        auto stats = wheel.get_statistics();
+        r.waits = stats.ticks;
+        r.handlers += stats.ticks;
+        return r;
+    }
+
+    result bench_none(size_t ops, size_t num_conns)
+    {
+        boost::asio::io_service iosvc;
+        std::vector<std::unique_ptr<bare_connection>> conns;
+        for (size_t i = 0; i < num_conns; ++i)
+        {
+            conns.emplace_back(new bare_connection);
+        }
+        return run(ops, conns, iosvc);
+    }
+
+    void print(const char* name, size_t num_conns, const result& r, const result& baseline)
+    {
+        std::cout << std::fixed << std::setprecision(1)
+            << std::setw(10) << name << std::setw(8) << num_conns
+            << std::setw(12) << r.ns_per_op
+            << std::setw(12) << r.ns_per_op - baseline.ns_per_op
+            << std::setw(12) << r.waits
+            << std::setw(12) << r.handlers << std::endl;
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    size_t ops = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000000;
+
+    std::cout << "operations: " << ops << std::endl;
+    std::cout << std::setw(10) << "timeouts" << std::setw(8) << "conns"
+        << std::setw(12) << "ns/op" << std::setw(12) << "overhead"
+        << std::setw(12) << "waits" << std::setw(12) << "handlers" << std::endl;
+
+    for (size_t num_conns : {1, 16, 256})
+    {
+        auto baseline = bench_none(ops, num_conns);
+        print("none", num_conns, baseline, baseline);
+        print("deadline", num_conns, bench_deadline(ops, num_conns), baseline);
+        print("wheel", num_conns, bench_wheel(ops, num_conns), baseline);
+    }
+
+    return 0;
+}
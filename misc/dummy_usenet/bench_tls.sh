@@ -0,0 +1,50 @@
+#!/bin/sh
+# Posts the same file twice against a locally running dummy_server, once with
+# user-space TLS and once with KernelTLS, and prints the wall/CPU summary line
+# of each run.
+#
+# Usage: bench_tls.sh path/to/post2usenet port file [connections]
+#
+# For the kernel path to actually engage, the tls module must be loaded
+# (modprobe tls). Otherwise the second run reports the fallback.
+
+if [ $# -lt 3 ]; then
+    echo "Usage: $0 post2usenet port file [connections]"
+    exit 1
+fi
+
+POSTER=$1
+PORT=$2
+FILE=$3
+CONNECTIONS=${4:-8}
+WORKDIR=$(mktemp -d)
+
+write_config()
+{
+    cat > "$WORKDIR/$1.conf" <<CONF
+[global]
+From = bench <bench@example.com>
+ArticleSize = 700000
+ArticleQueueSize = 64
+OperationTimeout = 30
+
+[Server1]
+Address = 127.0.0.1
+Port = $PORT
+Username = bench
+Password = bench
+TLS = yes
+KernelTLS = $2
+Connections = $CONNECTIONS
+CONF
+}
+
+write_config userspace no
+write_config kernel yes
+
+for mode in userspace kernel; do
+    echo "== $mode"
+    "$POSTER" -c "$WORKDIR/$mode.conf" -g alt.binaries.test "$FILE" 2>&1 | grep -E "^\[(INFO\] Posted|WARN\] Kernel)"
+done
+
+rm -rf "$WORKDIR"
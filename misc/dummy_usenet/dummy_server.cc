@@ -18,6 +18,7 @@ const std::string SERVER_AUTH("381 PASS required\r\n");
 const std::string SERVER_AUTH_SUCCESS("281 Posting allowed\r\n");
 const std::string SERVER_SEND_ARTICLE("381 Send article to be posted\r\n");
 const std::string SERVER_ARTICLE_POSTED("200 Article posted\r\n");
+const std::string SERVER_UNKNOWN_COMMAND("500 What?\r\n");
 
 std::string read_line(ssl_socket& socket, boost::asio::streambuf& readbuf)
 {
@@ -93,6 +94,11 @@ void usenet_session(std::unique_ptr<ssl_socket> sockptr)
             std::cout << "Client " << id << " gracefully quitting " << std::endl;
             socket.shutdown();
         }
+        else
+        {
+            // e.g. CAPABILITIES, so clients probing for extensions move on
+            boost::asio::write(socket, boost::asio::buffer(SERVER_UNKNOWN_COMMAND));
+        }
     }
     } catch (std::exception& e)
     {
@@ -0,0 +1,852 @@
+/**
+ * Discrete-event simulation of how usenet hands articles to connections.
+ *
+ * Runs usenet's own work_scheduler on virtual time: retries ahead of the
+ * shared queue, look-ahead batches while nobody is idle, an idle connection
+ * picked per server by the dispatch policy, articles a server refused
+ * routed to another server's queue and stolen from there once the others
+ * run dry. Failures are classified and backed off by retry_policy, and
+ * optionally each server has a connection_ramp. All of those are the real
+ * ones from src/nntp, driven the way usenet drives them. Only the
+ * connections and servers are made up:
+ *
+ *   - a post takes two round trips plus the article over the connection's
+ *     bandwidth, both drawn per post from log-normal distributions
+ *   - with a cap, a server's bandwidth is shared by the posts in flight
+ *   - posts fail at configurable rates: dropped connections, throttling
+ *     (503, the connection reconnects), refusals (441) and moves (440)
+ *   - a post that would take longer than the timeout fails at the timeout
+ *   - connects take three round trips, paced per server like the
+ *     connect_supervisor does
+ *
+ * Encoding is a steady rate at which articles are queued, or the whole job
+ * is queued up front. Only with idle connections of several servers to
+ * choose from does the dispatch policy make a difference, so compare
+ * policies with the encoder slower than the servers. Nothing sleeps,
+ * thousands of articles take milliseconds. The same seed gives the same
+ * job, only retry_policy jitters its backoff on its own.
+ *
+ * What usenet does around the scheduler is left out, and results drift
+ * from what it does the more a job depends on it:
+ *
+ *   - everything is DATA, no job's VERIFY or RECOVERY, and no post order
+ *   - no racing of stragglers, spare connections, recycling of slow ones,
+ *     or STATs of posts whose acknowledgement got lost
+ *
+ * Build from this directory:
+ *   g++ -std=c++11 -O2 -pthread simulate_dispatch.cc ../../src/nntp/dispatch_policy.cc \
+ *       ../../src/nntp/retry_policy.cc ../../src/nntp/connection_ramp.cc \
+ *       ../../src/nntp/work_scheduler.cc ../../src/util/backoff.cc -o simulate_dispatch
+ *
+ * Usage: simulate_dispatch [-a articles] [-s article KB] [-e encode MB/s]
+ *                          [-p policy] [-b prefetch] [-t timeout ms]
+ *                          [-f max failures] [-d retry ms] [-r seed] [-v]
+ *                          server...
+ *
+ * The policy is fifo, weighted, least-outstanding or all (the default),
+ * which runs the same job under each of them. Prefetch is usenet's
+ * PrefetchDepth, 4 by default. A server is a comma separated list of
+ * key=value, e.g.
+ *   connections=20,rtt=80,bandwidth=500,cap=8000,throttle=0.01
+ *
+ *   connections   how many, 8 by default
+ *   initial       start with this many and ramp up, 0 uses all
+ *   rtt           median round trip in ms, 40 by default
+ *   rtt_spread    sigma of its log-normal, 0.3
+ *   bandwidth     median KB/s of one connection, 1000
+ *   bw_spread     sigma of its log-normal, 0.3
+ *   cap           KB/s of the whole server, 0 is none
+ *   connect_rate  connects per second, 10
+ *   drop, throttle, reject, move
+ *                 chance per post of each failure, 0
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "../../src/nntp/dispatch_policy.hpp"
+#include "../../src/nntp/retry_policy.hpp"
+#include "../../src/nntp/connection_ramp.hpp"
+#include "../../src/nntp/work_scheduler.hpp"
+#include "../../src/util/make_unique.hpp"
+
+namespace
+{
+    // Same as usenet's RAMP_INTERVAL_MS
+    const double RAMP_INTERVAL_MS = 2000;
+
+    struct server_spec
+    {
+        size_t connections = 8;
+        size_t initial = 0;
+        double rtt = 40;
+        double rtt_spread = 0.3;
+        double bandwidth = 1000;
+        double bw_spread = 0.3;
+        double cap = 0;
+        double connect_rate = 10;
+        double drop = 0;
+        double throttle = 0;
+        double reject = 0;
+        double move = 0;
+    };
+
+    struct job_spec
+    {
+        size_t articles = 2000;
+        double article_kb = 700;
+
+        // Zero queues everything up front
+        double encode_mb = 0;
+        double timeout_ms = 10000;
+        unsigned int max_failures = 3;
+        unsigned int retry_ms = 1000;
+        unsigned int seed = 1;
+        size_t prefetch_depth = p2u::nntp::DEFAULT_PREFETCH_DEPTH;
+
+        // Print what the connection ramps decide
+        bool verbose = false;
+        std::vector<server_spec> servers;
+    };
+
+    struct result
+    {
+        double makespan_ms = 0;
+        size_t posted = 0;
+        size_t given_up = 0;
+        size_t retries = 0;
+        std::vector<double> post_ms;
+        std::vector<double> article_ms;
+        std::vector<size_t> server_posted;
+        std::vector<double> utilization;
+        std::vector<size_t> server_connections;
+        std::vector<size_t> server_routed;
+        std::vector<size_t> server_stolen;
+    };
+
+    server_spec parse_server(const std::string& text)
+    {
+        server_spec spec;
+        std::istringstream stream{text};
+        std::string item;
+        while (std::getline(stream, item, ','))
+        {
+            auto equals = item.find('=');
+            if (equals == std::string::npos)
+            {
+                throw std::runtime_error{"Expected key=value: " + item};
+            }
+
+            auto key = item.substr(0, equals);
+            auto value = std::strtod(item.c_str() + equals + 1, nullptr);
+            if (key == "connections") spec.connections = std::max<size_t>(static_cast<size_t>(value), 1);
+            else if (key == "initial") spec.initial = static_cast<size_t>(value);
+            else if (key == "rtt") spec.rtt = value;
+            else if (key == "rtt_spread") spec.rtt_spread = value;
+            else if (key == "bandwidth") spec.bandwidth = value;
+            else if (key == "bw_spread") spec.bw_spread = value;
+            else if (key == "cap") spec.cap = value;
+            else if (key == "connect_rate") spec.connect_rate = value;
+            else if (key == "drop") spec.drop = value;
+            else if (key == "throttle") spec.throttle = value;
+            else if (key == "reject") spec.reject = value;
+            else if (key == "move") spec.move = value;
+            else throw std::runtime_error{"Unknown server key: " + key};
+        }
+        return spec;
+    }
+
+    double percentile(std::vector<double> values, double p)
+    {
+        if (values.empty())
+        {
+            return 0;
+        }
+        auto nth = values.begin() + static_cast<size_t>(p * (values.size() - 1));
+        std::nth_element(values.begin(), nth, values.end());
+        return *nth;
+    }
+
+    // Events on virtual time, in milliseconds. Ties run in the order they
+    // were scheduled.
+    class clock_queue
+    {
+        private:
+            struct event
+            {
+                double at;
+                std::uint64_t seq;
+                std::function<void()> run;
+            };
+
+            struct later
+            {
+                bool operator()(const event& a, const event& b) const
+                {
+                    return a.at > b.at || (a.at == b.at && a.seq > b.seq);
+                }
+            };
+
+            std::priority_queue<event, std::vector<event>, later> m_events;
+            std::uint64_t m_seq = 0;
+            double m_now = 0;
+
+        public:
+            double now() const
+            {
+                return m_now;
+            }
+
+            void after(double delay, std::function<void()> run)
+            {
+                m_events.push(event{m_now + std::max(delay, 0.0), m_seq++, std::move(run)});
+            }
+
+            void run()
+            {
+                while (!m_events.empty())
+                {
+                    auto next = m_events.top();
+                    m_events.pop();
+                    m_now = next.at;
+                    next.run();
+                }
+            }
+    };
+
+    class simulation
+    {
+        private:
+            enum class outcome
+            {
+                POSTED,
+                DROPPED,
+                TIMED_OUT,
+                THROTTLED,
+                REJECTED,
+                MOVED
+            };
+
+            // What the scheduler holds, an article by its index
+            struct work_item
+            {
+                p2u::nntp::post_priority priority = p2u::nntp::post_priority::DATA;
+                size_t avoid = p2u::nntp::NO_SERVER;
+                size_t article = 0;
+
+                bool stealable() const
+                {
+                    return true;
+                }
+            };
+
+            // Connections by their index
+            using scheduler = p2u::nntp::work_scheduler<size_t, work_item>;
+            using conn_iterator = scheduler::iterator;
+
+            struct server_state
+            {
+                server_spec spec;
+                p2u::nntp::server_load load;
+                std::unique_ptr<p2u::nntp::connection_ramp> ramp;
+                double next_connect = 0;
+                size_t in_flight = 0;
+
+                // Put aside by the ramp, not connected, and how many busy
+                // ones follow once they are done
+                std::list<size_t> dormant;
+                size_t shed = 0;
+
+                std::uint64_t interval_bytes = 0;
+                size_t interval_posts = 0;
+                double interval_busy_ms = 0;
+                size_t interval_errors = 0;
+
+                // Connection time spent posting, and available for it
+                double busy_ms = 0;
+                double enabled_ms = 0;
+                size_t enabled = 0;
+                double enabled_since = 0;
+                size_t peak = 0;
+                size_t posted = 0;
+            };
+
+            struct connection_state
+            {
+                size_t server;
+            };
+
+            struct article_state
+            {
+                unsigned int failures = 0;
+                double queued = 0;
+            };
+
+            const job_spec& m_job;
+            clock_queue m_clock;
+            std::mt19937 m_rng;
+            p2u::nntp::retry_policy m_retry;
+
+            std::vector<server_state> m_servers;
+            std::vector<connection_state> m_connections;
+            std::vector<article_state> m_articles;
+            scheduler m_scheduler;
+
+            size_t m_remaining;
+            result m_result;
+
+            double draw(double median, double sigma)
+            {
+                if (sigma <= 0)
+                {
+                    return median;
+                }
+                std::lognormal_distribution<double> distribution{std::log(median), sigma};
+                return distribution(m_rng);
+            }
+
+            void set_enabled(server_state& server, size_t enabled)
+            {
+                server.enabled_ms += server.enabled * (m_clock.now() - server.enabled_since);
+                server.enabled_since = m_clock.now();
+                server.enabled = enabled;
+                server.peak = std::max(server.peak, enabled);
+            }
+
+            void connect(conn_iterator conn)
+            {
+                // Paced per server, then three round trips: TCP, greeting,
+                // authentication
+                auto& server = m_servers[m_connections[*conn].server];
+                double start = std::max(m_clock.now(), server.next_connect);
+                server.next_connect = start + 1000 / std::max(server.spec.connect_rate, 0.001);
+                m_clock.after(start - m_clock.now() + 3 * draw(server.spec.rtt, server.spec.rtt_spread),
+                        [this, conn]()
+                        {
+                            find_work(conn);
+                        });
+            }
+
+            void reconnect(conn_iterator conn)
+            {
+                // Like usenet::schedule_reconnect, its batch goes back first
+                if (m_scheduler.return_batch(conn))
+                {
+                    drain();
+                }
+                connect(conn);
+            }
+
+            void find_work(conn_iterator conn)
+            {
+                // Like usenet::find_work, the connection busy
+                auto& server = m_servers[m_connections[*conn].server];
+                if (server.shed > 0)
+                {
+                    // The ramp wants fewer
+                    --server.shed;
+                    make_dormant(conn);
+                    return;
+                }
+
+                work_item item;
+                if (m_scheduler.next_work(item, conn))
+                {
+                    start_post(conn, item.article);
+                }
+                else
+                {
+                    m_scheduler.make_ready(conn);
+                }
+            }
+
+            void drain()
+            {
+                conn_iterator conn;
+                work_item item;
+                while (m_scheduler.drain(conn, item))
+                {
+                    start_post(conn, item.article);
+                }
+            }
+
+            void make_dormant(conn_iterator conn)
+            {
+                // Like usenet::make_dormant, the connection busy
+                auto& server = m_servers[m_connections[*conn].server];
+                if (m_scheduler.return_batch(conn))
+                {
+                    drain();
+                }
+                server.dormant.splice(server.dormant.end(), m_scheduler.busy(), conn);
+                set_enabled(server, server.enabled - 1);
+            }
+
+            void wake_dormant(server_state& server)
+            {
+                auto conn = server.dormant.begin();
+                m_scheduler.busy().splice(m_scheduler.busy().end(), server.dormant, conn);
+                set_enabled(server, server.enabled + 1);
+                connect(conn);
+            }
+
+            void start_post(conn_iterator conn, size_t article)
+            {
+                auto& server = m_servers[m_connections[*conn].server];
+                const auto& spec = server.spec;
+
+                double bandwidth = draw(spec.bandwidth, spec.bw_spread);
+                if (spec.cap > 0)
+                {
+                    bandwidth = std::min(bandwidth, spec.cap / (server.in_flight + 1));
+                }
+                double duration = 2 * draw(spec.rtt, spec.rtt_spread) +
+                    m_job.article_kb / std::max(bandwidth, 0.001) * 1000;
+
+                // Refusals only come after the whole article was sent
+                std::uniform_real_distribution<double> chance{0, 1};
+                double roll = chance(m_rng);
+                auto what = outcome::POSTED;
+                if ((roll -= spec.drop) < 0)
+                {
+                    what = outcome::DROPPED;
+                    duration *= chance(m_rng);
+                }
+                else if ((roll -= spec.throttle) < 0)
+                {
+                    what = outcome::THROTTLED;
+                }
+                else if ((roll -= spec.reject) < 0)
+                {
+                    what = outcome::REJECTED;
+                }
+                else if ((roll -= spec.move) < 0)
+                {
+                    what = outcome::MOVED;
+                }
+
+                if (duration > m_job.timeout_ms)
+                {
+                    what = outcome::TIMED_OUT;
+                    duration = m_job.timeout_ms;
+                }
+
+                auto bytes = static_cast<std::uint64_t>(m_job.article_kb * 1024);
+                server.load.on_dispatched(bytes);
+                ++server.in_flight;
+                double started = m_clock.now();
+                m_clock.after(duration, [this, conn, article, what, started]()
+                        {
+                            finish_post(conn, article, what, started);
+                        });
+            }
+
+            void finish_post(conn_iterator conn, size_t article, outcome what, double started)
+            {
+                // Like usenet::on_post_finished, the retry is placed before
+                // the connection looks for work or reconnects
+                auto server_index = m_connections[*conn].server;
+                auto& server = m_servers[server_index];
+                auto bytes = static_cast<std::uint64_t>(m_job.article_kb * 1024);
+                double elapsed = m_clock.now() - started;
+                --server.in_flight;
+                server.busy_ms += elapsed;
+
+                switch (what)
+                {
+                    case outcome::POSTED:
+                        server.load.on_posted(bytes, std::chrono::microseconds{
+                                static_cast<std::int64_t>(elapsed * 1000)});
+                        server.interval_bytes += bytes;
+                        ++server.interval_posts;
+                        server.interval_busy_ms += elapsed;
+                        ++server.posted;
+                        m_result.post_ms.push_back(elapsed);
+                        m_result.article_ms.push_back(m_clock.now() - m_articles[article].queued);
+                        done();
+                        find_work(conn);
+                        break;
+                    case outcome::DROPPED:
+                    case outcome::TIMED_OUT:
+                        // The connection was the problem, any other one will do
+                        server.load.on_failed(bytes);
+                        ++server.interval_errors;
+                        retry(article, p2u::nntp::NO_SERVER, false);
+                        reconnect(conn);
+                        break;
+                    case outcome::THROTTLED:
+                        server.load.on_failed(bytes);
+                        ++server.interval_errors;
+                        retry(article, p2u::nntp::NO_SERVER, true);
+                        reconnect(conn);
+                        break;
+                    case outcome::REJECTED:
+                        server.load.on_failed(bytes);
+                        ++m_result.given_up;
+                        done();
+                        find_work(conn);
+                        break;
+                    case outcome::MOVED:
+                        server.load.on_failed(bytes);
+                        retry(article, server_index, false);
+                        find_work(conn);
+                        break;
+                }
+            }
+
+            void retry(size_t article, size_t avoid, bool delayed)
+            {
+                auto& state = m_articles[article];
+                if (m_retry.exhausted(++state.failures))
+                {
+                    ++m_result.given_up;
+                    done();
+                    return;
+                }
+
+                ++m_result.retries;
+                if (!delayed)
+                {
+                    place(article, avoid);
+                    return;
+                }
+
+                m_clock.after(m_retry.delay_for(state.failures).count(), [this, article, avoid]()
+                        {
+                            place(article, avoid);
+                        });
+            }
+
+            void place(size_t article, size_t avoid)
+            {
+                // Like usenet::place_post
+                work_item item;
+                item.priority = p2u::nntp::post_priority::RETRY;
+                item.avoid = avoid;
+                item.article = article;
+
+                conn_iterator conn;
+                if (m_scheduler.place(item, conn))
+                {
+                    start_post(conn, article);
+                }
+            }
+
+            void enqueue(size_t article)
+            {
+                m_articles[article].queued = m_clock.now();
+                work_item item;
+                item.article = article;
+                m_scheduler.push(std::move(item));
+            }
+
+            void arrive(size_t article)
+            {
+                enqueue(article);
+                drain();
+
+                if (article + 1 < m_job.articles)
+                {
+                    m_clock.after(m_job.article_kb / 1024 / m_job.encode_mb * 1000, [this, article]()
+                            {
+                                arrive(article + 1);
+                            });
+                }
+            }
+
+            void done()
+            {
+                if (--m_remaining == 0)
+                {
+                    m_result.makespan_ms = m_clock.now();
+                }
+            }
+
+            void on_ramp_timer()
+            {
+                if (m_remaining == 0)
+                {
+                    return;
+                }
+
+                bool backlog = m_scheduler.queued() > 0 && m_scheduler.idle() == 0;
+                for (size_t i = 0; i < m_servers.size(); ++i)
+                {
+                    auto& server = m_servers[i];
+                    if (!server.ramp)
+                    {
+                        continue;
+                    }
+
+                    auto decision = server.ramp->on_interval(server.interval_bytes, server.interval_posts,
+                            std::chrono::milliseconds{static_cast<std::int64_t>(server.interval_busy_ms)},
+                            server.interval_errors, backlog);
+                    if (m_job.verbose && decision.what != p2u::nntp::connection_ramp::action::HOLD)
+                    {
+                        std::cout << std::fixed << std::setprecision(1) << "  "
+                            << m_clock.now() / 1000 << " s: server " << i << " to "
+                            << decision.target << " connections, " << decision.reason << " ("
+                            << server.interval_bytes / 1024 / (RAMP_INTERVAL_MS / 1000) << " KB/s, "
+                            << server.interval_errors << " errors)" << std::endl;
+                    }
+                    server.interval_bytes = 0;
+                    server.interval_posts = 0;
+                    server.interval_busy_ms = 0;
+                    server.interval_errors = 0;
+                    apply_ramp(i, decision.target);
+                }
+
+                m_clock.after(RAMP_INTERVAL_MS, [this]()
+                        {
+                            on_ramp_timer();
+                        });
+            }
+
+            void apply_ramp(size_t server_index, size_t target)
+            {
+                // Like usenet::apply_ramp
+                auto& server = m_servers[server_index];
+                server.load.set_connections(target);
+
+                size_t wanted = server.enabled - std::min(server.enabled, server.shed);
+                while (wanted < target && server.shed > 0)
+                {
+                    --server.shed;
+                    ++wanted;
+                }
+                while (wanted < target && !server.dormant.empty())
+                {
+                    wake_dormant(server);
+                    ++wanted;
+                }
+
+                // Idle ones go right away, busy ones once they are done
+                auto& ready = m_scheduler.ready();
+                while (wanted > target)
+                {
+                    auto it = std::find_if(ready.begin(), ready.end(), [this, server_index](size_t conn)
+                            {
+                                return m_connections[conn].server == server_index;
+                            });
+                    if (it != ready.end())
+                    {
+                        m_scheduler.take_ready(it);
+                        make_dormant(it);
+                    }
+                    else
+                    {
+                        ++server.shed;
+                    }
+                    --wanted;
+                }
+            }
+
+        public:
+            simulation(const job_spec& job, p2u::nntp::dispatch_mode mode)
+                : m_job{job}, m_rng{job.seed},
+                  m_retry{job.max_failures, std::chrono::milliseconds{job.retry_ms},
+                      std::chrono::milliseconds{job.retry_ms * 60}},
+                  m_servers(job.servers.size()), m_articles(job.articles),
+                  m_scheduler{0, [this](size_t conn)
+                      {
+                          return m_connections[conn].server;
+                      }},
+                  m_remaining{job.articles}
+            {
+                m_scheduler.set_dispatch_policy(p2u::nntp::make_dispatch_policy(mode));
+                m_scheduler.set_prefetch_depth(job.prefetch_depth);
+
+                for (size_t i = 0; i < job.servers.size(); ++i)
+                {
+                    auto& server = m_servers[i];
+                    server.spec = job.servers[i];
+                    m_scheduler.add_server(&server.load);
+
+                    size_t initial = server.spec.connections;
+                    if (server.spec.initial > 0 && server.spec.initial < server.spec.connections)
+                    {
+                        server.ramp = std::make_unique<p2u::nntp::connection_ramp>(
+                                server.spec.initial, server.spec.connections);
+                        initial = server.ramp->target();
+                    }
+                    server.load.set_connections(initial);
+
+                    // The rest are only connected when the ramp asks
+                    for (size_t c = 0; c < server.spec.connections; ++c)
+                    {
+                        auto& list = c < initial ? m_scheduler.busy() : server.dormant;
+                        list.push_back(m_connections.size());
+                        m_connections.push_back(connection_state{i});
+                    }
+                    set_enabled(server, initial);
+                }
+
+                if (job.encode_mb <= 0)
+                {
+                    for (size_t article = 0; article < job.articles; ++article)
+                    {
+                        enqueue(article);
+                    }
+                }
+            }
+
+            result run()
+            {
+                auto& busy = m_scheduler.busy();
+                for (auto conn = busy.begin(); conn != busy.end(); ++conn)
+                {
+                    connect(conn);
+                }
+
+                if (std::any_of(m_servers.begin(), m_servers.end(),
+                            [](const server_state& server) { return server.ramp != nullptr; }))
+                {
+                    m_clock.after(RAMP_INTERVAL_MS, [this]()
+                            {
+                                on_ramp_timer();
+                            });
+                }
+
+                if (m_job.encode_mb > 0 && m_job.articles > 0)
+                {
+                    m_clock.after(0, [this]()
+                            {
+                                arrive(0);
+                            });
+                }
+
+                m_clock.run();
+
+                for (size_t i = 0; i < m_servers.size(); ++i)
+                {
+                    auto& server = m_servers[i];
+                    server.enabled_ms += server.enabled *
+                        std::max(m_result.makespan_ms - server.enabled_since, 0.0);
+                    m_result.posted += server.posted;
+                    m_result.server_posted.push_back(server.posted);
+                    m_result.utilization.push_back(server.enabled_ms > 0 ?
+                            std::min(server.busy_ms / server.enabled_ms, 1.0) : 0);
+                    m_result.server_connections.push_back(server.peak);
+                    m_result.server_routed.push_back(m_scheduler.routed(i));
+                    m_result.server_stolen.push_back(m_scheduler.stolen(i));
+                }
+                return m_result;
+            }
+    };
+
+    void report(const job_spec& job, p2u::nntp::dispatch_mode mode, const result& res)
+    {
+        double seconds = res.makespan_ms / 1000;
+        std::cout << std::fixed << std::setprecision(1)
+            << to_string(mode) << ": makespan " << seconds << " s, "
+            << job.article_kb * res.posted / 1024 / std::max(seconds, 0.001) << " MB/s, "
+            << res.posted << " posted, " << res.retries << " retries, "
+            << res.given_up << " given up" << std::endl;
+        std::cout << "  post latency: p50 " << percentile(res.post_ms, 0.5)
+            << " ms, p90 " << percentile(res.post_ms, 0.9)
+            << " ms, p99 " << percentile(res.post_ms, 0.99)
+            << " ms, max " << percentile(res.post_ms, 1) << " ms" << std::endl;
+        std::cout << "  queued to posted: p50 " << percentile(res.article_ms, 0.5)
+            << " ms, p99 " << percentile(res.article_ms, 0.99)
+            << " ms, max " << percentile(res.article_ms, 1) << " ms" << std::endl;
+        for (size_t i = 0; i < res.server_posted.size(); ++i)
+        {
+            std::cout << "  server " << i << ": " << res.server_posted[i] << " posted, utilization "
+                << res.utilization[i] * 100 << "%, peak connections "
+                << res.server_connections[i] << ", retries routed here "
+                << res.server_routed[i] << ", stolen " << res.server_stolen[i] << std::endl;
+        }
+    }
+
+    void usage()
+    {
+        std::cerr << "Usage: simulate_dispatch [-a articles] [-s article KB] [-e encode MB/s]" << std::endl
+            << "                         [-p policy] [-b prefetch] [-t timeout ms]" << std::endl
+            << "                         [-f max failures] [-d retry ms] [-r seed] [-v]" << std::endl
+            << "                         server..." << std::endl
+            << "A server is key=value,... see the top of simulate_dispatch.cc" << std::endl;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    job_spec job;
+    std::string policy = "all";
+
+    try
+    {
+        int opt;
+        while ((opt = getopt(argc, argv, "a:s:e:p:b:t:f:d:r:vh")) != -1)
+        {
+            switch (opt)
+            {
+                case 'a': job.articles = std::strtoul(optarg, nullptr, 10); break;
+                case 's': job.article_kb = std::strtod(optarg, nullptr); break;
+                case 'e': job.encode_mb = std::strtod(optarg, nullptr); break;
+                case 'p': policy = optarg; break;
+                case 'b': job.prefetch_depth = std::strtoul(optarg, nullptr, 10); break;
+                case 't': job.timeout_ms = std::strtod(optarg, nullptr); break;
+                case 'f': job.max_failures = std::strtoul(optarg, nullptr, 10); break;
+                case 'd': job.retry_ms = std::strtoul(optarg, nullptr, 10); break;
+                case 'r': job.seed = std::strtoul(optarg, nullptr, 10); break;
+                case 'v': job.verbose = true; break;
+                default:
+                    usage();
+                    return 1;
+            }
+        }
+
+        for (int i = optind; i < argc; ++i)
+        {
+            job.servers.push_back(parse_server(argv[i]));
+        }
+        if (job.servers.empty())
+        {
+            job.servers.push_back(server_spec{});
+        }
+
+        std::vector<p2u::nntp::dispatch_mode> modes;
+        if (policy == "all")
+        {
+            modes = {p2u::nntp::dispatch_mode::FIFO, p2u::nntp::dispatch_mode::WEIGHTED,
+                p2u::nntp::dispatch_mode::LEAST_OUTSTANDING};
+        }
+        else
+        {
+            modes.push_back(p2u::nntp::parse_dispatch_mode(policy));
+        }
+
+        std::cout << "Not modeled: priority classes beyond retries and data, hedging, spares,"
+            << " recycling (see the top of simulate_dispatch.cc)" << std::endl;
+
+        for (auto mode : modes)
+        {
+            auto start = std::chrono::steady_clock::now();
+            simulation sim{job, mode};
+            auto res = sim.run();
+            report(job, mode, res);
+            std::cout << "  simulated in " << std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
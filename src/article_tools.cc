@@ -0,0 +1,91 @@
+#include "article_tools.hpp"
+#include "fileset.hpp"
+#include <boost/asio/buffer.hpp>
+#include <cassert>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <vector>
+
+static std::mt19937 rng{static_cast<std::mt19937::result_type>(
+            std::chrono::system_clock::now().time_since_epoch().count())};
+static std::mutex rng_lock;
+
+std::string get_run_nonce(size_t length)
+{
+    static const char choices[] = "abcdefghijklmnopqrstuvwxyz1234567890";
+    std::ostringstream stream;
+
+    // Retries and hedges ask for new message ids from every io thread
+    std::lock_guard<std::mutex> _lock{rng_lock};
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        stream << choices[rng() % (sizeof(choices) - 1)];
+    }
+
+    return stream.str();
+}
+
+void renew_message_id(const std::shared_ptr<p2u::nntp::article>& article, const std::string& domain)
+{
+    auto& header = const_cast<p2u::nntp::header&>(article->get_header());
+
+    // Add some random data to the header to be sent.
+    //
+    // Why you ask? For some reason, certain news providers (ahem highwinds) have
+    // this stupid bug where if you try to post a certain message, it will *always* timeout
+    //
+    // Like, not even fail to post, just time out.
+    //
+    // This makes it *extremely* annoying to deal with (and it is the entire reason why I have
+    // logic that "times out" a news post")
+    //
+    // And even worse, when they time out, *even* after I change the message ID to avoid a possibility
+    // of duping a previous post, it *still* fails to post. The one method I found to seemingly work is
+    // to append some random data in the header.
+    std::string random_data_header_key{"X-Random-"};
+    random_data_header_key += get_run_nonce(10);
+    header.additional.push_back({random_data_header_key, get_run_nonce(5)});
+
+    // Change the message ID of this part. Which one made it into
+    // the NZB is settled once the post finishes.
+    auto key = fileset::get_key_from_message_id(header.msgid);
+    header.msgid = fileset::get_usenet_message_id(get_run_nonce(NONCE_LENGTH), domain, key.file_index, key.piece_index);
+}
+
+void dump_article(const p2u::nntp::article& article)
+{
+    std::ostringstream dumpfile;
+    dumpfile << article.get_header().msgid << ".dump";
+    std::ofstream dump{dumpfile.str().c_str(), std::ofstream::binary};
+    if (!dump.is_open())
+    {
+        std::cerr << "[ERROR] Could not open dump file. Discarding.." << std::endl;
+        return;
+    }
+
+    std::ostringstream header;
+    article.get_header().write_to(header);
+
+    std::string headerstr = header.str();
+    dump.write(headerstr.c_str(), headerstr.length());
+    dump.write("\r\n", 2);
+
+    std::vector<boost::asio::const_buffer> buffers;
+    article.write_payload_asio_buffers(std::back_inserter(buffers));
+    assert(buffers.size() > 0);
+    for (auto& p : buffers)
+    {
+        const char* buf = boost::asio::buffer_cast<const char*>(p);
+        size_t bufsize = boost::asio::buffer_size(p);
+        dump.write(buf, bufsize);
+    }
+
+    dump.write("\r\n.\r\n", 5);
+    dump.close();
+}
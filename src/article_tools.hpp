@@ -0,0 +1,27 @@
+#ifndef ARTICLE_TOOLS_HPP_
+#define ARTICLE_TOOLS_HPP_
+
+#include <memory>
+#include <string>
+
+#include "nntp/message.hpp"
+
+const int NONCE_LENGTH = 16;
+
+// Random [a-z0-9] string. Safe to call from any thread.
+std::string get_run_nonce(size_t length);
+
+/**
+ * Gives a piece a fresh identity, for when the same article has to go out
+ * again. Keeps its file and piece index, so it still maps to the same NZB
+ * segment.
+ */
+void renew_message_id(const std::shared_ptr<p2u::nntp::article>& article, const std::string& domain);
+
+/**
+ * Writes an article we gave up on to <msgid>.dump in the working directory,
+ * so it can be posted by hand.
+ */
+void dump_article(const p2u::nntp::article& article);
+
+#endif
@@ -0,0 +1,441 @@
+#include "daemon.hpp"
+#include "article_tools.hpp"
+#include "fileset.hpp"
+#include "util/make_unique.hpp"
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <unistd.h>
+#include <chrono>
+#include <csignal>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace
+{
+    // Longest request line we take
+    const size_t MAX_LINE = 64 * 1024;
+}
+
+class post_daemon::session : public std::enable_shared_from_this<session>
+{
+    private:
+        post_daemon& m_daemon;
+        boost::asio::local::stream_protocol::socket m_socket;
+        boost::asio::streambuf m_input;
+        std::deque<std::string> m_output;
+        bool m_writing;
+        bool m_closing;
+
+        // The job being described. Groups stay the default ones until the
+        // first group line.
+        prog_config m_request;
+        bool m_groups_given;
+
+        void read();
+        void write();
+        void on_line(const std::string& line);
+        void fail(const std::string& reason);
+
+    public:
+        explicit session(post_daemon& daemon);
+
+        boost::asio::local::stream_protocol::socket& get_socket();
+
+        // All of these on the control thread only
+        void start();
+        void send(const std::string& line);
+        void close_after_sending();
+        void close();
+};
+
+post_daemon::session::session(post_daemon& daemon)
+    : m_daemon(daemon), m_socket{daemon.m_control}, m_input{MAX_LINE},
+      m_writing{false}, m_closing{false}, m_request(daemon.m_cfg), m_groups_given{false}
+{
+    m_request.files.clear();
+    m_request.subject.clear();
+    m_request.nzboutput.clear();
+}
+
+boost::asio::local::stream_protocol::socket& post_daemon::session::get_socket()
+{
+    return m_socket;
+}
+
+void post_daemon::session::start()
+{
+    read();
+}
+
+void post_daemon::session::read()
+{
+    auto self = shared_from_this();
+    boost::asio::async_read_until(m_socket, m_input, '\n',
+            [self](const boost::system::error_code& ec, size_t)
+            {
+                if (ec)
+                {
+                    // Gone, or a line that doesn't fit
+                    self->close();
+                    return;
+                }
+
+                std::istream stream{&self->m_input};
+                std::string line;
+                std::getline(stream, line);
+                boost::algorithm::trim(line);
+                self->on_line(line);
+            });
+}
+
+void post_daemon::session::on_line(const std::string& line)
+{
+    auto space = line.find(' ');
+    auto key = line.substr(0, space);
+    auto value = space == std::string::npos ? std::string{} : boost::algorithm::trim_copy(line.substr(space + 1));
+
+    try
+    {
+        if (key.empty())
+        {
+        }
+        else if (key == "subject")
+        {
+            m_request.subject = value;
+        }
+        else if (key == "group")
+        {
+            if (!m_groups_given)
+            {
+                m_request.groups.clear();
+                m_groups_given = true;
+            }
+            m_request.groups.push_back(value);
+        }
+        else if (key == "file")
+        {
+            m_request.files.push_back(value);
+        }
+        else if (key == "nzb")
+        {
+            m_request.nzboutput = value;
+        }
+        else if (key == "order")
+        {
+            m_request.order = parse_post_order(value);
+        }
+        else if (key == "post")
+        {
+            // That's all we read, the job is answered from here on
+            m_daemon.submit(shared_from_this(), m_request);
+            return;
+        }
+        else
+        {
+            fail("Unknown request \"" + key + "\"");
+            return;
+        }
+    }
+    catch (const std::runtime_error& e)
+    {
+        fail(e.what());
+        return;
+    }
+
+    read();
+}
+
+void post_daemon::session::fail(const std::string& reason)
+{
+    send("ERROR " + reason);
+    close_after_sending();
+}
+
+void post_daemon::session::send(const std::string& line)
+{
+    if (!m_socket.is_open() || m_closing)
+    {
+        return;
+    }
+
+    m_output.push_back(line + "\n");
+    if (!m_writing)
+    {
+        write();
+    }
+}
+
+void post_daemon::session::write()
+{
+    m_writing = true;
+    auto self = shared_from_this();
+    boost::asio::async_write(m_socket, boost::asio::buffer(m_output.front()),
+            [self](const boost::system::error_code& ec, size_t)
+            {
+                self->m_output.pop_front();
+                if (ec)
+                {
+                    self->close();
+                }
+                else if (!self->m_output.empty())
+                {
+                    self->write();
+                }
+                else
+                {
+                    self->m_writing = false;
+                    if (self->m_closing)
+                    {
+                        self->close();
+                    }
+                }
+            });
+}
+
+void post_daemon::session::close_after_sending()
+{
+    m_closing = true;
+    if (!m_writing)
+    {
+        close();
+    }
+}
+
+void post_daemon::session::close()
+{
+    if (m_socket.is_open())
+    {
+        boost::system::error_code ec;
+        m_socket.shutdown(boost::asio::local::stream_protocol::socket::shutdown_both, ec);
+        m_socket.close(ec);
+    }
+    m_output.clear();
+    m_daemon.m_sessions.erase(shared_from_this());
+}
+
+post_daemon::post_daemon(const prog_config& cfg, p2u::nntp::usenet& usenet)
+    : m_cfg(cfg), m_usenet(usenet), m_poster{usenet},
+      m_control_work{std::make_unique<boost::asio::io_service::work>(m_control)},
+      m_acceptor{m_control}, m_signals{m_control, SIGINT, SIGTERM}, m_stopping{false}
+{
+
+}
+
+void post_daemon::accept()
+{
+    auto client = std::make_shared<session>(*this);
+    m_acceptor.async_accept(client->get_socket(), [this, client](const boost::system::error_code& ec)
+            {
+                if (ec == boost::asio::error::operation_aborted)
+                {
+                    return;
+                }
+
+                if (ec)
+                {
+                    std::cerr << "[WARN] Could not accept a client: " << ec.message() << std::endl;
+                }
+                else
+                {
+                    m_sessions.insert(client);
+                    client->start();
+                }
+                accept();
+            });
+}
+
+void post_daemon::on_signal(const boost::system::error_code& ec)
+{
+    if (ec)
+    {
+        return;
+    }
+
+    std::cerr << "[INFO] Stopping once the running jobs are done" << std::endl;
+    boost::system::error_code ignored;
+    m_acceptor.close(ignored);
+
+    std::lock_guard<std::mutex> _lock{m_lock};
+    m_stopping = true;
+    m_wakeup.notify_all();
+}
+
+void post_daemon::submit(const std::shared_ptr<session>& client, const prog_config& request)
+{
+    namespace fs = boost::filesystem;
+
+    p2u::job_options options;
+    options.from = request.from;
+    options.subject = request.subject;
+    options.groups = request.groups;
+    options.msgid_domain = request.msgiddomain;
+    options.article_size = request.article_size;
+    options.order = request.order;
+
+    // The subject the poster would pick, to name the NZB after
+    if (options.subject.empty() && request.files.size() == 1)
+    {
+        options.subject = request.files.front().filename().generic_string();
+    }
+
+    auto nzbpath = request.nzboutput;
+    if (!nzbpath.empty() && fs::is_directory(nzbpath))
+    {
+        nzbpath = (fs::path{nzbpath} / (options.subject + ".nzb")).generic_string();
+    }
+
+    // Both come in on an io thread
+    auto on_segment = [this, client](const p2u::segment_event& event)
+    {
+        if (!event.posted)
+        {
+            // Keep what we couldn't post, so it can be posted by hand
+            dump_article(*event.article);
+        }
+
+        auto seconds_elapsed = std::chrono::duration_cast<std::chrono::seconds>(event.elapsed).count();
+        std::uint64_t speed_kb = 0;
+        if (seconds_elapsed != 0)
+        {
+            speed_kb = (event.bytes_posted / seconds_elapsed) / 1024;
+        }
+
+        std::ostringstream status;
+        status << "STATUS> job " << event.job << ": " << event.pieces_done * 100 / event.pieces_total
+            << "% - Pieces Remaining: " << event.pieces_total - event.pieces_done
+            << " - Average Speed: " << speed_kb << " KB/s";
+
+        auto line = status.str();
+        m_control.post([client, line]()
+                {
+                    client->send(line);
+                });
+    };
+
+    auto on_done = [this, client, nzbpath](const p2u::job_result& result)
+    {
+        m_control.post([this, client, nzbpath, result]()
+                {
+                    finish(client, nzbpath, result);
+                });
+    };
+
+    size_t id;
+    try
+    {
+        id = m_poster.submit_files(request.files, options, on_segment, on_done);
+    }
+    catch (const std::exception& e)
+    {
+        client->send(std::string{"ERROR "} + e.what());
+        client->close_after_sending();
+        return;
+    }
+
+    // Whatever the job reports is posted here, so this goes out first
+    client->send("ACCEPTED " + std::to_string(id));
+}
+
+void post_daemon::finish(const std::shared_ptr<session>& client, const std::string& nzbpath,
+        const p2u::job_result& result)
+{
+    if (!nzbpath.empty())
+    {
+        std::ofstream nzboutstream{nzbpath.c_str()};
+        if (!nzboutstream.is_open())
+        {
+            client->send("ERROR " + std::to_string(result.job) + " Cannot open "
+                    + nzbpath + " for writing. Nzb output discarded.");
+        }
+        else
+        {
+            nzboutstream << result.nzb;
+        }
+    }
+
+    std::ostringstream done;
+    done << "DONE " << result.job << " posted " << result.posted << " of " << result.total
+        << " pieces, " << result.failed << " failed, " << result.bytes << " bytes in "
+        << result.elapsed.count() << " ms";
+    client->send(done.str());
+    client->close_after_sending();
+}
+
+int post_daemon::run()
+{
+    namespace fs = boost::filesystem;
+    namespace local = boost::asio::local;
+
+    local::stream_protocol::endpoint endpoint{m_cfg.daemon_socket};
+
+    // A socket left behind by a daemon that is gone is in the way, one that
+    // still answers is not ours to take
+    if (fs::status(m_cfg.daemon_socket).type() == fs::socket_file)
+    {
+        local::stream_protocol::socket probe{m_control};
+        boost::system::error_code ec;
+        probe.connect(endpoint, ec);
+        if (!ec)
+        {
+            std::cerr << "[ERROR] Another daemon is listening on " << m_cfg.daemon_socket << std::endl;
+            return 1;
+        }
+        ::unlink(m_cfg.daemon_socket.c_str());
+    }
+
+    try
+    {
+        m_acceptor.open(endpoint.protocol());
+        m_acceptor.bind(endpoint);
+        m_acceptor.listen();
+    }
+    catch (const boost::system::system_error& e)
+    {
+        std::cerr << "[ERROR] Cannot listen on " << m_cfg.daemon_socket << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    m_poster.set_thread_affinity(m_cfg.encoder_cpus);
+    m_poster.start();
+    m_signals.async_wait(std::bind(&post_daemon::on_signal, this, std::placeholders::_1));
+    accept();
+    std::thread control{[this]()
+            {
+                m_control.run();
+            }};
+
+    std::cerr << "[INFO] Taking jobs on " << m_cfg.daemon_socket << std::endl;
+    {
+        std::unique_lock<std::mutex> lock{m_lock};
+        m_wakeup.wait(lock, [this]()
+                {
+                    return m_stopping;
+                });
+    }
+
+    m_poster.shutdown();
+    m_poster.write_statistics(std::cerr);
+
+    // Clients that connected but never asked for anything
+    m_control.post([this]()
+            {
+                boost::system::error_code ignored;
+                m_acceptor.close(ignored);
+                m_signals.cancel(ignored);
+
+                auto sessions = m_sessions;
+                for (const auto& client : sessions)
+                {
+                    client->close();
+                }
+            });
+    m_control_work.reset();
+    control.join();
+
+    ::unlink(m_cfg.daemon_socket.c_str());
+    return m_usenet.get_queue_size() == 0 ? 0 : 1;
+}
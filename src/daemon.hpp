@@ -0,0 +1,89 @@
+#ifndef DAEMON_HPP_
+#define DAEMON_HPP_
+
+/**
+ * post2usenet as a long running process.
+ *
+ * Resolving, connecting, the TLS handshake and AUTHINFO take seconds per
+ * server, which for a small job is more than the posting itself. The daemon
+ * sets its connections up once and takes jobs over a Unix socket, one job
+ * per client connection:
+ *
+ *     subject My.Upload
+ *     group alt.binaries.test
+ *     nzb /srv/nzb/My.Upload.nzb
+ *     file /srv/upload/My.Upload
+ *     post
+ *
+ * Groups default to the ones given on the command line. Subject, nzb and
+ * order work like on the command line, paths are as the daemon sees them.
+ * The answer is "ACCEPTED <job>" or "ERROR <reason>", then a STATUS> line
+ * per piece posted and "DONE <job> ..." once the NZB is written. The client
+ * may hang up early, the job goes on.
+ *
+ * Jobs run side by side on one poster, see poster.hpp. In between, idle
+ * connections send a DATE every IdleKeepAlive seconds, so they are still
+ * there for the next job, and have TCP keepalive on unless KeepAlive says
+ * otherwise.
+ *
+ * SIGINT or SIGTERM stop taking jobs, finish the running ones and exit.
+ */
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "program_config.hpp"
+#include "poster.hpp"
+#include "nntp/usenet.hpp"
+
+class post_daemon : private boost::noncopyable
+{
+    private:
+        class session;
+
+        const prog_config& m_cfg;
+        p2u::nntp::usenet& m_usenet;
+        p2u::poster m_poster;
+
+        // Accepting, reading requests, answering and writing NZBs happen on
+        // one thread of their own, so the io threads never wait on a client
+        boost::asio::io_service m_control;
+        std::unique_ptr<boost::asio::io_service::work> m_control_work;
+        boost::asio::local::stream_protocol::acceptor m_acceptor;
+        boost::asio::signal_set m_signals;
+
+        // Only touched on the control thread
+        std::set<std::shared_ptr<session>> m_sessions;
+
+        // Set on SIGINT or SIGTERM, which run() waits for
+        std::mutex m_lock;
+        std::condition_variable m_wakeup;
+        bool m_stopping;
+
+        void accept();
+        void on_signal(const boost::system::error_code& ec);
+
+        // On the control thread. Answers the client either way.
+        void submit(const std::shared_ptr<session>& client, const prog_config& request);
+        void finish(const std::shared_ptr<session>& client, const std::string& nzbpath,
+                const p2u::job_result& result);
+
+    public:
+        /**
+         * The usenet is to be set up with its connections, but not started.
+         */
+        post_daemon(const prog_config& cfg, p2u::nntp::usenet& usenet);
+
+        /**
+         * Listens on cfg.daemon_socket and posts jobs until told to stop.
+         * Returns the exit code.
+         */
+        int run();
+};
+
+#endif
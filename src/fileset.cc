@@ -1,6 +1,35 @@
 #include "fileset.hpp"
 #include "util/make_unique.hpp"
+#include <algorithm>
+#include <boost/algorithm/string/predicate.hpp>
 #include <sstream>
+#include <stdexcept>
+
+const char* to_string(post_order order)
+{
+    switch (order)
+    {
+        case post_order::FILE_IN_ORDER:
+            return "file-in-order";
+        case post_order::SMALLEST_FIRST:
+            return "smallest-first";
+        case post_order::ROUND_ROBIN:
+            return "round-robin";
+    }
+    return "unknown";
+}
+
+post_order parse_post_order(const std::string& name)
+{
+    for (auto order : {post_order::FILE_IN_ORDER, post_order::SMALLEST_FIRST, post_order::ROUND_ROBIN})
+    {
+        if (boost::algorithm::iequals(name, to_string(order)))
+        {
+            return order;
+        }
+    }
+    throw std::runtime_error{"Unknown post order: " + name};
+}
 
 fileset::fileset(size_t article_size)
     : m_articlesize{article_size}
@@ -18,6 +47,12 @@ bool fileset::add_file(const boost::filesystem::path& p)
     return true;
 }
 
+void fileset::add_buffer(const std::string& name, chunk data)
+{
+    m_files.push_back(name);
+    m_filehandles.emplace_back(std::make_unique<p2u::util::yencgenerator>(name, std::move(data), m_articlesize, 128));
+}
+
 std::string fileset::get_file_name(size_t index) const
 {
     return m_files.at(index).filename().generic_string();
@@ -67,6 +102,63 @@ size_t fileset::get_total_pieces() const
     return ret;
 }
 
+bool fileset::is_recovery_file(size_t index) const
+{
+    return boost::algorithm::iends_with(m_files.at(index).filename().generic_string(), ".par2");
+}
+
+std::vector<filepiece_key> fileset::get_post_order(post_order order) const
+{
+    std::vector<size_t> data, recovery;
+    for (size_t i = 0; i < m_files.size(); ++i)
+    {
+        (is_recovery_file(i) ? recovery : data).push_back(i);
+    }
+
+    std::vector<filepiece_key> pieces;
+    auto arrange = [this, order, &pieces](std::vector<size_t>& files)
+    {
+        if (order == post_order::SMALLEST_FIRST)
+        {
+            std::stable_sort(files.begin(), files.end(), [this](size_t a, size_t b)
+                    {
+                        return m_filehandles[a]->size() < m_filehandles[b]->size();
+                    });
+        }
+
+        if (order == post_order::ROUND_ROBIN)
+        {
+            bool more = true;
+            for (size_t piece = 0; more; ++piece)
+            {
+                more = false;
+                for (auto file : files)
+                {
+                    if (piece < get_num_pieces(file))
+                    {
+                        pieces.push_back(filepiece_key{file, piece});
+                        more = true;
+                    }
+                }
+            }
+        }
+        else
+        {
+            for (auto file : files)
+            {
+                for (size_t piece = 0; piece < get_num_pieces(file); ++piece)
+                {
+                    pieces.push_back(filepiece_key{file, piece});
+                }
+            }
+        }
+    };
+
+    arrange(data);
+    arrange(recovery);
+    return pieces;
+}
+
 filepiece_key fileset::get_key_from_message_id(const std::string& msgid)
 {
     filepiece_key ret;
@@ -86,6 +178,15 @@ filepiece_key fileset::get_key_from_message_id(const std::string& msgid)
 
 }
 
+std::string fileset::get_nonce_from_message_id(const std::string& msgid)
+{
+    size_t start = (!msgid.empty() && msgid[0] == '<') ? 1 : 0;
+    size_t firstDot = msgid.find('.');
+    assert(firstDot != std::string::npos);
+
+    return msgid.substr(start, firstDot - start);
+}
+
 bool filepiece_key::operator<(const filepiece_key& rhs) const
 {
     if (file_index < rhs.file_index)
@@ -5,6 +5,8 @@
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "util/yencgenerator.hpp"
 
@@ -16,6 +18,26 @@ struct filepiece_key
     bool operator<(const filepiece_key& rhs) const;
 };
 
+// In which order the pieces of a job are posted. Recovery files (PAR2) go
+// last either way.
+enum class post_order
+{
+    // File by file, as given
+    FILE_IN_ORDER,
+
+    // Small files first, so e.g. NFOs and SFVs are complete early
+    SMALLEST_FIRST,
+
+    // A piece of every file in turn
+    ROUND_ROBIN
+};
+
+const char* to_string(post_order order);
+
+// "file-in-order", "smallest-first" or "round-robin". Throws
+// std::runtime_error for anything else.
+post_order parse_post_order(const std::string& name);
+
 class fileset
 {
     private:
@@ -29,11 +51,21 @@ class fileset
         fileset(size_t article_size);
 
         bool add_file(const boost::filesystem::path& p);
+
+        // A file that is only in memory, posted under name
+        void add_buffer(const std::string& name, chunk data);
         size_t get_num_pieces(size_t index) const;
         size_t get_num_files() const;
         std::string get_file_name(size_t index) const;
         size_t get_total_pieces() const;
 
+        // PAR2 volumes and the like, which are only needed if something
+        // else goes missing
+        bool is_recovery_file(size_t index) const;
+
+        // Every piece of every file, in the order they should be posted
+        std::vector<filepiece_key> get_post_order(post_order order) const;
+
         chunk get_chunk(size_t fileindex, size_t pieceindex);
         std::string get_usenet_subject(const std::string& subject, size_t fileIndex, size_t pieceIndex) const;
         static std::string get_usenet_message_id(const std::string& nonce, const std::string& domain, size_t fileIndex, size_t pieceIndex);
@@ -41,5 +73,8 @@ class fileset
         // From a message like <nonce>.<fileindex>.<pieceindex>@<host>, retrieve fileindex and pieceindex
         static filepiece_key get_key_from_message_id(const std::string& msgid);
 
+        // Same, but the nonce
+        static std::string get_nonce_from_message_id(const std::string& msgid);
+
 };
 #endif
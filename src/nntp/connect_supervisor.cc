@@ -0,0 +1,153 @@
+#include "connect_supervisor.hpp"
+#include "../util/backoff.hpp"
+#include <algorithm>
+#include <ostream>
+
+p2u::nntp::connect_supervisor::connect_supervisor(boost::asio::io_service& io_service,
+                                                  double attempts_per_second,
+                                                  int base_backoff_ms,
+                                                  int max_backoff_ms)
+    : m_iosvc(io_service),
+      m_interval{attempts_per_second > 0 ? static_cast<std::int64_t>(1000000 / attempts_per_second) : 0},
+      m_base_backoff_ms{base_backoff_ms}, m_max_backoff_ms{max_backoff_ms},
+      m_next_start{clock::now()},
+      m_rng{static_cast<std::mt19937::result_type>(clock::now().time_since_epoch().count())},
+      m_stopped{false}
+{
+
+}
+
+std::chrono::milliseconds p2u::nntp::connect_supervisor::backoff_for(unsigned int failures)
+{
+    // Must be called with m_lock held
+    return p2u::util::jittered_backoff(std::chrono::milliseconds{m_base_backoff_ms},
+            std::chrono::milliseconds{m_max_backoff_ms}, failures, m_rng);
+}
+
+bool p2u::nntp::connect_supervisor::schedule(slot_key slot, const connect_function& connect)
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+
+    if (m_stopped)
+    {
+        return false;
+    }
+
+    auto& state = m_slots[slot];
+    if (state.pending)
+    {
+        return true;
+    }
+
+    auto now = clock::now();
+    auto backoff = backoff_for(state.consecutive_failures);
+
+    if (backoff.count() > 0)
+    {
+        ++m_stats.backoffs;
+        m_stats.total_backoff_ms += backoff.count();
+        m_stats.max_backoff_ms = std::max<std::uint64_t>(m_stats.max_backoff_ms, backoff.count());
+    }
+
+    // Take the next free start slot at or after the backoff expires
+    auto start = std::max(now + backoff, m_next_start);
+    m_next_start = start + m_interval;
+    m_stats.total_pacing_ms += std::chrono::duration_cast<std::chrono::milliseconds>(start - (now + backoff)).count();
+
+    if (!state.timer)
+    {
+        state.timer.reset(new boost::asio::deadline_timer(m_iosvc));
+    }
+
+    state.pending = true;
+    state.timer->expires_from_now(boost::posix_time::microseconds(
+                std::chrono::duration_cast<std::chrono::microseconds>(start - now).count()));
+    state.timer->async_wait([this, slot, connect](const boost::system::error_code& ec)
+            {
+                {
+                    std::lock_guard<std::mutex> _lock{m_lock};
+                    auto it = m_slots.find(slot);
+                    if (ec || m_stopped || it == m_slots.end())
+                    {
+                        return;
+                    }
+                    it->second.pending = false;
+                    ++m_stats.attempts;
+                }
+
+                connect();
+            });
+    return true;
+}
+
+void p2u::nntp::connect_supervisor::on_failure(slot_key slot)
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    ++m_slots[slot].consecutive_failures;
+    ++m_stats.failures;
+}
+
+void p2u::nntp::connect_supervisor::on_success(slot_key slot)
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    auto it = m_slots.find(slot);
+    if (it != m_slots.end())
+    {
+        it->second.consecutive_failures = 0;
+    }
+}
+
+unsigned int p2u::nntp::connect_supervisor::failures(slot_key slot) const
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    auto it = m_slots.find(slot);
+    return it == m_slots.end() ? 0 : it->second.consecutive_failures;
+}
+
+std::vector<p2u::nntp::connect_supervisor::slot_key> p2u::nntp::connect_supervisor::stop()
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    m_stopped = true;
+
+    std::vector<slot_key> cancelled;
+    for (auto& p : m_slots)
+    {
+        if (p.second.pending)
+        {
+            p.second.pending = false;
+            p.second.timer->cancel();
+            cancelled.push_back(p.first);
+        }
+    }
+    return cancelled;
+}
+
+void p2u::nntp::connect_supervisor::forget(slot_key slot)
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    auto it = m_slots.find(slot);
+    if (it != m_slots.end())
+    {
+        if (it->second.timer)
+        {
+            it->second.timer->cancel();
+        }
+        m_slots.erase(it);
+    }
+}
+
+p2u::nntp::connect_supervisor::statistics p2u::nntp::connect_supervisor::get_statistics() const
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    return m_stats;
+}
+
+std::ostream& p2u::nntp::operator<<(std::ostream& stream, const connect_supervisor::statistics& stats)
+{
+    stream << "connect attempts: " << stats.attempts
+        << ", failures: " << stats.failures
+        << ", backoffs: " << stats.backoffs
+        << " (total " << stats.total_backoff_ms << " ms, max " << stats.max_backoff_ms << " ms)"
+        << ", pacing delay: " << stats.total_pacing_ms << " ms";
+    return stream;
+}
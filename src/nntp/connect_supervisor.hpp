@@ -0,0 +1,112 @@
+#ifndef NNTP_CONNECT_SUPERVISOR_HPP_
+#define NNTP_CONNECT_SUPERVISOR_HPP_
+
+/**
+ * Paces (re)connects to one server.
+ *
+ * Providers don't take kindly to a few hundred connects arriving in the same
+ * second, which is exactly what happens at startup or when a frontend
+ * hiccups and every connection errors out at once. Getting temporarily
+ * banned costs far more throughput than reconnecting a little slower.
+ *
+ * So every connect goes through here:
+ *   - Attempts are spaced out to at most ConnectRate per second, which also
+ *     brings connections back gradually after an outage.
+ *   - A slot that keeps failing waits an exponentially growing, jittered
+ *     amount of time before its next attempt. The failure count resets once
+ *     the slot does useful work again.
+ */
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+#include <chrono>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+namespace p2u
+{
+    namespace nntp
+    {
+        class connection;
+
+        class connect_supervisor : private boost::noncopyable
+        {
+            public:
+                using slot_key = const connection*;
+                using connect_function = std::function<void()>;
+
+                struct statistics
+                {
+                    size_t attempts = 0;
+                    size_t failures = 0;
+                    size_t backoffs = 0;
+                    std::uint64_t total_backoff_ms = 0;
+                    std::uint64_t max_backoff_ms = 0;
+                    std::uint64_t total_pacing_ms = 0;
+                };
+
+            private:
+                struct slot_state
+                {
+                    unsigned int consecutive_failures = 0;
+                    std::unique_ptr<boost::asio::deadline_timer> timer;
+                    bool pending = false;
+                };
+
+                using clock = std::chrono::steady_clock;
+
+                boost::asio::io_service& m_iosvc;
+                std::chrono::microseconds m_interval;
+                int m_base_backoff_ms;
+                int m_max_backoff_ms;
+
+                mutable std::mutex m_lock;
+                std::unordered_map<slot_key, slot_state> m_slots;
+                clock::time_point m_next_start;
+                std::mt19937 m_rng;
+                statistics m_stats;
+                bool m_stopped;
+
+                std::chrono::milliseconds backoff_for(unsigned int failures);
+
+            public:
+                connect_supervisor(boost::asio::io_service& io_service,
+                                   double attempts_per_second,
+                                   int base_backoff_ms,
+                                   int max_backoff_ms);
+
+                /**
+                 * Runs connect once both the server's pacing and the slot's
+                 * backoff allow it. Returns false once stopped, connect is
+                 * never run then.
+                 */
+                bool schedule(slot_key slot, const connect_function& connect);
+
+                void on_failure(slot_key slot);
+                void on_success(slot_key slot);
+
+                /**
+                 * Number of consecutive failures of this slot.
+                 */
+                unsigned int failures(slot_key slot) const;
+
+                /**
+                 * Cancels every connect that hasn't started yet, and returns
+                 * the slots they belonged to.
+                 */
+                std::vector<slot_key> stop();
+
+                void forget(slot_key slot);
+
+                statistics get_statistics() const;
+        };
+
+        std::ostream& operator<<(std::ostream& stream, const connect_supervisor::statistics& stats);
+    }
+}
+#endif
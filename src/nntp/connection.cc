@@ -14,7 +14,11 @@
 #include <boost/utility/string_ref.hpp>
 #include <boost/algorithm/string.hpp>
 #include <array>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdlib>
+#include <limits>
 
 #include "message.hpp"
 #include "connection.hpp"
@@ -27,7 +31,10 @@ const std::string p2u::nntp::protocol::POST{"POST\r\n"};
 const std::string p2u::nntp::protocol::AUTHINFOUSER{"AUTHINFO USER "};
 const std::string p2u::nntp::protocol::AUTHINFOPASS{"AUTHINFO PASS "};
 const std::string p2u::nntp::protocol::STAT{"STAT "};
+const std::string p2u::nntp::protocol::DATE{"DATE\r\n"};
 const std::string p2u::nntp::protocol::QUIT{"QUIT\r\n"};
+const std::string p2u::nntp::protocol::CAPABILITIES{"CAPABILITIES\r\n"};
+const std::string p2u::nntp::protocol::COMPRESS_DEFLATE{"COMPRESS DEFLATE\r\n"};
 
 p2u::nntp::connection::connection(boost::asio::io_service& io_service,
                                   const connection_info& conn)
@@ -38,9 +45,23 @@ p2u::nntp::connection::connection(boost::asio::io_service& io_service,
 
 p2u::nntp::connection::connection(boost::asio::io_service& io_service,
                                   const connection_info& conn, int timeout)
-    : m_sock {io_service}, m_resolver{io_service}, m_state {state::DISCONNECTED}, m_conninfo(conn),
-      m_timer{io_service}, m_timeout{timeout}
+    : m_sock {io_service}, m_state {state::DISCONNECTED}, m_conninfo(conn),
+      m_payload_compression{payload_compression::PROBE},
+      m_shaping_timer{io_service}, m_shaped_part{0}, m_shaped_offset{0}, m_shaped_bytes{0},
+      m_last_response_code{0}, m_timeout{timeout}
 {
+    m_rate_limits.push_back(std::make_shared<p2u::asio::token_bucket>(
+                conn.max_connection_upload_rate * 1024));
+
+    // Without a shared tracker every phase just gets the full timeout
+    m_latency = std::make_shared<latency_tracker>(max_timeout(), max_timeout(), 1);
+
+    set_timer_wheel(std::make_shared<p2u::asio::timer_wheel>(io_service));
+
+    // A private cache until someone shares theirs with us
+    m_resolver = std::make_shared<resolver_cache>(io_service,
+            conn.serveraddr, conn.port, conn.dns_cache_ttl);
+
     if (conn.tls)
     {
         initSSL();
@@ -61,26 +82,104 @@ void p2u::nntp::connection::initSSL()
     // Because we want the NSA to MITM us
     m_sslctx->set_verify_mode(boost::asio::ssl::verify_none);
 
-    m_sslstream = std::unique_ptr<ssl_stream>(
-            new ssl_stream(m_sock, *m_sslctx));
+    if (m_conninfo.ktls)
+    {
+        if (ktls_stream::supported())
+        {
+            ktls_stream::enable_on(*m_sslctx);
+        }
+        else
+        {
+            std::cerr << "[WARN] Kernel TLS requested but OpenSSL was built without it. Using user-space TLS." << std::endl;
+        }
+    }
 }
 
-void p2u::nntp::connection::timeout_next_async_operation(int seconds)
+void p2u::nntp::connection::reset_tls_stream()
 {
-    // Start the timer.
-    if (seconds < 1)
+    // A TLS session can't be reused on a new socket, so every connect gets
+    // a fresh stream.
+    if (m_conninfo.ktls && ktls_stream::supported())
     {
-        return;
+        m_ktlsstream = std::unique_ptr<ktls_stream>(
+                new ktls_stream(m_sock, *m_sslctx));
     }
+    else
+    {
+        m_sslstream = std::unique_ptr<ssl_stream>(
+                new ssl_stream(m_sock, *m_sslctx));
+    }
+}
+
+void p2u::nntp::connection::do_handshake()
+{
+    timeout_next_async_operation(max_timeout());
 
-    m_timer.expires_from_now(boost::posix_time::seconds(seconds));
-    m_timer.async_wait([this](const boost::system::error_code& ec)
+    auto _complete = [this](const boost::system::error_code& ec)
+    {
+        if (!ec)
+        {
+            cancel_timeout();
+
+            if (m_ktlsstream && !m_ktlsstream->kernel_send())
             {
-                if (!ec)
+                static std::atomic<bool> warned{false};
+                if (!warned.exchange(true))
                 {
-                    m_sock.cancel();
+                    std::cerr << "[WARN] Kernel refused TLS offload (is the tls module loaded?). Falling back to user-space encryption." << std::endl;
                 }
-            });
+            }
+
+            do_authenticate();
+        }
+        else
+        {
+            connect_handler_callback(connect_result::FATAL_CONNECT_ERROR);
+        }
+    };
+
+    if (m_ktlsstream)
+    {
+        m_ktlsstream->async_handshake(_complete);
+    }
+    else
+    {
+        m_sslstream->async_handshake(m_sslstream->client, _complete);
+    }
+}
+
+void p2u::nntp::connection::timeout_next_async_operation(std::chrono::milliseconds timeout)
+{
+    // Arming is cheap, the wheel only looks at it when it ticks past the
+    // deadline.
+    m_timeout_entry->arm(timeout);
+}
+
+std::chrono::milliseconds p2u::nntp::connection::max_timeout() const
+{
+    return std::chrono::seconds{m_timeout};
+}
+
+void p2u::nntp::connection::cancel_timeout()
+{
+    m_timeout_entry->disarm();
+}
+
+void p2u::nntp::connection::on_operation_timeout()
+{
+    if (m_connect_race)
+    {
+        m_latency->record_timeout(latency_phase::CONNECT,
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - m_connect_started));
+        m_connect_race->cancel();
+    }
+    else
+    {
+        // The socket may have been closed under us in the meantime
+        boost::system::error_code ignored;
+        m_sock.cancel(ignored);
+    }
 }
 
 void p2u::nntp::connection::send_authinfo_username()
@@ -127,8 +226,14 @@ void p2u::nntp::connection::check_authinfo_result(const std::string& line)
 {
     if (line[0] == '2')
     {
-        m_state = state::CONNECTED_AND_AUTHENTICATED;
-        connect_handler_callback(connect_result::CONNECT_SUCCESS);
+        if (m_conninfo.compress)
+        {
+            negotiate_compression();
+        }
+        else
+        {
+            on_authenticated();
+        }
     }
     else
     {
@@ -136,6 +241,187 @@ void p2u::nntp::connection::check_authinfo_result(const std::string& line)
     }
 }
 
+void p2u::nntp::connection::on_authenticated()
+{
+    m_state = state::CONNECTED_AND_AUTHENTICATED;
+    connect_handler_callback(connect_result::CONNECT_SUCCESS);
+}
+
+void p2u::nntp::connection::negotiate_compression()
+{
+    // RFC 8054: only if the server lists it, and only once authenticated
+    // (some servers list it before AUTHINFO but refuse it then)
+    write(boost::asio::buffer(protocol::CAPABILITIES), [this](const boost::system::error_code& ec, size_t)
+            {
+                if (ec)
+                {
+                    connect_handler_callback(connect_result::FATAL_CONNECT_ERROR);
+                    return;
+                }
+
+                read_line([this](const boost::system::error_code& ec, const std::string& line)
+                    {
+                        if (ec)
+                        {
+                            connect_handler_callback(connect_result::FATAL_CONNECT_ERROR);
+                        }
+                        else if (line[0] != '1')
+                        {
+                            // No capability list at all, an old server
+                            static std::atomic<bool> warned{false};
+                            if (!warned.exchange(true))
+                            {
+                                std::cerr << "[WARN] " << m_conninfo.serveraddr << " does not list its capabilities. Not compressing." << std::endl;
+                            }
+                            on_authenticated();
+                        }
+                        else
+                        {
+                            read_capabilities(false);
+                        }
+                    });
+            });
+}
+
+void p2u::nntp::connection::read_capabilities(bool deflate)
+{
+    read_line([this, deflate](const boost::system::error_code& ec, const std::string& line)
+            {
+                if (ec)
+                {
+                    connect_handler_callback(connect_result::FATAL_CONNECT_ERROR);
+                    return;
+                }
+
+                if (line == ".\r\n")
+                {
+                    if (deflate)
+                    {
+                        send_compress();
+                        return;
+                    }
+
+                    static std::atomic<bool> warned{false};
+                    if (!warned.exchange(true))
+                    {
+                        std::cerr << "[WARN] " << m_conninfo.serveraddr << " does not offer COMPRESS DEFLATE. Not compressing." << std::endl;
+                    }
+                    on_authenticated();
+                    return;
+                }
+
+                read_capabilities(deflate || (boost::istarts_with(line, "COMPRESS") &&
+                            boost::icontains(line, "DEFLATE")));
+            });
+}
+
+void p2u::nntp::connection::send_compress()
+{
+    write(boost::asio::buffer(protocol::COMPRESS_DEFLATE), [this](const boost::system::error_code& ec, size_t)
+            {
+                if (ec)
+                {
+                    connect_handler_callback(connect_result::FATAL_CONNECT_ERROR);
+                    return;
+                }
+
+                read_line([this](const boost::system::error_code& ec, const std::string& line)
+                    {
+                        if (ec)
+                        {
+                            connect_handler_callback(connect_result::FATAL_CONNECT_ERROR);
+                            return;
+                        }
+
+                        if (boost::starts_with(line, "206"))
+                        {
+                            // Everything after the 206 line is compressed
+                            start_compression();
+                        }
+                        else
+                        {
+                            std::cerr << "[WARN] " << m_conninfo.serveraddr << " refused COMPRESS DEFLATE: " << line;
+                        }
+                        on_authenticated();
+                    });
+            });
+}
+
+void p2u::nntp::connection::start_compression()
+{
+    auto read = [this](boost::asio::mutable_buffer buffer, const p2u::asio::deflate_stream::io_handler& handler)
+    {
+        if (m_ktlsstream)
+        {
+            m_ktlsstream->async_read_some(boost::asio::buffer(buffer), handler);
+        }
+        else if (m_sslstream)
+        {
+            m_sslstream->async_read_some(boost::asio::buffer(buffer), handler);
+        }
+        else
+        {
+            m_sock.async_read_some(boost::asio::buffer(buffer), handler);
+        }
+    };
+
+    auto write = [this](boost::asio::const_buffer buffer, const p2u::asio::deflate_stream::io_handler& handler)
+    {
+        if (m_ktlsstream)
+        {
+            boost::asio::async_write(*m_ktlsstream, boost::asio::buffer(buffer), handler);
+        }
+        else if (m_sslstream)
+        {
+            boost::asio::async_write(*m_sslstream, boost::asio::buffer(buffer), handler);
+        }
+        else
+        {
+            boost::asio::async_write(m_sock, boost::asio::buffer(buffer), handler);
+        }
+    };
+
+    m_deflatestream.reset(new p2u::asio::deflate_stream(m_sock, read, write));
+    m_payload_compression = payload_compression::PROBE;
+    ++m_compression.sessions;
+}
+
+void p2u::nntp::connection::end_compression()
+{
+    if (m_deflatestream)
+    {
+        m_compression.bytes += m_deflatestream->get_statistics();
+        m_deflatestream.reset();
+    }
+}
+
+void p2u::nntp::connection::after_payload(const p2u::asio::compression_statistics& before)
+{
+    if (!m_deflatestream)
+    {
+        return;
+    }
+
+    // Back to compressing commands
+    m_deflatestream->set_level(Z_DEFAULT_COMPRESSION);
+
+    if (m_payload_compression == payload_compression::PROBE)
+    {
+        const auto& after = m_deflatestream->get_statistics();
+        double raw = static_cast<double>(after.sent - before.sent);
+        double compressed = static_cast<double>(after.sent_compressed - before.sent_compressed);
+        if (raw > 0 && compressed <= raw * PAYLOAD_COMPRESSION_WIN)
+        {
+            m_payload_compression = payload_compression::ON;
+            ++m_compression.payload_sessions;
+        }
+        else
+        {
+            m_payload_compression = payload_compression::OFF;
+        }
+    }
+}
+
 void p2u::nntp::connection::send_authinfo_password()
 {
     std::array<boost::asio::const_buffer, 3> parts {
@@ -199,58 +485,125 @@ void p2u::nntp::connection::do_connect()
     boost::system::error_code ec;
 
     m_state = state::CONNECTING;
+    end_compression();
+
+    if (m_sslctx)
+    {
+        reset_tls_stream();
+    }
 
-    tcp::resolver::query query(m_conninfo.serveraddr, "");
+    m_resolver->async_resolve(get_io_service(),
+            [this](const boost::system::error_code& ec, const resolver_cache::endpoint_list& endpoints)
+            {
+                if (!ec && !endpoints.empty())
+                {
+                    start_connect_race(endpoints);
+                }
+                else
+                {
+                    connect_handler_callback(connect_result::FATAL_CONNECT_ERROR);
+                }
+            });
+}
 
+void p2u::nntp::connection::start_connect_race(const resolver_cache::endpoint_list& endpoints)
+{
+    // Every connection starts on a different address so that we spread over
+    // the provider's frontends. The others are only tried if that one is slow
+    // to answer or dead.
+    auto ordered = endpoints;
+    std::rotate(ordered.begin(),
+            ordered.begin() + (m_resolver->next_offset() % ordered.size()),
+            ordered.end());
 
-    m_resolver.async_resolve(query,
-            [this](const boost::system::error_code& ec, boost::asio::ip::tcp::resolver::iterator resolvit)
+    m_connect_started = std::chrono::steady_clock::now();
+    m_connect_race = p2u::asio::connect_race::start(get_io_service(), ordered,
+            boost::posix_time::milliseconds(CONNECT_STAGGER_MS),
+            [this](const boost::system::error_code& ec, p2u::asio::connect_race::socket_ptr sock)
             {
+                m_connect_race.reset();
+                cancel_timeout();
+
                 if (!ec)
                 {
-                    tcp::endpoint endpoint(resolvit->endpoint().address(), m_conninfo.port);
-                    timeout_next_async_operation(m_timeout);
-                    m_sock.async_connect(endpoint, [this](const boost::system::error_code& ec)
-                        {
-                            if (!ec)
-                            {
-                                // Connect successful, try authenticating
-                                m_timer.cancel();
+                    m_latency->record(latency_phase::CONNECT,
+                            std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - m_connect_started));
+                    m_sock = std::move(*sock);
 
-                                if (m_sslstream)
-                                {
-                                    // Need to handshake first
-                                    timeout_next_async_operation(m_timeout);
-                                    m_sslstream->async_handshake(m_sslstream->client,
-                                        [this](const boost::system::error_code& ec)
-                                        {
-                                            if (!ec)
-                                            {
-                                                m_timer.cancel();
-                                                do_authenticate();
-                                            }
-                                            else
-                                            {
-                                                connect_handler_callback(connect_result::FATAL_CONNECT_ERROR);
-                                            }
-                                        });
-                                }
-                                else
-                                {
-                                    do_authenticate();
-                                }
-                            }
-                            else
-                            {
-                                connect_handler_callback(connect_result::FATAL_CONNECT_ERROR);
-                            }
-                        });
+                    if (m_sslctx)
+                    {
+                        // Need to handshake first
+                        do_handshake();
+                    }
+                    else
+                    {
+                        do_authenticate();
+                    }
                 }
                 else
                 {
+                    if (ec != boost::asio::error::operation_aborted)
+                    {
+                        // Every address failed, the records may be stale
+                        m_resolver->invalidate();
+                    }
                     connect_handler_callback(connect_result::FATAL_CONNECT_ERROR);
                 }
-            });
+            },
+            std::bind(&p2u::nntp::connection::setup_socket, this, std::placeholders::_1));
+
+    timeout_next_async_operation(m_latency->timeout_for(latency_phase::CONNECT));
+}
+
+boost::system::error_code p2u::nntp::connection::setup_socket(tcp::socket& sock)
+{
+    boost::system::error_code ec;
+    if (!m_bind_address.is_unspecified())
+    {
+        // Unbound, but it already knows its family
+        auto local = sock.local_endpoint(ec);
+        if (ec)
+        {
+            return ec;
+        }
+
+        // Only the addresses of the same family can be raced from here
+        if (m_bind_address.is_v4() != local.address().is_v4())
+        {
+            return boost::asio::error::address_family_not_supported;
+        }
+
+        sock.bind(tcp::endpoint{m_bind_address, 0}, ec);
+        if (ec)
+        {
+            return ec;
+        }
+    }
+
+    auto failed = p2u::asio::apply_socket_options(sock, m_conninfo.socket);
+
+    // Lets the kernel spread each chunk of a rate limited article over the
+    // wire instead of sending it as one burst
+    auto own_rate = m_rate_limits.front()->get_rate();
+    if (own_rate > 0)
+    {
+        p2u::asio::set_max_pacing_rate(sock, own_rate);
+    }
+    if (!failed.empty())
+    {
+        // Same profile on every connection, so it would fail the same way
+        static std::atomic<bool> warned{false};
+        if (!warned.exchange(true))
+        {
+            for (const auto& option : failed)
+            {
+                std::cerr << "[WARN] Could not set socket option " << option << std::endl;
+            }
+        }
+    }
+
+    return ec;
 }
 
 void p2u::nntp::connection::async_connect()
@@ -286,14 +639,20 @@ void p2u::nntp::connection::do_post()
             {
                 if (!ec)
                 {
-                    read_line([this](const boost::system::error_code& ec, const std::string& line)
+                    read_response(latency_phase::POST_ACK, [this](const boost::system::error_code& ec, const std::string& line)
                     {
                         if (!ec)
                         {
-                            if (line[0] == '4')
+                            m_last_response_code = std::atoi(line.c_str());
+                            if (m_last_response_code == 440)
                             {
                                 post_handler_callback(post_result::POSTING_NOT_PERMITTED);
                             }
+                            else if (line[0] != '3')
+                            {
+                                // e.g. 480 or 400, the caller decides by code
+                                post_handler_callback(post_result::POST_FAILURE);
+                            }
                             else
                             {
                                 send_article();
@@ -326,16 +685,32 @@ void p2u::nntp::connection::send_article()
     m_article->write_payload_asio_buffers(std::back_inserter(m_send_parts));
     m_send_parts.push_back(boost::asio::buffer(protocol::MESSAGE_TERM));
 
-    write(m_send_parts, [this](const boost::system::error_code& ec, size_t)
+    p2u::asio::compression_statistics compression_before;
+    if (m_deflatestream)
+    {
+        m_deflatestream->set_level(m_payload_compression == payload_compression::OFF ?
+                Z_NO_COMPRESSION : Z_DEFAULT_COMPRESSION);
+        compression_before = m_deflatestream->get_statistics();
+    }
+
+    m_article_started = std::chrono::steady_clock::now();
+    shaped_write([this, compression_before](const boost::system::error_code& ec, size_t bytes_transferred)
             {
                 if (!ec)
                 {
-                    read_line([this](const boost::system::error_code& ec, const std::string& line)
+                    after_payload(compression_before);
+
+                    read_response(latency_phase::ARTICLE_ACK, [this, bytes_transferred](const boost::system::error_code& ec, const std::string& line)
                         {
                             if (!ec)
                             {
+                                m_last_response_code = std::atoi(line.c_str());
                                 if (line[0] == '2')
                                 {
+                                    ++m_transfer.articles;
+                                    m_transfer.bytes += bytes_transferred;
+                                    m_transfer.busy += std::chrono::duration_cast<std::chrono::milliseconds>(
+                                            std::chrono::steady_clock::now() - m_article_started);
                                     post_handler_callback(post_result::POST_SUCCESS);
                                 }
                                 else
@@ -346,7 +721,7 @@ void p2u::nntp::connection::send_article()
                             }
                             else
                             {
-                                post_handler_callback(post_result::POST_FAILURE_CONNECTION_ERROR);
+                                post_handler_callback(post_result::POST_FAILURE_UNACKNOWLEDGED);
                             }
                         });
                 }
@@ -357,6 +732,126 @@ void p2u::nntp::connection::send_article()
             });
 }
 
+size_t p2u::nntp::connection::shaping_chunk_size() const
+{
+    std::uint64_t tightest = 0;
+    for (const auto& limit : m_rate_limits)
+    {
+        auto rate = limit->get_rate();
+        if (rate > 0 && (tightest == 0 || rate < tightest))
+        {
+            tightest = rate;
+        }
+    }
+
+    if (tightest == 0)
+    {
+        return 0;
+    }
+
+    size_t chunk = static_cast<size_t>(tightest * SHAPING_INTERVAL_MS / 1000);
+    return std::max(MIN_SHAPING_CHUNK, std::min(MAX_SHAPING_CHUNK, chunk));
+}
+
+std::chrono::microseconds p2u::nntp::connection::take_tokens(size_t bytes)
+{
+    // Every bucket is charged, the tightest one decides the wait
+    std::chrono::microseconds wait{0};
+    for (auto& limit : m_rate_limits)
+    {
+        wait = std::max(wait, limit->take(bytes));
+    }
+    return wait;
+}
+
+void p2u::nntp::connection::shaped_write(const write_handler& handler)
+{
+    if (shaping_chunk_size() == 0)
+    {
+        // Unlimited, no need to cut it up
+        write(m_send_parts, handler);
+        return;
+    }
+
+    m_shaped_handler = handler;
+    m_shaped_part = 0;
+    m_shaped_offset = 0;
+    m_shaped_bytes = 0;
+    write_next_chunk();
+}
+
+void p2u::nntp::connection::write_next_chunk()
+{
+    // Limits may be changed or lifted halfway through an article
+    size_t chunk_size = shaping_chunk_size();
+    if (chunk_size == 0)
+    {
+        chunk_size = std::numeric_limits<size_t>::max();
+    }
+
+    m_shaped_chunk.clear();
+    size_t length = 0;
+    while (m_shaped_part < m_send_parts.size() && length < chunk_size)
+    {
+        const auto& part = m_send_parts[m_shaped_part];
+        size_t part_size = boost::asio::buffer_size(part);
+        size_t n = std::min(part_size - m_shaped_offset, chunk_size - length);
+        m_shaped_chunk.push_back(boost::asio::buffer(part + m_shaped_offset, n));
+        length += n;
+        m_shaped_offset += n;
+        if (m_shaped_offset == part_size)
+        {
+            ++m_shaped_part;
+            m_shaped_offset = 0;
+        }
+    }
+
+    if (length == 0)
+    {
+        auto handler = m_shaped_handler;
+        m_shaped_handler = nullptr;
+        handler(boost::system::error_code{}, m_shaped_bytes);
+        return;
+    }
+
+    auto send = [this]()
+    {
+        write(m_shaped_chunk, [this](const boost::system::error_code& ec, size_t bytes_transferred)
+                {
+                    m_shaped_bytes += bytes_transferred;
+                    if (ec)
+                    {
+                        auto handler = m_shaped_handler;
+                        m_shaped_handler = nullptr;
+                        handler(ec, m_shaped_bytes);
+                        return;
+                    }
+                    write_next_chunk();
+                });
+    };
+
+    auto wait = take_tokens(length);
+    if (wait.count() == 0)
+    {
+        send();
+        return;
+    }
+
+    m_shaping_timer.expires_from_now(boost::posix_time::microseconds(wait.count()));
+    m_shaping_timer.async_wait([this, send](const boost::system::error_code& ec)
+            {
+                if (ec)
+                {
+                    // Closed while waiting for our turn
+                    auto handler = m_shaped_handler;
+                    m_shaped_handler = nullptr;
+                    handler(ec, m_shaped_bytes);
+                    return;
+                }
+                send();
+            });
+}
+
 void p2u::nntp::connection::set_post_handler(const post_handler& handler)
 {
     m_posthandler = handler;
@@ -372,6 +867,47 @@ void p2u::nntp::connection::set_stat_handler(const stat_handler& handler)
     m_stathandler = handler;
 }
 
+void p2u::nntp::connection::set_keepalive_handler(const keepalive_handler& handler)
+{
+    m_keepalivehandler = handler;
+}
+
+void p2u::nntp::connection::set_resolver_cache(const std::shared_ptr<resolver_cache>& cache)
+{
+    m_resolver = cache;
+}
+
+void p2u::nntp::connection::set_latency_tracker(const std::shared_ptr<latency_tracker>& tracker)
+{
+    m_latency = tracker;
+}
+
+void p2u::nntp::connection::add_rate_limit(const std::shared_ptr<p2u::asio::token_bucket>& limit)
+{
+    m_rate_limits.push_back(limit);
+}
+
+void p2u::nntp::connection::set_rate_limit(std::uint64_t bytes_per_second)
+{
+    m_rate_limits.front()->set_rate(bytes_per_second);
+    if (m_sock.is_open())
+    {
+        // Best effort, the bucket is what actually enforces it
+        p2u::asio::set_max_pacing_rate(m_sock, bytes_per_second);
+    }
+}
+
+void p2u::nntp::connection::set_timer_wheel(const std::shared_ptr<p2u::asio::timer_wheel>& wheel)
+{
+    m_timeout_entry.reset();
+    m_wheel = wheel;
+    m_timeout_entry.reset(new p2u::asio::timer_wheel::entry(*m_wheel,
+                [this]()
+                {
+                    on_operation_timeout();
+                }));
+}
+
 bool p2u::nntp::connection::async_post(const std::shared_ptr<article>& message)
 {
     if (m_state != state::CONNECTED_AND_AUTHENTICATED)
@@ -419,7 +955,7 @@ void p2u::nntp::connection::do_stat()
     {
         if (!ec)
         {
-            read_line([this](const boost::system::error_code& ec, const std::string& line)
+            read_response(latency_phase::STAT, [this](const boost::system::error_code& ec, const std::string& line)
                 {
                     if (!ec)
                     {
@@ -461,12 +997,68 @@ bool p2u::nntp::connection::async_stat(const std::string& mid)
     return true;
 }
 
+void p2u::nntp::connection::keepalive_handler_callback(bool alive)
+{
+    m_state = state::CONNECTED_AND_AUTHENTICATED;
+    get_io_service().post([this, alive]()
+            {
+                if (m_keepalivehandler)
+                {
+                    m_keepalivehandler(alive);
+                }
+            });
+}
+
+void p2u::nntp::connection::do_keepalive()
+{
+    m_state = state::BUSY;
+
+    write(boost::asio::buffer(protocol::DATE), [this](const boost::system::error_code& ec, size_t)
+    {
+        if (ec)
+        {
+            keepalive_handler_callback(false);
+            return;
+        }
+
+        // As quick to answer as a STAT, but not worth learning from
+        read_line(m_latency->timeout_for(latency_phase::STAT), [this](const boost::system::error_code& ec, const std::string& line)
+            {
+                // 111 and the server's time, or a 5xx from a server that
+                // doesn't know DATE, is still a session. One the server
+                // gave up on usually gets a 400 first.
+                keepalive_handler_callback(!ec && !line.empty() && line[0] != '4');
+            });
+    });
+}
+
+bool p2u::nntp::connection::async_keepalive()
+{
+    if (m_state != state::CONNECTED_AND_AUTHENTICATED)
+    {
+        return false;
+    }
+
+    get_io_service().post([this](){ do_keepalive(); });
+    return true;
+}
+
 
 void p2u::nntp::connection::close()
 {
     if (m_state == state::DISCONNECTED)
         return;
 
+    cancel_timeout();
+
+    boost::system::error_code ignored;
+    m_shaping_timer.cancel(ignored);
+
+    if (m_connect_race)
+    {
+        m_connect_race->cancel();
+    }
+
     try
     {
         m_sock.shutdown(tcp::socket::shutdown_both);
@@ -477,6 +1069,8 @@ void p2u::nntp::connection::close()
         // Ignore any exceptions that may occur :(
     }
 
+    end_compression();
+
     // Consume any leftover data in the readbuf
     size_t data_left = m_readbuf.size();
     if (data_left > 0)
@@ -492,6 +1086,41 @@ boost::asio::io_service& p2u::nntp::connection::get_io_service()
     return m_sock.get_io_service();
 }
 
+const p2u::nntp::connection_info& p2u::nntp::connection::get_connection_info() const
+{
+    return m_conninfo;
+}
+
+p2u::nntp::compression_report p2u::nntp::connection::get_compression_report() const
+{
+    auto report = m_compression;
+    if (m_deflatestream)
+    {
+        report.bytes += m_deflatestream->get_statistics();
+    }
+    return report;
+}
+
+const p2u::nntp::transfer_statistics& p2u::nntp::connection::get_transfer_statistics() const
+{
+    return m_transfer;
+}
+
+int p2u::nntp::connection::get_last_response_code() const
+{
+    return m_last_response_code;
+}
+
+void p2u::nntp::connection::set_bind_address(const boost::asio::ip::address& address)
+{
+    m_bind_address = address;
+}
+
+const boost::asio::ip::address& p2u::nntp::connection::get_bind_address() const
+{
+    return m_bind_address;
+}
+
 
 void p2u::nntp::connection::cancel_sock_operation(const boost::system::error_code& ec)
 {
@@ -5,6 +5,13 @@
 #include <boost/asio/spawn.hpp>
 #include <boost/asio/ssl/stream.hpp>
 #include "../util/asio_helpers.hpp"
+#include "../util/ktls_stream.hpp"
+#include "../util/connect_race.hpp"
+#include "../util/timer_wheel.hpp"
+#include "../util/token_bucket.hpp"
+#include "../util/deflate_stream.hpp"
+#include "resolver_cache.hpp"
+#include "latency_tracker.hpp"
 
 
 using namespace boost::asio::ip;
@@ -22,17 +29,38 @@ namespace p2u
             extern const std::string AUTHINFOUSER;
             extern const std::string AUTHINFOPASS;
             extern const std::string STAT;
+            extern const std::string DATE;
             extern const std::string QUIT;
+            extern const std::string CAPABILITIES;
+            extern const std::string COMPRESS_DEFLATE;
         }
 
         class article;
 
+        // How long to wait on one address before also trying the next one
+        const int CONNECT_STAGGER_MS = 250;
+
+        // A rate limited article goes out in chunks of about this many
+        // milliseconds worth of the tightest limit
+        const int SHAPING_INTERVAL_MS = 20;
+        const size_t MIN_SHAPING_CHUNK = 4 * 1024;
+        const size_t MAX_SHAPING_CHUNK = 256 * 1024;
+
+        // On a compressed session, articles stay compressed only if the
+        // first one shrank to this fraction of its size or less. yEnc
+        // usually doesn't, and then the CPU is better spent elsewhere.
+        const double PAYLOAD_COMPRESSION_WIN = 0.9;
+
         enum class post_result
         {
             POST_SUCCESS,
             POSTING_NOT_PERMITTED,
             POST_FAILURE,
-            POST_FAILURE_CONNECTION_ERROR
+            POST_FAILURE_CONNECTION_ERROR,
+
+            // The whole article went out but the response never came. The
+            // server may well have it.
+            POST_FAILURE_UNACKNOWLEDGED
         };
 
         enum class connect_result
@@ -50,10 +78,38 @@ namespace p2u
         };
 
 
+        // What one connection achieved while it was actually posting
+        struct transfer_statistics
+        {
+            size_t articles = 0;
+            std::uint64_t bytes = 0;
+
+            // From the first byte of an article to its acknowledgement
+            std::chrono::milliseconds busy{0};
+        };
+
+        // What COMPRESS DEFLATE did for a connection, over all its sessions
+        struct compression_report
+        {
+            p2u::asio::compression_statistics bytes;
+            size_t sessions = 0;
+
+            // Sessions that kept compressing articles, not just commands
+            size_t payload_sessions = 0;
+        };
+
         class connection : private boost::noncopyable
         {
             using ssl_context = boost::asio::ssl::context;
             using ssl_stream = boost::asio::ssl::stream<tcp::socket&>;
+            using ktls_stream = p2u::asio::ktls_stream;
+
+            enum class payload_compression
+            {
+                PROBE,
+                ON,
+                OFF
+            };
 
             enum class state
             {
@@ -65,9 +121,11 @@ namespace p2u
             };
 
             public:
+                using write_handler = std::function<void(const boost::system::error_code&, size_t)>;
                 using connect_handler = std::function<void(connect_result)>;
                 using post_handler = std::function<void(const std::shared_ptr<article>&, post_result)>;
                 using stat_handler = std::function<void(const std::string& msgid, stat_result)>;
+                using keepalive_handler = std::function<void(bool alive)>;
 
             private:
                 /**
@@ -101,55 +159,147 @@ namespace p2u
                 };
 
                 tcp::socket m_sock;
-                tcp::resolver m_resolver;
+                std::shared_ptr<resolver_cache> m_resolver;
+                std::shared_ptr<p2u::asio::connect_race> m_connect_race;
+                std::shared_ptr<latency_tracker> m_latency;
+                std::chrono::steady_clock::time_point m_connect_started;
+                boost::asio::ip::address m_bind_address;
                 state m_state; // because boost MSL would be overkill
                 const connection_info& m_conninfo;
                 boost::asio::streambuf m_readbuf;
                 std::unique_ptr<ssl_context> m_sslctx;
                 std::unique_ptr<ssl_stream> m_sslstream;
 
-                boost::asio::deadline_timer m_timer;
+                // Only used when kernel TLS was requested. Exactly one of
+                // m_sslstream and m_ktlsstream is set on a TLS connection.
+                std::unique_ptr<ktls_stream> m_ktlsstream;
+
+                // On top of whichever of the above, once the server agreed
+                // to COMPRESS DEFLATE. Reset on every connect.
+                std::unique_ptr<p2u::asio::deflate_stream> m_deflatestream;
+                payload_compression m_payload_compression;
+                compression_report m_compression;
+
+                // Declared before the entry, which has to go first
+                std::shared_ptr<p2u::asio::timer_wheel> m_wheel;
+                std::unique_ptr<p2u::asio::timer_wheel::entry> m_timeout_entry;
 
                 connect_handler m_connecthandler;
                 post_handler m_posthandler;
                 stat_handler m_stathandler;
+                keepalive_handler m_keepalivehandler;
 
                 std::shared_ptr<article> m_article;
+                std::chrono::steady_clock::time_point m_article_started;
+                transfer_statistics m_transfer;
                 std::vector<boost::asio::const_buffer> m_send_parts;
                 std::string m_postheader;
 
+                // Every limit an article has to fit under. The first one is
+                // this connection's own.
+                std::vector<std::shared_ptr<p2u::asio::token_bucket>> m_rate_limits;
+                boost::asio::deadline_timer m_shaping_timer;
+
+                // Progress of a chunked write of m_send_parts
+                std::vector<boost::asio::const_buffer> m_shaped_chunk;
+                size_t m_shaped_part;
+                size_t m_shaped_offset;
+                size_t m_shaped_bytes;
+                write_handler m_shaped_handler;
+
                 std::string m_msgid;
 
+                // Of the last POST, so failures can be told apart
+                int m_last_response_code;
+
                 int m_timeout;
                 int m_numtries;
 
                 void do_connect();
+                void start_connect_race(const resolver_cache::endpoint_list& endpoints);
+                boost::system::error_code setup_socket(tcp::socket& sock);
 
                 void do_authenticate();
+                void on_authenticated();
+
+                void negotiate_compression();
+                void read_capabilities(bool deflate);
+                void send_compress();
+                void start_compression();
+                void end_compression();
+                void after_payload(const p2u::asio::compression_statistics& before);
 
                 void do_post();
                 void send_article();
+
+                size_t shaping_chunk_size() const;
+                std::chrono::microseconds take_tokens(size_t bytes);
+                void shaped_write(const write_handler& handler);
+                void write_next_chunk();
                 void do_stat();
+                void do_keepalive();
 
                 void initSSL();
+                void reset_tls_stream();
+                void do_handshake();
 
 
                 template <class CompletionHandler>
                 void read_line(CompletionHandler handler)
                 {
+                    read_line(max_timeout(), handler);
+                }
+
+                /**
+                 * Reads a server response to something we just sent, with a
+                 * timeout learned from how long this phase usually takes.
+                 */
+                template <class CompletionHandler>
+                void read_response(latency_phase phase, CompletionHandler handler)
+                {
+                    auto timeout = m_latency->timeout_for(phase);
+                    auto started = std::chrono::steady_clock::now();
+
+                    read_line(timeout, [this, phase, started, handler](const boost::system::error_code& ec, const std::string& line)
+                            {
+                                auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                        std::chrono::steady_clock::now() - started);
+                                if (!ec)
+                                {
+                                    m_latency->record(phase, waited);
+                                }
+                                else if (ec == boost::asio::error::operation_aborted)
+                                {
+                                    m_latency->record_timeout(phase, waited);
+                                }
+
+                                handler(ec, line);
+                            });
+                }
 
-                    timeout_next_async_operation(m_timeout);
+                template <class CompletionHandler>
+                void read_line(std::chrono::milliseconds timeout, CompletionHandler handler)
+                {
+                    timeout_next_async_operation(timeout);
                     auto _dispatch = [this,handler](const boost::system::error_code& ec, const std::string& line)
                     {
                         if (!ec)
                         {
-                            m_timer.cancel();
+                            cancel_timeout();
                         }
 
                         handler(ec, line);
                     };
 
-                    if (m_sslstream)
+                    if (m_deflatestream)
+                    {
+                        p2u::asio::async_read_line(*m_deflatestream, m_readbuf, _dispatch);
+                    }
+                    else if (m_ktlsstream)
+                    {
+                        p2u::asio::async_read_line(*m_ktlsstream, m_readbuf, _dispatch);
+                    }
+                    else if (m_sslstream)
                     {
                         p2u::asio::async_read_line(*m_sslstream, m_readbuf, _dispatch);
                     } else
@@ -158,21 +308,32 @@ namespace p2u
                     }
                 }
 
-                void timeout_next_async_operation(int seconds);
+                void timeout_next_async_operation(std::chrono::milliseconds timeout);
+                std::chrono::milliseconds max_timeout() const;
+                void cancel_timeout();
+                void on_operation_timeout();
                 void cancel_sock_operation(const boost::system::error_code& ec);
 
                 template <class ConstBufferSequence, class CompletionHandler>
                 void write(const ConstBufferSequence& buffers, CompletionHandler completion_handler)
                 {
-                    timeout_next_async_operation(m_timeout);
+                    timeout_next_async_operation(max_timeout());
 
                     auto _complete = [this,completion_handler](const boost::system::error_code& ec, size_t bytes_transferred)
                     {
-                        m_timer.cancel();
+                        cancel_timeout();
                         completion_handler(ec, bytes_transferred);
                     };
 
-                    if (m_sslstream)
+                    if (m_deflatestream)
+                    {
+                        m_deflatestream->async_write(buffers, _complete);
+                    }
+                    else if (m_ktlsstream)
+                    {
+                        boost::asio::async_write(*m_ktlsstream, buffers, _complete);
+                    }
+                    else if (m_sslstream)
                     {
                         boost::asio::async_write(*m_sslstream, buffers, _complete);
                     }
@@ -190,6 +351,7 @@ namespace p2u
                 void post_handler_callback(post_result result);
                 void connect_handler_callback(connect_result result);
                 void stat_handler_callback(stat_result result);
+                void keepalive_handler_callback(bool alive);
 
             public:
                 connection(boost::asio::io_service& io_service,
@@ -200,15 +362,74 @@ namespace p2u
                 void set_post_handler(const post_handler& handler);
                 void set_connect_handler(const connect_handler& handler);
                 void set_stat_handler(const stat_handler& handler);
+                void set_keepalive_handler(const keepalive_handler& handler);
+
+                /**
+                 * Share one address cache between all connections to the same
+                 * server.
+                 */
+                void set_resolver_cache(const std::shared_ptr<resolver_cache>& cache);
+
+                /**
+                 * Track timeouts on a wheel shared with the other connections
+                 * of this io_service. Must not be called while an operation
+                 * is in flight.
+                 */
+                void set_timer_wheel(const std::shared_ptr<p2u::asio::timer_wheel>& wheel);
+
+                /**
+                 * Share learned response times with the other connections to
+                 * the same server.
+                 */
+                void set_latency_tracker(const std::shared_ptr<latency_tracker>& tracker);
+
+                /**
+                 * Makes articles also fit under a limit shared with other
+                 * connections, e.g. all of one server's.
+                 */
+                void add_rate_limit(const std::shared_ptr<p2u::asio::token_bucket>& limit);
+
+                /**
+                 * Limits this connection alone, in bytes per second. Zero
+                 * lifts the limit. Must be called on the io_service thread.
+                 */
+                void set_rate_limit(std::uint64_t bytes_per_second);
+
+                /**
+                 * Send from this local address instead of letting the
+                 * kernel choose. Takes effect on the next connect.
+                 */
+                void set_bind_address(const boost::asio::ip::address& address);
+                const boost::asio::ip::address& get_bind_address() const;
 
                 void async_connect();
                 bool async_post(const std::shared_ptr<article>& message);
 
                 bool async_stat(const std::string& messageid);
+
+                /**
+                 * Sends a DATE on an idle connection, so the server doesn't
+                 * drop the session and a dropped one shows before it is
+                 * needed. The handler learns whether it answered.
+                 */
+                bool async_keepalive();
                 void close();
 
                 void async_graceful_disconnect();
                 boost::asio::io_service& get_io_service();
+                const connection_info& get_connection_info() const;
+                const transfer_statistics& get_transfer_statistics() const;
+
+                /**
+                 * Including the session that is still open, if any
+                 */
+                compression_report get_compression_report() const;
+
+                /**
+                 * The server's reply code to the last POST or article.
+                 * Valid when the post handler runs.
+                 */
+                int get_last_response_code() const;
                 ~connection();
         };
     }
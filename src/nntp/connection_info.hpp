@@ -2,12 +2,22 @@
 #define NNTP_CONNECTION_INFO_HPP_
 
 #include <cstdint>
+#include <vector>
+#include <boost/asio/ip/address.hpp>
 #include <boost/functional/hash.hpp>
+#include "../util/socket_options.hpp"
 
 namespace p2u
 {
     namespace nntp
     {
+        // A local address to send from, weight relative to the others
+        struct bind_address
+        {
+            boost::asio::ip::address address;
+            unsigned int weight = 1;
+        };
+
         struct connection_info
         {
             std::string username;
@@ -15,6 +25,60 @@ namespace p2u
             std::string serveraddr;
             std::uint16_t port;
             bool tls;
+
+            // Hand TLS record encryption to the kernel after the handshake
+            bool ktls = false;
+
+            // Negotiate COMPRESS DEFLATE (RFC 8054) if the server offers it
+            bool compress = false;
+
+            // How long resolved addresses are reused, in seconds
+            int dns_cache_ttl = 300;
+
+            // Connect pacing and backoff, see connect_supervisor
+            double connect_rate = 10;
+            int connect_backoff_ms = 1000;
+            int max_connect_backoff_ms = 60000;
+            unsigned int max_connect_failures = 5;
+
+            // How many of the connections are kept connected in reserve
+            unsigned int spare_connections = 0;
+
+            // Connections idle this many seconds, e.g. between the jobs of a
+            // daemon, send a DATE so the server keeps the session and a
+            // dropped one is reconnected before it's needed. Zero turns it
+            // off.
+            int idle_keepalive = 60;
+
+            // Start with this many posting connections and add more, up to
+            // the configured number, while they pay off. See
+            // connection_ramp. Zero uses all of them from the start.
+            unsigned int initial_connections = 0;
+
+            // Recycle a connection after recycle_after articles in a row
+            // below recycle_below times its server's median rate
+            double recycle_below = 0.2;
+            unsigned int recycle_after = 3;
+
+            // At the end of a job, posts taking longer than this percentile
+            // of the server's recent posts are raced on an idle connection.
+            // Zero turns it off.
+            double hedge_percentile = 0.9;
+
+            // Upload caps in KB/s for all connections to this server
+            // together and for each one on its own. Zero is unlimited.
+            std::uint64_t max_upload_rate = 0;
+            std::uint64_t max_connection_upload_rate = 0;
+
+            // Learned per-phase timeouts, see latency_tracker
+            int min_timeout_ms = 2000;
+            double timeout_multiplier = 4;
+
+            p2u::asio::socket_options socket;
+
+            // Connections are spread over these by weight. Empty lets the
+            // kernel pick the source address.
+            std::vector<bind_address> bind_addresses;
         };
 
         bool operator==(const connection_info& first,
@@ -0,0 +1,137 @@
+#include "connection_ramp.hpp"
+#include <algorithm>
+#include <ostream>
+
+namespace
+{
+    // Gain in goodput a new connection has to bring to stay
+    const double MIN_GAIN = 0.05;
+
+    // Posts per connection a measurement has to cover
+    const size_t MIN_POSTS_PER_CONNECTION = 2;
+}
+
+p2u::nntp::connection_ramp::connection_ramp(size_t initial, size_t maximum)
+    : m_target{std::max<size_t>(std::min(initial, maximum), 1)},
+      m_maximum{std::max<size_t>(maximum, 1)}, m_rate_before{0}, m_target_before{0},
+      m_probing{false}, m_slow_start{true}, m_settle{0}, m_hold{0}
+{
+    m_stats.target = m_target;
+    m_stats.peak = m_target;
+}
+
+p2u::nntp::connection_ramp::decision p2u::nntp::connection_ramp::shrink_to(size_t target,
+        const char* reason)
+{
+    if (target >= m_target)
+    {
+        return make_decision(action::HOLD, "at the minimum");
+    }
+
+    m_target = target;
+    ++m_stats.shrunk;
+    m_stats.target = m_target;
+    return make_decision(action::SHRINK, reason);
+}
+
+p2u::nntp::connection_ramp::decision p2u::nntp::connection_ramp::make_decision(action what,
+        const char* reason) const
+{
+    decision result;
+    result.what = what;
+    result.target = m_target;
+    result.reason = reason;
+    return result;
+}
+
+void p2u::nntp::connection_ramp::start_window()
+{
+    m_window = window{};
+}
+
+p2u::nntp::connection_ramp::decision p2u::nntp::connection_ramp::on_interval(std::uint64_t bytes,
+        size_t posts, std::chrono::milliseconds busy, size_t errors, bool backlog)
+{
+    if (errors > 0)
+    {
+        // The server pushes back. Whatever we were probing is moot.
+        m_probing = false;
+        m_slow_start = false;
+        m_settle = 0;
+        m_hold = BACKOFF_INTERVALS;
+        start_window();
+        return shrink_to(std::max<size_t>(m_target / 2, 1), "errors or throttling");
+    }
+
+    if (m_settle > 0)
+    {
+        --m_settle;
+        return make_decision(action::HOLD, "settling");
+    }
+
+    if (m_hold > 0)
+    {
+        --m_hold;
+        return make_decision(action::HOLD, "holding");
+    }
+
+    m_window.bytes += bytes;
+    m_window.posts += posts;
+    m_window.busy += busy;
+    if (m_window.posts < MIN_POSTS_PER_CONNECTION * m_target)
+    {
+        return make_decision(action::HOLD, "measuring");
+    }
+
+    double rate = m_window.bytes * 1000.0 / std::max<std::int64_t>(m_window.busy.count(), 1) * m_target;
+    start_window();
+
+    if (m_probing)
+    {
+        m_probing = false;
+        if (rate < m_rate_before * (1 + MIN_GAIN))
+        {
+            m_slow_start = false;
+            m_hold = PLATEAU_INTERVALS;
+            return shrink_to(m_target_before, "no gain from the last connections");
+        }
+    }
+
+    if (!backlog)
+    {
+        return make_decision(action::HOLD, "nothing waiting");
+    }
+
+    if (m_target >= m_maximum)
+    {
+        return make_decision(action::HOLD, "at the maximum");
+    }
+
+    m_rate_before = rate;
+    m_target_before = m_target;
+    m_probing = true;
+    m_settle = 1;
+    m_target = std::min(m_slow_start ? 2 * m_target : m_target + 1, m_maximum);
+    ++m_stats.grown;
+    m_stats.target = m_target;
+    m_stats.peak = std::max(m_stats.peak, m_target);
+    return make_decision(action::GROW, "probing for more goodput");
+}
+
+size_t p2u::nntp::connection_ramp::target() const
+{
+    return m_target;
+}
+
+p2u::nntp::connection_ramp::statistics p2u::nntp::connection_ramp::get_statistics() const
+{
+    return m_stats;
+}
+
+std::ostream& p2u::nntp::operator<<(std::ostream& stream, const connection_ramp::statistics& stats)
+{
+    stream << "connection ramp: " << stats.target << " connections at the end, peak "
+        << stats.peak << ", grown " << stats.grown << " times, shrunk "
+        << stats.shrunk << " times";
+    return stream;
+}
@@ -0,0 +1,127 @@
+#ifndef NNTP_CONNECTION_RAMP_HPP_
+#define NNTP_CONNECTION_RAMP_HPP_
+
+/**
+ * Finds out how many connections to a server pay off.
+ *
+ * The right number depends on the provider, the route and the time of day,
+ * so rather than trusting a hand-tuned Connections value we start with a
+ * few and probe upwards for as long as more connections buy noticeably more
+ * goodput. Like TCP with its window: the count doubles at first, and after
+ * the first probe that didn't pay off grows by one connection at a time.
+ * Connections that didn't pay off are taken away again and we stay put for
+ * a while before probing once more. Errors and throttling halve the count
+ * right away.
+ *
+ * Goodput is estimated as the rate of the posts that finished times the
+ * number of connections, not as bytes per interval. With large articles
+ * only a handful finish per interval, and how many happen to fall into one
+ * would drown out what one more connection brings.
+ *
+ * It only decides. The caller measures each interval and carries out the
+ * decision.
+ */
+
+#include <boost/noncopyable.hpp>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+
+namespace p2u
+{
+    namespace nntp
+    {
+        class connection_ramp : private boost::noncopyable
+        {
+            public:
+                enum class action
+                {
+                    HOLD,
+                    GROW,
+                    SHRINK
+                };
+
+                struct decision
+                {
+                    action what = action::HOLD;
+                    size_t target = 0;
+
+                    // Why, for the log
+                    const char* reason = "";
+                };
+
+                struct statistics
+                {
+                    size_t target = 0;
+                    size_t peak = 0;
+                    size_t grown = 0;
+                    size_t shrunk = 0;
+                };
+
+                // Intervals to wait after backing off from errors, and
+                // after a connection didn't pay off, before probing again
+                static const unsigned int BACKOFF_INTERVALS = 5;
+                static const unsigned int PLATEAU_INTERVALS = 15;
+
+            private:
+                size_t m_target;
+                size_t m_maximum;
+
+                // Estimated goodput before the last connections were
+                // added, in bytes per second, how many there were, and
+                // whether it is still to be judged
+                double m_rate_before;
+                size_t m_target_before;
+                bool m_probing;
+
+                // Doubling rather than adding one
+                bool m_slow_start;
+
+                // Intervals to sit out. A new connection needs one to
+                // connect and warm up before it shows in the goodput.
+                unsigned int m_settle;
+                unsigned int m_hold;
+
+                // What the current measurement has seen so far. It spans as
+                // many intervals as it takes for every connection to finish
+                // a couple of posts.
+                struct window
+                {
+                    std::uint64_t bytes = 0;
+                    size_t posts = 0;
+                    std::chrono::milliseconds busy{0};
+                };
+                window m_window;
+
+                statistics m_stats;
+
+                decision shrink_to(size_t target, const char* reason);
+                decision make_decision(action what, const char* reason) const;
+                void start_window();
+
+            public:
+                /**
+                 * Starts with initial connections and never goes beyond
+                 * maximum, nor below one.
+                 */
+                connection_ramp(size_t initial, size_t maximum);
+
+                /**
+                 * Feed what the server's connections got done since the
+                 * last call: bytes and posts, how long those posts took
+                 * together, and failures that hint at overload or
+                 * throttling. Backlog says whether work was waiting, more
+                 * connections can't help otherwise.
+                 */
+                decision on_interval(std::uint64_t bytes, size_t posts,
+                        std::chrono::milliseconds busy, size_t errors, bool backlog);
+
+                size_t target() const;
+
+                statistics get_statistics() const;
+        };
+
+        std::ostream& operator<<(std::ostream& stream, const connection_ramp::statistics& stats);
+    }
+}
+#endif
@@ -0,0 +1,222 @@
+#include "dispatch_policy.hpp"
+#include "../util/make_unique.hpp"
+#include <algorithm>
+#include <boost/algorithm/string/predicate.hpp>
+#include <ostream>
+#include <stdexcept>
+
+namespace
+{
+    // Weight of the newest post in the goodput and the error rate
+    const double GOODPUT_SMOOTHING = 0.2;
+    const double ERROR_SMOOTHING = 0.1;
+
+    // Least share of the best server's weight anybody gets
+    const double MIN_SHARE = 0.05;
+}
+
+p2u::nntp::server_load::server_load()
+    : m_goodput{0}, m_error_rate{0}, m_connections{1}, m_samples{0},
+      m_outstanding_bytes{0}, m_outstanding{0}, m_dispatched{0}
+{
+
+}
+
+void p2u::nntp::server_load::set_connections(size_t connections)
+{
+    m_connections = std::max<size_t>(connections, 1);
+}
+
+void p2u::nntp::server_load::on_dispatched(std::uint64_t bytes)
+{
+    m_outstanding_bytes += bytes;
+    ++m_outstanding;
+    ++m_dispatched;
+}
+
+void p2u::nntp::server_load::finish(std::uint64_t bytes)
+{
+    m_outstanding_bytes -= std::min(m_outstanding_bytes, bytes);
+    m_outstanding -= std::min<size_t>(m_outstanding, 1);
+}
+
+void p2u::nntp::server_load::on_posted(std::uint64_t bytes, std::chrono::microseconds elapsed)
+{
+    finish(bytes);
+
+    double rate = bytes * 1e6 / std::max<std::int64_t>(elapsed.count(), 1);
+    m_goodput = (m_samples == 0) ? rate :
+        GOODPUT_SMOOTHING * rate + (1 - GOODPUT_SMOOTHING) * m_goodput;
+    m_error_rate = (1 - ERROR_SMOOTHING) * m_error_rate;
+    ++m_samples;
+}
+
+void p2u::nntp::server_load::on_failed(std::uint64_t bytes)
+{
+    finish(bytes);
+    m_error_rate = ERROR_SMOOTHING + (1 - ERROR_SMOOTHING) * m_error_rate;
+}
+
+void p2u::nntp::server_load::on_abandoned(std::uint64_t bytes)
+{
+    finish(bytes);
+}
+
+bool p2u::nntp::server_load::measured() const
+{
+    return m_samples > 0;
+}
+
+double p2u::nntp::server_load::goodput() const
+{
+    return m_goodput;
+}
+
+double p2u::nntp::server_load::error_rate() const
+{
+    return m_error_rate;
+}
+
+size_t p2u::nntp::server_load::connections() const
+{
+    return m_connections;
+}
+
+size_t p2u::nntp::server_load::dispatched() const
+{
+    return m_dispatched;
+}
+
+std::uint64_t p2u::nntp::server_load::outstanding_bytes() const
+{
+    return m_outstanding_bytes;
+}
+
+double p2u::nntp::server_load::weight() const
+{
+    return m_goodput * m_connections * (1 - m_error_rate);
+}
+
+std::ostream& p2u::nntp::operator<<(std::ostream& stream, const server_load& load)
+{
+    stream << "articles dispatched: " << load.dispatched()
+        << ", goodput per connection: " << static_cast<std::uint64_t>(load.goodput() / 1024)
+        << " KB/s, error rate: " << static_cast<int>(load.error_rate() * 100) << "%";
+    return stream;
+}
+
+const char* p2u::nntp::to_string(dispatch_mode mode)
+{
+    switch (mode)
+    {
+        case dispatch_mode::FIFO:
+            return "fifo";
+        case dispatch_mode::WEIGHTED:
+            return "weighted";
+        case dispatch_mode::LEAST_OUTSTANDING:
+            return "least-outstanding";
+    }
+    return "unknown";
+}
+
+p2u::nntp::dispatch_mode p2u::nntp::parse_dispatch_mode(const std::string& name)
+{
+    for (auto mode : {dispatch_mode::FIFO, dispatch_mode::WEIGHTED, dispatch_mode::LEAST_OUTSTANDING})
+    {
+        if (boost::algorithm::iequals(name, to_string(mode)))
+        {
+            return mode;
+        }
+    }
+    throw std::runtime_error{"Unknown dispatch policy: " + name};
+}
+
+size_t p2u::nntp::fifo_dispatch::choose(const std::vector<const server_load*>&)
+{
+    return 0;
+}
+
+p2u::nntp::dispatch_mode p2u::nntp::fifo_dispatch::mode() const
+{
+    return dispatch_mode::FIFO;
+}
+
+size_t p2u::nntp::weighted_dispatch::choose(const std::vector<const server_load*>& candidates)
+{
+    double best_weight = 0;
+    for (auto load : candidates)
+    {
+        best_weight = std::max(best_weight, load->weight());
+    }
+
+    if (best_weight <= 0)
+    {
+        // Nothing measured yet, all the same to us
+        best_weight = 1;
+    }
+
+    // Smooth weighted round robin, as in spreading connections over bind
+    // addresses
+    std::vector<double> weights;
+    double total = 0;
+    for (auto load : candidates)
+    {
+        double weight = load->measured() ? load->weight() : best_weight;
+        weights.push_back(std::max(weight, best_weight * MIN_SHARE));
+        total += weights.back();
+    }
+
+    size_t best = 0;
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        m_credit[candidates[i]] += weights[i];
+        if (m_credit[candidates[i]] > m_credit[candidates[best]])
+        {
+            best = i;
+        }
+    }
+
+    m_credit[candidates[best]] -= total;
+    return best;
+}
+
+p2u::nntp::dispatch_mode p2u::nntp::weighted_dispatch::mode() const
+{
+    return dispatch_mode::WEIGHTED;
+}
+
+size_t p2u::nntp::least_outstanding_dispatch::choose(const std::vector<const server_load*>& candidates)
+{
+    auto per_connection = [](const server_load* load)
+    {
+        return static_cast<double>(load->outstanding_bytes()) / load->connections();
+    };
+
+    size_t best = 0;
+    for (size_t i = 1; i < candidates.size(); ++i)
+    {
+        if (per_connection(candidates[i]) < per_connection(candidates[best]))
+        {
+            best = i;
+        }
+    }
+    return best;
+}
+
+p2u::nntp::dispatch_mode p2u::nntp::least_outstanding_dispatch::mode() const
+{
+    return dispatch_mode::LEAST_OUTSTANDING;
+}
+
+std::unique_ptr<p2u::nntp::dispatch_policy> p2u::nntp::make_dispatch_policy(dispatch_mode mode)
+{
+    switch (mode)
+    {
+        case dispatch_mode::FIFO:
+            return std::make_unique<fifo_dispatch>();
+        case dispatch_mode::LEAST_OUTSTANDING:
+            return std::make_unique<least_outstanding_dispatch>();
+        default:
+            return std::make_unique<weighted_dispatch>();
+    }
+}
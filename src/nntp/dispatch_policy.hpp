@@ -0,0 +1,155 @@
+#ifndef NNTP_DISPATCH_POLICY_HPP_
+#define NNTP_DISPATCH_POLICY_HPP_
+
+/**
+ * Decides which server the next article goes to when connections to more
+ * than one of them are idle.
+ *
+ * Giving it to whichever connection went idle first is fine with a single
+ * provider. With several, one doing 5 MB/s per connection gets as many
+ * articles as one doing 50 MB/s, and one that rejects half of what it gets
+ * as many as one that takes everything. So every server keeps a load
+ * record of its goodput, error rate and what it still has in flight, and
+ * the policy picks from those.
+ *
+ * A connection that goes idle while articles are queued still takes the
+ * next one itself. The policy only decides between idle connections, so
+ * no link is ever kept idle while there is work.
+ *
+ * Both are only touched with usenet's m_bfm held and don't lock themselves.
+ */
+
+#include <boost/noncopyable.hpp>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace p2u
+{
+    namespace nntp
+    {
+        class server_load
+        {
+            private:
+                // Per connection and smoothed, bytes per second
+                double m_goodput;
+
+                // Share of failed posts, smoothed
+                double m_error_rate;
+
+                size_t m_connections;
+                size_t m_samples;
+                std::uint64_t m_outstanding_bytes;
+                size_t m_outstanding;
+                size_t m_dispatched;
+
+                void finish(std::uint64_t bytes);
+
+            public:
+                server_load();
+
+                /**
+                 * Connections that take articles, spares not counted
+                 */
+                void set_connections(size_t connections);
+
+                void on_dispatched(std::uint64_t bytes);
+                void on_posted(std::uint64_t bytes, std::chrono::microseconds elapsed);
+                void on_failed(std::uint64_t bytes);
+
+                /**
+                 * Cut off because a copy raced against it won. Says nothing
+                 * about the server.
+                 */
+                void on_abandoned(std::uint64_t bytes);
+
+                bool measured() const;
+                double goodput() const;
+                double error_rate() const;
+                size_t connections() const;
+                size_t dispatched() const;
+                std::uint64_t outstanding_bytes() const;
+
+                /**
+                 * What the whole server can take, discounted by how much of
+                 * it fails
+                 */
+                double weight() const;
+        };
+
+        std::ostream& operator<<(std::ostream& stream, const server_load& load);
+
+        enum class dispatch_mode
+        {
+            // Whichever connection went idle first, what we used to do
+            FIFO,
+
+            // In proportion to each server's weight
+            WEIGHTED,
+
+            // The server with the fewest bytes in flight per connection
+            LEAST_OUTSTANDING
+        };
+
+        const char* to_string(dispatch_mode mode);
+
+        /**
+         * "fifo", "weighted" or "least-outstanding". Throws
+         * std::runtime_error for anything else.
+         */
+        dispatch_mode parse_dispatch_mode(const std::string& name);
+
+        class dispatch_policy : private boost::noncopyable
+        {
+            public:
+                virtual ~dispatch_policy() = default;
+
+                /**
+                 * Candidates are the servers with an idle connection, in
+                 * the order their first one went idle, or those a retry
+                 * can be sent to instead of the one that refused it. Never
+                 * empty. Returns an index into it.
+                 */
+                virtual size_t choose(const std::vector<const server_load*>& candidates) = 0;
+
+                virtual dispatch_mode mode() const = 0;
+        };
+
+        class fifo_dispatch : public dispatch_policy
+        {
+            public:
+                size_t choose(const std::vector<const server_load*>& candidates) override;
+                dispatch_mode mode() const override;
+        };
+
+        /**
+         * Smooth weighted round robin over the candidates. Servers without
+         * measurements yet are weighted like the best one, so they get
+         * measured, and nobody drops below a small share, so a server that
+         * had a bad spell gets a chance to recover.
+         */
+        class weighted_dispatch : public dispatch_policy
+        {
+            private:
+                std::unordered_map<const server_load*, double> m_credit;
+
+            public:
+                size_t choose(const std::vector<const server_load*>& candidates) override;
+                dispatch_mode mode() const override;
+        };
+
+        class least_outstanding_dispatch : public dispatch_policy
+        {
+            public:
+                size_t choose(const std::vector<const server_load*>& candidates) override;
+                dispatch_mode mode() const override;
+        };
+
+        std::unique_ptr<dispatch_policy> make_dispatch_policy(dispatch_mode mode);
+    }
+}
+#endif
@@ -0,0 +1,99 @@
+#include "health_monitor.hpp"
+#include <algorithm>
+#include <ostream>
+#include <vector>
+
+namespace
+{
+    // Weight of the newest article in a slot's rate
+    const double RATE_SMOOTHING = 0.3;
+}
+
+p2u::nntp::health_monitor::health_monitor(double threshold, unsigned int patience)
+    : m_threshold{threshold}, m_patience{std::max(patience, 1u)}
+{
+
+}
+
+double p2u::nntp::health_monitor::median_rate() const
+{
+    // Must be called with m_lock held
+    std::vector<double> rates;
+    for (const auto& slot : m_slots)
+    {
+        if (slot.second.articles >= MIN_ARTICLES)
+        {
+            rates.push_back(slot.second.rate);
+        }
+    }
+
+    if (rates.size() < MIN_SLOTS)
+    {
+        return 0;
+    }
+
+    auto middle = rates.begin() + rates.size() / 2;
+    std::nth_element(rates.begin(), middle, rates.end());
+    return *middle;
+}
+
+bool p2u::nntp::health_monitor::record(slot_key slot, const transfer_statistics& totals)
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    auto& state = m_slots[slot];
+
+    auto bytes = totals.bytes - state.last.bytes;
+    auto busy = totals.busy - state.last.busy;
+    state.last = totals;
+
+    // Bytes per millisecond, only relative values matter here
+    double rate = static_cast<double>(bytes) / std::max<std::int64_t>(busy.count(), 1);
+    state.rate = (state.articles == 0) ? rate :
+        RATE_SMOOTHING * rate + (1 - RATE_SMOOTHING) * state.rate;
+    ++state.articles;
+
+    if (m_threshold <= 0 || state.articles < MIN_ARTICLES)
+    {
+        return false;
+    }
+
+    double median = median_rate();
+    m_stats.median_rate = median;
+    if (median <= 0 || state.rate >= median * m_threshold)
+    {
+        state.low_streak = 0;
+        return false;
+    }
+
+    if (++state.low_streak < m_patience)
+    {
+        return false;
+    }
+
+    ++m_stats.recycled;
+
+    // Keep the totals so the next delta is right, but score it afresh
+    auto last = state.last;
+    state = slot_state{};
+    state.last = last;
+    return true;
+}
+
+void p2u::nntp::health_monitor::forget(slot_key slot)
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    m_slots.erase(slot);
+}
+
+p2u::nntp::health_monitor::statistics p2u::nntp::health_monitor::get_statistics() const
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    return m_stats;
+}
+
+std::ostream& p2u::nntp::operator<<(std::ostream& stream, const health_monitor::statistics& stats)
+{
+    stream << "slow connections recycled: " << stats.recycled
+        << ", median rate: " << static_cast<size_t>(stats.median_rate * 1000 / 1024) << " KB/s";
+    return stream;
+}
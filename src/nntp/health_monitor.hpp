@@ -0,0 +1,86 @@
+#ifndef NNTP_HEALTH_MONITOR_HPP_
+#define NNTP_HEALTH_MONITOR_HPP_
+
+/**
+ * Spots connections of one server that have slowed down to a trickle.
+ *
+ * Some frontends throttle a single connection without ever dropping it. Such
+ * a slot keeps getting articles like any other and ends up holding back the
+ * end of every job. So each slot's recent article rate is scored against
+ * the median of its server's slots, and one that stays below the threshold
+ * for a few articles in a row is recycled. Its reconnect starts at the next
+ * resolved address, so it usually lands on a different frontend.
+ */
+
+#include <boost/noncopyable.hpp>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+#include <unordered_map>
+#include "connection.hpp"
+
+namespace p2u
+{
+    namespace nntp
+    {
+        class health_monitor : private boost::noncopyable
+        {
+            public:
+                using slot_key = const connection*;
+
+                struct statistics
+                {
+                    size_t recycled = 0;
+                    double median_rate = 0;
+                };
+
+                // Articles a slot must have posted before it is scored or
+                // counts towards the median
+                static const size_t MIN_ARTICLES = 2;
+
+                // Scoring against fewer slots than this is just noise
+                static const size_t MIN_SLOTS = 3;
+
+            private:
+                struct slot_state
+                {
+                    transfer_statistics last;
+                    double rate = 0;
+                    size_t articles = 0;
+                    unsigned int low_streak = 0;
+                };
+
+                double m_threshold;
+                unsigned int m_patience;
+
+                mutable std::mutex m_lock;
+                std::unordered_map<slot_key, slot_state> m_slots;
+                statistics m_stats;
+
+                double median_rate() const;
+
+            public:
+                /**
+                 * A slot is recycled after patience articles in a row below
+                 * threshold times the median rate. A threshold of 0 never
+                 * recycles anything.
+                 */
+                health_monitor(double threshold, unsigned int patience);
+
+                /**
+                 * Feed the slot's running totals after every article it
+                 * posted. Returns true if the slot should be recycled, in
+                 * which case its score starts over.
+                 */
+                bool record(slot_key slot, const transfer_statistics& totals);
+
+                void forget(slot_key slot);
+
+                statistics get_statistics() const;
+        };
+
+        std::ostream& operator<<(std::ostream& stream, const health_monitor::statistics& stats);
+    }
+}
+#endif
@@ -0,0 +1,135 @@
+#include "latency_tracker.hpp"
+#include <algorithm>
+#include <ostream>
+
+const char* p2u::nntp::to_string(latency_phase phase)
+{
+    switch (phase)
+    {
+        case latency_phase::CONNECT:
+            return "connect";
+        case latency_phase::POST_ACK:
+            return "POST ack";
+        case latency_phase::ARTICLE_ACK:
+            return "article ack";
+        case latency_phase::STAT:
+            return "STAT";
+        case latency_phase::POST_COMPLETE:
+            return "whole post";
+        default:
+            return "?";
+    }
+}
+
+p2u::nntp::latency_tracker::latency_tracker(std::chrono::milliseconds min_timeout,
+                                            std::chrono::milliseconds max_timeout,
+                                            double multiplier)
+    : m_min{min_timeout}, m_max{max_timeout}, m_multiplier{multiplier}
+{
+    for (auto& window : m_phases)
+    {
+        window.samples.reserve(WINDOW_SIZE);
+        window.timeout = m_max;
+    }
+}
+
+void p2u::nntp::latency_tracker::record(latency_phase phase, std::chrono::milliseconds latency)
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    auto& window = m_phases[static_cast<size_t>(phase)];
+
+    if (window.samples.size() < WINDOW_SIZE)
+    {
+        window.samples.push_back(latency);
+    }
+    else
+    {
+        window.samples[window.next] = latency;
+    }
+    window.next = (window.next + 1) % WINDOW_SIZE;
+    ++window.total;
+
+    // Sorting the window on every sample would be a waste, timeouts don't
+    // need to react that fast.
+    if (++window.since_update >= MIN_SAMPLES / 2 && window.samples.size() >= MIN_SAMPLES)
+    {
+        window.since_update = 0;
+        update_timeout(window);
+    }
+}
+
+void p2u::nntp::latency_tracker::record_timeout(latency_phase phase, std::chrono::milliseconds waited)
+{
+    {
+        std::lock_guard<std::mutex> _lock{m_lock};
+        ++m_phases[static_cast<size_t>(phase)].timeouts;
+    }
+
+    // A timed out operation took at least this long. Counting it keeps a
+    // server that got slower from timing out over and over on a stale p99.
+    record(phase, waited);
+}
+
+void p2u::nntp::latency_tracker::update_timeout(phase_window& window)
+{
+    // Must be called with m_lock held
+    auto sorted = window.samples;
+    auto at = [&sorted](double q)
+    {
+        auto index = static_cast<size_t>(q * (sorted.size() - 1));
+        std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+        return sorted[index];
+    };
+
+    window.p50 = at(0.50);
+    window.p99 = at(0.99);
+
+    if (m_max.count() <= 0)
+    {
+        return;
+    }
+
+    std::chrono::milliseconds timeout{static_cast<std::chrono::milliseconds::rep>(window.p99.count() * m_multiplier)};
+    window.timeout = std::max(m_min, std::min(m_max, timeout));
+}
+
+std::chrono::milliseconds p2u::nntp::latency_tracker::timeout_for(latency_phase phase) const
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    return m_phases[static_cast<size_t>(phase)].timeout;
+}
+
+std::chrono::milliseconds p2u::nntp::latency_tracker::percentile(latency_phase phase, double q) const
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    const auto& window = m_phases[static_cast<size_t>(phase)];
+    if (window.samples.size() < MIN_SAMPLES)
+    {
+        return std::chrono::milliseconds{0};
+    }
+
+    auto sorted = window.samples;
+    auto index = static_cast<size_t>(q * (sorted.size() - 1));
+    std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    return sorted[index];
+}
+
+void p2u::nntp::latency_tracker::write_statistics(std::ostream& stream) const
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    bool first = true;
+    for (size_t i = 0; i < NUM_PHASES; ++i)
+    {
+        const auto& window = m_phases[i];
+        if (window.total == 0)
+        {
+            continue;
+        }
+
+        stream << (first ? "" : ", ") << to_string(static_cast<latency_phase>(i))
+            << ": p50 " << window.p50.count() << " ms / p99 " << window.p99.count()
+            << " ms, timeout " << window.timeout.count() << " ms"
+            << " (" << window.total << " samples, " << window.timeouts << " timed out)";
+        first = false;
+    }
+}
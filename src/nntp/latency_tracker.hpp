@@ -0,0 +1,105 @@
+#ifndef NNTP_LATENCY_TRACKER_HPP_
+#define NNTP_LATENCY_TRACKER_HPP_
+
+/**
+ * Keeps a running latency distribution per protocol phase for one server,
+ * and derives operation timeouts from it.
+ *
+ * A single OperationTimeout is wrong for everybody: too short for slow
+ * servers (spurious retries and re-uploads) and far too long for fast ones,
+ * where a hung post (see the highwinds story in main.cc) ties up a slot for
+ * the full duration. So each phase gets p99 * multiplier of what the server
+ * has actually been doing lately, clamped to [min, max], where max is the
+ * configured OperationTimeout.
+ *
+ * Until a phase has seen enough samples, its timeout is the maximum.
+ */
+
+#include <boost/noncopyable.hpp>
+#include <array>
+#include <chrono>
+#include <iosfwd>
+#include <mutex>
+#include <vector>
+
+namespace p2u
+{
+    namespace nntp
+    {
+        enum class latency_phase
+        {
+            CONNECT,
+            POST_ACK,
+            ARTICLE_ACK,
+            STAT,
+
+            // A whole post, from handing it to a connection to the article's
+            // ack. Not used for timeouts.
+            POST_COMPLETE,
+            NUM_PHASES
+        };
+
+        const char* to_string(latency_phase phase);
+
+        class latency_tracker : private boost::noncopyable
+        {
+            public:
+                // Only the most recent samples count, servers change their
+                // mind.
+                static const size_t WINDOW_SIZE = 256;
+
+                // Don't trust a percentile over fewer samples than this
+                static const size_t MIN_SAMPLES = 20;
+
+            private:
+                static const size_t NUM_PHASES = static_cast<size_t>(latency_phase::NUM_PHASES);
+
+                struct phase_window
+                {
+                    std::vector<std::chrono::milliseconds> samples;
+                    size_t next = 0;
+                    size_t since_update = 0;
+                    std::chrono::milliseconds timeout{0};
+                    std::chrono::milliseconds p50{0};
+                    std::chrono::milliseconds p99{0};
+                    size_t total = 0;
+                    size_t timeouts = 0;
+                };
+
+                mutable std::mutex m_lock;
+                std::array<phase_window, NUM_PHASES> m_phases;
+
+                std::chrono::milliseconds m_min;
+                std::chrono::milliseconds m_max;
+                double m_multiplier;
+
+                void update_timeout(phase_window& window);
+
+            public:
+                latency_tracker(std::chrono::milliseconds min_timeout,
+                                std::chrono::milliseconds max_timeout,
+                                double multiplier);
+
+                void record(latency_phase phase, std::chrono::milliseconds latency);
+
+                /**
+                 * Same as record, but for an operation we gave up on.
+                 */
+                void record_timeout(latency_phase phase, std::chrono::milliseconds waited);
+
+                /**
+                 * Zero means no timeout, as with OperationTimeout = 0
+                 */
+                std::chrono::milliseconds timeout_for(latency_phase phase) const;
+
+                /**
+                 * Recent latency percentile of a phase, or zero if there
+                 * aren't enough samples yet.
+                 */
+                std::chrono::milliseconds percentile(latency_phase phase, double q) const;
+
+                void write_statistics(std::ostream& stream) const;
+        };
+    }
+}
+#endif
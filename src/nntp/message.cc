@@ -51,3 +51,13 @@ size_t p2u::nntp::article::get_payload_size() const
             });
     return ret;
 }
+
+void p2u::nntp::article::set_cancel_flag(const std::shared_ptr<const std::atomic<bool>>& flag)
+{
+    m_cancelled = flag;
+}
+
+bool p2u::nntp::article::is_cancelled() const
+{
+    return m_cancelled && m_cancelled->load();
+}
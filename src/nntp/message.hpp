@@ -1,6 +1,7 @@
 #ifndef NNTP_MESSAGE_HPP_
 #define NNTP_MESSAGE_HPP_
 
+#include <atomic>
 #include <vector>
 #include <string>
 #include <boost/noncopyable.hpp>
@@ -43,6 +44,7 @@ namespace p2u
             private:
                 header m_header;
                 std::vector<payload_piece_type> m_payload;
+                std::shared_ptr<const std::atomic<bool>> m_cancelled;
             public:
                 article(header h);
 
@@ -57,6 +59,14 @@ namespace p2u
 
                 size_t get_payload_size() const;
 
+                /**
+                 * Lets whoever queued the article take it back. Once the
+                 * flag is set, it is dropped rather than sent, unless it is
+                 * on its way already. Copies share the flag.
+                 */
+                void set_cancel_flag(const std::shared_ptr<const std::atomic<bool>>& flag);
+                bool is_cancelled() const;
+
                 /*
                  * Writes all payload pieces of the article.
                  */
@@ -0,0 +1,103 @@
+#include "resolver_cache.hpp"
+#include <algorithm>
+
+p2u::nntp::resolver_cache::resolver_cache(boost::asio::io_service& io_service,
+                                          const std::string& host,
+                                          std::uint16_t port,
+                                          int ttl_seconds)
+    : m_resolver{io_service}, m_host{host}, m_port{port}, m_ttl{ttl_seconds},
+      m_resolving{false}, m_next_offset{0}
+{
+
+}
+
+void p2u::nntp::resolver_cache::async_resolve(boost::asio::io_service& io_service,
+                                              const resolve_handler& handler)
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+
+    if (!m_endpoints.empty() && std::chrono::steady_clock::now() < m_expires)
+    {
+        auto endpoints = m_endpoints;
+        io_service.post([handler, endpoints]()
+                {
+                    handler(boost::system::error_code{}, endpoints);
+                });
+        return;
+    }
+
+    m_waiters.push_back(waiter{&io_service, handler});
+
+    if (!m_resolving)
+    {
+        m_resolving = true;
+        boost::asio::ip::tcp::resolver::query query(m_host, "");
+        m_resolver.async_resolve(query,
+                [this](const boost::system::error_code& ec, boost::asio::ip::tcp::resolver::iterator it)
+                {
+                    on_resolved(ec, it);
+                });
+    }
+}
+
+void p2u::nntp::resolver_cache::on_resolved(const boost::system::error_code& ec,
+                                            boost::asio::ip::tcp::resolver::iterator it)
+{
+    std::vector<waiter> waiters;
+    endpoint_list endpoints;
+
+    {
+        std::lock_guard<std::mutex> _lock{m_lock};
+        m_resolving = false;
+        waiters.swap(m_waiters);
+
+        if (!ec)
+        {
+            endpoint_list v4;
+            endpoint_list v6;
+            for (; it != boost::asio::ip::tcp::resolver::iterator{}; ++it)
+            {
+                boost::asio::ip::tcp::endpoint endpoint(it->endpoint().address(), m_port);
+                auto& family = endpoint.address().is_v6() ? v6 : v4;
+                if (std::find(family.begin(), family.end(), endpoint) == family.end())
+                {
+                    family.push_back(endpoint);
+                }
+            }
+
+            // Alternate address families (RFC 8305), preferring IPv6
+            for (size_t i = 0; i < std::max(v4.size(), v6.size()); ++i)
+            {
+                if (i < v6.size())
+                    endpoints.push_back(v6[i]);
+                if (i < v4.size())
+                    endpoints.push_back(v4[i]);
+            }
+
+            m_endpoints = endpoints;
+            m_expires = std::chrono::steady_clock::now() + m_ttl;
+        }
+    }
+
+    // Each on the thread its connection lives on
+    for (auto& waiter : waiters)
+    {
+        auto handler = waiter.handler;
+        waiter.io_service->post([handler, ec, endpoints]()
+                {
+                    handler(ec, endpoints);
+                });
+    }
+}
+
+void p2u::nntp::resolver_cache::invalidate()
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    m_endpoints.clear();
+}
+
+size_t p2u::nntp::resolver_cache::next_offset()
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    return m_next_offset++;
+}
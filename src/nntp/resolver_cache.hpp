@@ -0,0 +1,83 @@
+#ifndef NNTP_RESOLVER_CACHE_HPP_
+#define NNTP_RESOLVER_CACHE_HPP_
+
+/**
+ * Caches the resolved addresses of one server so that bringing up (or
+ * reconnecting) hundreds of connections costs one lookup instead of hundreds.
+ *
+ * getaddrinfo doesn't tell us the record TTL, so entries live for a
+ * configurable amount of time (DnsCacheTtl) and are dropped early whenever
+ * every address of the server failed to connect.
+ *
+ * Concurrent lookups are coalesced: whoever asks while a lookup is running
+ * gets the result of that lookup.
+ */
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace p2u
+{
+    namespace nntp
+    {
+        class resolver_cache : private boost::noncopyable
+        {
+            public:
+                using endpoint_list = std::vector<boost::asio::ip::tcp::endpoint>;
+                using resolve_handler = std::function<void(const boost::system::error_code&, const endpoint_list&)>;
+
+            private:
+                boost::asio::ip::tcp::resolver m_resolver;
+                std::string m_host;
+                std::uint16_t m_port;
+                std::chrono::seconds m_ttl;
+
+                std::mutex m_lock;
+                endpoint_list m_endpoints;
+                std::chrono::steady_clock::time_point m_expires;
+                bool m_resolving;
+                struct waiter
+                {
+                    boost::asio::io_service* io_service;
+                    resolve_handler handler;
+                };
+                std::vector<waiter> m_waiters;
+
+                size_t m_next_offset;
+
+                void on_resolved(const boost::system::error_code& ec,
+                                 boost::asio::ip::tcp::resolver::iterator it);
+
+            public:
+                resolver_cache(boost::asio::io_service& io_service,
+                               const std::string& host, std::uint16_t port,
+                               int ttl_seconds);
+
+                /**
+                 * Calls handler with the server's addresses, IPv6 and IPv4
+                 * interleaved. The handler is always invoked through the
+                 * given io_service (the caller's, which need not be the one
+                 * doing the lookup), never from within this call.
+                 */
+                void async_resolve(boost::asio::io_service& io_service,
+                                   const resolve_handler& handler);
+
+                /**
+                 * Forget the cached addresses; the next caller re-resolves.
+                 */
+                void invalidate();
+
+                /**
+                 * Hands out a different starting address to every caller so
+                 * that connections spread over all of the provider's
+                 * frontends instead of piling onto the first A record.
+                 */
+                size_t next_offset();
+        };
+    }
+}
+#endif
@@ -0,0 +1,66 @@
+#include "retry_policy.hpp"
+#include "../util/backoff.hpp"
+#include <algorithm>
+#include <cstdint>
+
+const char* p2u::nntp::to_string(post_failure_action action)
+{
+    switch (action)
+    {
+        case post_failure_action::SKIP:
+            return "skipped";
+        case post_failure_action::REAUTHENTICATE:
+            return "re-authenticated";
+        case post_failure_action::RESCHEDULE:
+            return "rescheduled";
+        case post_failure_action::MOVE_SERVER:
+            return "moved";
+        default:
+            return "unknown";
+    }
+}
+
+p2u::nntp::post_failure_action p2u::nntp::classify_post_failure(int response_code)
+{
+    switch (response_code)
+    {
+        // Duplicate or rejected outright
+        case 435:
+        case 437:
+        case 441:
+            return post_failure_action::SKIP;
+
+        case 480:
+            return post_failure_action::REAUTHENTICATE;
+
+        // Posting not permitted on this server
+        case 440:
+            return post_failure_action::MOVE_SERVER;
+
+        // 400 and 503 are the usual "come back later", and anything we don't
+        // know is treated the same way rather than hammering the server.
+        default:
+            return post_failure_action::RESCHEDULE;
+    }
+}
+
+p2u::nntp::retry_policy::retry_policy(unsigned int max_failures,
+                                      std::chrono::milliseconds base_delay,
+                                      std::chrono::milliseconds max_delay)
+    : m_max_failures{max_failures}, m_base_delay{base_delay}, m_max_delay{max_delay},
+      m_rng{static_cast<std::mt19937::result_type>(
+              std::chrono::steady_clock::now().time_since_epoch().count())}
+{
+
+}
+
+bool p2u::nntp::retry_policy::exhausted(unsigned int failures) const
+{
+    return failures >= m_max_failures;
+}
+
+std::chrono::milliseconds p2u::nntp::retry_policy::delay_for(unsigned int failures)
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    return p2u::util::jittered_backoff(m_base_delay, m_max_delay, failures, m_rng);
+}
@@ -0,0 +1,70 @@
+#ifndef NNTP_RETRY_POLICY_HPP_
+#define NNTP_RETRY_POLICY_HPP_
+
+/**
+ * What to do with an article the server didn't take, based on its reply.
+ *
+ * Retrying everything right away is what we used to do. Against a server
+ * that is having a bad day (400/503) that just re-uploads the same article
+ * in a tight loop, and for articles the server will never take (435, 437,
+ * 441) it's pointless no matter how long we wait.
+ */
+
+#include <chrono>
+#include <mutex>
+#include <random>
+
+namespace p2u
+{
+    namespace nntp
+    {
+        enum class post_failure_action
+        {
+            // Rejected for good, retrying won't help
+            SKIP,
+
+            // The server forgot who we are, reconnect and try again
+            REAUTHENTICATE,
+
+            // Transient, try again after a backoff delay
+            RESCHEDULE,
+
+            // This server won't take it, give another one a go
+            MOVE_SERVER,
+
+            NUM_ACTIONS
+        };
+
+        const char* to_string(post_failure_action action);
+
+        post_failure_action classify_post_failure(int response_code);
+
+        class retry_policy
+        {
+            private:
+                unsigned int m_max_failures;
+                std::chrono::milliseconds m_base_delay;
+                std::chrono::milliseconds m_max_delay;
+
+                std::mutex m_lock;
+                std::mt19937 m_rng;
+
+            public:
+                retry_policy(unsigned int max_failures,
+                             std::chrono::milliseconds base_delay,
+                             std::chrono::milliseconds max_delay);
+
+                /**
+                 * Whether an article that failed this many times should be
+                 * given up on.
+                 */
+                bool exhausted(unsigned int failures) const;
+
+                /**
+                 * base * 2^(failures - 1), capped and jittered
+                 */
+                std::chrono::milliseconds delay_for(unsigned int failures);
+        };
+    }
+}
+#endif
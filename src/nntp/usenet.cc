@@ -2,6 +2,64 @@
 #include "message.hpp"
 #include "connection_info.hpp"
 #include "../util/make_unique.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <stdexcept>
+
+namespace
+{
+    // Smooth weighted round robin, so that e.g. weights 2:1 give A B A A B A
+    // rather than A A B A A B.
+    std::vector<boost::asio::ip::address> spread_over(
+            const std::vector<p2u::nntp::bind_address>& addresses, size_t count)
+    {
+        std::vector<boost::asio::ip::address> result;
+        if (addresses.empty())
+        {
+            return result;
+        }
+
+        long total = 0;
+        for (const auto& bind : addresses)
+        {
+            total += bind.weight;
+        }
+
+        std::vector<long> current(addresses.size(), 0);
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t best = 0;
+            for (size_t j = 0; j < addresses.size(); ++j)
+            {
+                current[j] += addresses[j].weight;
+                if (current[j] > current[best])
+                {
+                    best = j;
+                }
+            }
+
+            current[best] -= total;
+            result.push_back(addresses[best].address);
+        }
+
+        return result;
+    }
+
+    double kb_per_second(const p2u::nntp::transfer_statistics& transfer)
+    {
+        return transfer.bytes / 1024.0 /
+            std::max<double>(transfer.busy.count() / 1000.0, 0.001);
+    }
+
+    size_t shard_count(size_t iothreads)
+    {
+        if (iothreads == 0)
+        {
+            iothreads = std::thread::hardware_concurrency();
+        }
+        return std::max<size_t>(iothreads, 1);
+    }
+}
 
 p2u::nntp::usenet::usenet(size_t iothreads)
     : usenet{iothreads, 0}
@@ -10,7 +68,22 @@ p2u::nntp::usenet::usenet(size_t iothreads)
 }
 
 p2u::nntp::usenet::usenet(size_t iothreads, size_t max_queue_size)
-    : m_maxsize{max_queue_size}, m_numthreads{iothreads}, m_optimeout{0}
+    : m_shards{make_shards(iothreads)},
+      m_upload_limit{std::make_shared<p2u::asio::token_bucket>()},
+      m_scheduler{max_queue_size, [this](const connection_handle& conn)
+              {
+                  auto server = server_of(conn);
+                  return server ? server->id : NO_SERVER;
+              }},
+      m_maxsize{max_queue_size},
+      m_waiting_producers{0}, m_stranded{false},
+      m_num_unacknowledged{0}, m_num_landed{0},
+      m_bytes_not_reposted{0}, m_delayed{home_service()}, m_num_delayed{0},
+      m_retry{std::make_unique<p2u::nntp::retry_policy>(3, std::chrono::seconds{1}, std::chrono::seconds{60})},
+      m_failure_actions{}, m_num_given_up{0}, m_num_cancelled{0}, m_tail_timer{home_service()}, m_tail_active{false},
+      m_num_hedged{0}, m_num_hedges_won{0}, m_ramp_timer{home_service()}, m_ramp_active{false},
+      m_keepalive_timer{home_service()}, m_keepalive_active{false},
+      m_winding_down{false}, m_optimeout{DEFAULT_OPERATION_TIMEOUT}
 {
 
 }
@@ -22,158 +95,556 @@ p2u::nntp::usenet::~usenet()
 
 void p2u::nntp::usenet::set_operation_timeout(int seconds)
 {
+    // The connections and latency trackers take it when they're made
+    if (!m_conninfo.empty())
+    {
+        throw std::logic_error("Operation timeout must be set before adding connections");
+    }
     m_optimeout = seconds;
 }
 
+void p2u::nntp::usenet::set_retry_policy(unsigned int max_failures,
+                                         std::chrono::milliseconds base_delay,
+                                         std::chrono::milliseconds max_delay)
+{
+    m_retry = std::make_unique<p2u::nntp::retry_policy>(max_failures, base_delay, max_delay);
+}
+
+void p2u::nntp::usenet::set_dispatch_policy(std::unique_ptr<dispatch_policy> policy)
+{
+    std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+    m_scheduler.set_dispatch_policy(std::move(policy));
+}
+
+void p2u::nntp::usenet::set_prefetch_depth(size_t depth)
+{
+    std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+    m_scheduler.set_prefetch_depth(depth);
+}
+
+void p2u::nntp::usenet::set_thread_affinity(const p2u::util::cpu_list& cpus)
+{
+    if (cpus.empty())
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < m_shards.size(); ++i)
+    {
+        auto& shard = *m_shards[i];
+        shard.cpu = cpus[i % cpus.size()];
+        shard.node = p2u::util::numa_node_of_cpu(shard.cpu);
+    }
+}
+
 void p2u::nntp::usenet::start_async_post(connection_handle_iterator conn,
-                                         const std::shared_ptr<article>& msg)
+                                         const std::shared_ptr<article>& msg,
+                                         const std::shared_ptr<hedge_state>& hedge)
 {
+    // Always called with m_bfm held
     auto& connection = *conn;
-    connection->async_post(msg);
+    auto server = server_of(connection);
+    if (msg->is_cancelled())
+    {
+        // Taken back by whoever queued it. The callback is user code, so it
+        // runs on the connection's thread, which then looks for other work.
+        ++m_num_cancelled;
+        m_post_failures.erase(msg.get());
+        if (hedge)
+        {
+            auto& racers = hedge->racers;
+            racers.erase(std::remove(racers.begin(), racers.end(), msg.get()), racers.end());
+        }
+        connection->get_io_service().post([this, conn, msg, hedge]()
+                {
+                    // A copy doesn't count, the original is still out there
+                    if (!hedge && m_slot_post_cancelled)
+                    {
+                        m_slot_post_cancelled(msg);
+                    }
+                    on_conn_becomes_ready(conn);
+                });
+        return;
+    }
+
+    m_inflight[msg.get()] = inflight_post{msg, connection.get(), server,
+        std::chrono::steady_clock::now(), hedge};
+    if (server)
+    {
+        server->load.on_dispatched(msg->get_payload_size());
+    }
+    // The connection is only ever touched on its own shard, and we may be
+    // on a producer's thread or another connection's
+    connection->get_io_service().post([this, conn, msg, server, hedge]()
+            {
+                if ((*conn)->async_post(msg))
+                {
+                    return;
+                }
+
+                // Closed under our feet, e.g. cut off as the loser of a race.
+                // Nothing will ever report back on it.
+                {
+                    std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+                    m_inflight.erase(msg.get());
+                    if (server)
+                    {
+                        server->load.on_abandoned(msg->get_payload_size());
+                    }
+
+                    if (hedge)
+                    {
+                        // The original is still in flight
+                        auto& racers = hedge->racers;
+                        racers.erase(std::remove(racers.begin(), racers.end(), msg.get()), racers.end());
+                    }
+                    else
+                    {
+                        work_item item;
+                        item.type = work_item::kind::POST;
+                        item.priority = post_priority::RETRY;
+                        item.msg = msg;
+                        queue_work(std::move(item));
+
+                        // Somebody else may be idle already
+                        drain_to_ready();
+                    }
+                }
+
+                // schedule_reconnect takes m_bfm itself
+                (*conn)->close();
+                schedule_reconnect(conn, server);
+            });
 }
 
 void p2u::nntp::usenet::start_async_stat(connection_handle_iterator conn,
                                          const std::string& msgid)
 {
+    // Like a post, on the connection's own shard
     auto& connection = *conn;
-    connection->async_stat(msgid);
+    connection->get_io_service().post([conn, msgid]()
+            {
+                (*conn)->async_stat(msgid);
+            });
 }
 
-void p2u::nntp::usenet::enqueue_stat(const std::string& msgid)
+void p2u::nntp::usenet::enqueue_stat(const std::string& msgid, post_priority priority)
 {
-    std::unique_lock<std::mutex> _lock{m_bfm};
+    work_item item;
+    item.type = work_item::kind::STAT;
+    item.priority = priority;
+    item.msgid = msgid;
+    enqueue(std::move(item), false);
+}
 
-    if (m_ready.size() > 0)
-    {
-        // Directly enqueue the task.
+void p2u::nntp::usenet::enqueue_post(const std::shared_ptr<p2u::nntp::article>& msg,
+                                     post_priority priority, bool bypass_wait)
+{
+    work_item item;
+    item.type = work_item::kind::POST;
+    item.priority = priority;
+    item.msg = msg;
+    enqueue(std::move(item), bypass_wait);
+}
 
-        // Get the iterator to the connection_handle that will enqueue the task
-        auto it = m_ready.begin();
+void p2u::nntp::usenet::enqueue(work_item&& item, bool bypass_wait)
+{
+    if (!bypass_wait)
+    {
+        wait_for_room();
+    }
 
-        // Transfer it into the busy list. This does not invalidate the iterator
-        m_busy.splice(m_busy.begin(), m_ready, it);
+    item.queued = std::chrono::steady_clock::now();
+    if (!m_scheduler.try_push(std::move(item)))
+    {
+        // A failed push leaves the item alone
+        std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+        m_scheduler.push_overflow(std::move(item));
+    }
 
-        start_async_stat(it, msgid);
-        return;
+    // See the comment on m_bfm: either we see the idle connection here, or
+    // it sees our item after it went idle.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_scheduler.idle() > 0)
+    {
+        std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+        drain_to_ready();
     }
+}
 
-    if (m_maxsize != 0 && m_queue.size() >= m_maxsize)
+void p2u::nntp::usenet::wait_for_room()
+{
+    if (m_maxsize == 0 || m_scheduler.queued() < m_maxsize)
     {
-        m_queuecv.wait(_lock,
-                [this](){return m_queue.size() < m_maxsize;});
+        return;
     }
 
-    // Defer the start_async_post to a connection that will become ready.
-    m_queue.push_back(std::bind(&p2u::nntp::usenet::start_async_stat, this, std::placeholders::_1, msgid));
+    std::unique_lock<std::mutex> _lock{m_space_lock};
+    m_waiting_producers.fetch_add(1);
+    m_queuecv.wait(_lock, [this]()
+            {
+                return m_scheduler.queued() < m_maxsize || m_stranded.load();
+            });
+    m_waiting_producers.fetch_sub(1);
 }
 
-void p2u::nntp::usenet::enqueue_post(const std::shared_ptr<p2u::nntp::article>& msg, bool bypass_wait)
+void p2u::nntp::usenet::queue_work(work_item&& item)
 {
-    std::unique_lock<std::mutex> _lock{m_bfm};
+    // Must be called with m_bfm held. Never blocks, the io threads requeue
+    // through here.
+    item.queued = std::chrono::steady_clock::now();
+    m_scheduler.push(std::move(item));
+}
 
-    if (m_ready.size() > 0)
+void p2u::nntp::usenet::return_prefetched(connection_handle_iterator conn)
+{
+    // Must be called with m_bfm held
+    if (m_scheduler.return_batch(conn))
     {
-        // Directly enqueue the task.
+        drain_to_ready();
+    }
+}
 
-        // Get the iterator to the connection_handle that will enqueue the task
-        auto it = m_ready.begin();
+void p2u::nntp::usenet::on_popped()
+{
+    // Must be called with m_bfm held, after m_scheduler handed out an item
+    //
+    // Blocked producers are woken once there is room for a batch, rather
+    // than for every article
+    size_t queued = m_scheduler.queued();
+    size_t batch = std::min(m_scheduler.get_prefetch_depth(), std::max<size_t>(m_maxsize / 2, 1));
+    if (m_waiting_producers.load() > 0 && queued + batch <= m_maxsize)
+    {
+        // Taking the lock makes sure the producer is either still about to
+        // check, or already waiting
+        {
+            std::lock_guard<std::mutex> _lock{m_space_lock};
+        }
+        m_queuecv.notify_all();
+    }
+}
 
-        // Transfer it into the busy list. This does not invalidate the iterator
-        m_busy.splice(m_busy.begin(), m_ready, it);
+void p2u::nntp::usenet::start_work(connection_handle_iterator conn, const work_item& item)
+{
+    // Must be called with m_bfm held
+    if (item.queued != std::chrono::steady_clock::time_point{})
+    {
+        auto waited = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - item.queued);
+        auto& wait = m_waits[static_cast<size_t>(item.priority)];
+        ++wait.items;
+        wait.total += waited;
+        wait.longest = std::max(wait.longest, waited);
+    }
 
-        start_async_post(it, msg);
-        return;
+    if (item.type == work_item::kind::POST)
+    {
+        start_async_post(conn, item.msg);
+    }
+    else
+    {
+        start_async_stat(conn, item.msgid);
     }
+}
 
-    if (!bypass_wait)
+void p2u::nntp::usenet::drain_to_ready()
+{
+    // Must be called with m_bfm held
+    connection_handle_iterator conn;
+    work_item item;
+    while (m_scheduler.drain(conn, item))
     {
-        if (m_maxsize != 0 && m_queue.size() >= m_maxsize)
-        {
-            m_queuecv.wait(_lock,
-                    [this](){return m_queue.size() < m_maxsize;});
-        }
+        on_popped();
+        start_work(conn, item);
     }
-    // Defer the start_async_post to a connection that will become ready.
-    m_queue.push_back(std::bind(&p2u::nntp::usenet::start_async_post, this, std::placeholders::_1, msg));
 }
 
 void p2u::nntp::usenet::on_conn_becomes_ready(connection_handle_iterator connit)
 {
-    std::lock_guard<std::mutex> _lock{m_bfm};
+    std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+    find_work(connit);
+}
+
+void p2u::nntp::usenet::find_work(connection_handle_iterator connit)
+{
+    // Must be called with m_bfm held
+    auto server = server_of(*connit);
+    if (server && server->shed > 0 && !winding_down())
+    {
+        // The ramp wants fewer connections to this server
+        --server->shed;
+        make_dormant(connit, server);
+        return;
+    }
 
-    if (m_queue.size() > 0)
+    work_item item;
+    if (m_scheduler.next_work(item, connit))
     {
         // Queue is non empty, we can just queue the next command without having
         // to splice the iterator back into the ready list
-        auto next_command = m_queue.front();
-        m_queue.pop_front();
-
-        // If we have a bounded queue, potentially producer(s) could be waiting
-        if (m_maxsize != 0)
-        {
-            m_queuecv.notify_one();
-        }
-
-        next_command(connit);
+        on_popped();
+        start_work(connit, item);
     }
     else
     {
         // There is no work for us to do at the moment, Let's put ourself back
         // into the ready queue
-        m_ready.splice(m_ready.end(), m_busy, connit);
+        m_scheduler.make_ready(connit);
+        m_idle_since[connit->get()] = std::chrono::steady_clock::now();
 
-        if (!m_work && m_queue.size() == 0)
+        // A producer may have pushed after we looked, but before it could
+        // see us idle. See the comment on m_bfm. The per-server queues are
+        // only touched with m_bfm held, nothing can have come in there.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_scheduler.take(item))
+        {
+            on_popped();
+            m_scheduler.take_ready(connit);
+            start_work(connit, item);
+        }
+        else if (winding_down() && !m_inflight.empty())
+        {
+            // Nothing new is coming. Rather than sit idle while the last
+            // few posts drag on, keep an eye out for stragglers.
+            start_tail_mode();
+        }
+        else if (winding_down() && m_scheduler.queued() == 0 && m_num_delayed == 0)
         {
-            auto& conn = *connit;
-            conn->async_graceful_disconnect();
-            m_busy.erase(connit);
+            wind_down();
+        }
+    }
+}
 
-            for (auto readyconnit = m_ready.begin(); readyconnit != m_ready.end();)
-            {
+void p2u::nntp::usenet::wind_down()
+{
+    // Must be called with m_bfm held
+    //
+    // Connections still waiting out a backoff have nothing left to do
+    stop_reconnecting();
 
-                (*readyconnit)->async_graceful_disconnect();
-                readyconnit = m_ready.erase(readyconnit);
+    // The QUIT is still in flight when this returns, so the connections are
+    // parked in m_closing rather than destroyed. Each says goodbye on its
+    // own thread.
+    auto disconnect = [](const connection_handle& conn)
+    {
+        auto ptr = conn.get();
+        ptr->get_io_service().post([ptr]()
+                {
+                    ptr->async_graceful_disconnect();
+                });
+    };
 
-            }
-            std::cerr << "[INFO] Gracefully disconnecting connection. Number of connections left: " << m_busy.size() + m_ready.size() << std::endl;
-        }
+    auto& ready = m_scheduler.ready();
+    std::for_each(ready.begin(), ready.end(), disconnect);
+    m_scheduler.release_ready(m_closing);
+
+    for (auto& server : m_conninfo)
+    {
+        std::for_each(server->spares.begin(), server->spares.end(), disconnect);
+        m_closing.splice(m_closing.end(), server->spares);
+    }
+
+    std::cerr << "[INFO] Gracefully disconnecting connection. Number of connections left: " << m_scheduler.busy().size() + m_scheduler.ready().size() << std::endl;
+    check_wound_down();
+}
+
+void p2u::nntp::usenet::check_wound_down()
+{
+    // Must be called with m_bfm held
+    //
+    // Normally the last connection to become ready winds everything down.
+    // This is for when the last busy one goes away instead, so nobody
+    // would notice.
+    if (!winding_down() || !m_scheduler.busy().empty())
+    {
+        return;
+    }
+
+    if (!m_scheduler.ready().empty() && m_scheduler.queued() == 0 && m_inflight.empty() && m_num_delayed == 0)
+    {
+        // Calls us again with no connection ready
+        wind_down();
+        return;
+    }
+
+    if (m_scheduler.ready().empty())
+    {
+        // Nothing can pick up work anymore. What's still in flight keeps
+        // its shard running until it's done.
+        m_work.clear();
+        stop_ramp();
+        stop_keepalive();
     }
 }
 
 void p2u::nntp::usenet::on_connected(connection_handle_iterator connit,
+        conn_info_element* server,
         p2u::nntp::connect_result result)
 {
     if (result == p2u::nntp::connect_result::FATAL_CONNECT_ERROR)
     {
-        std::cerr << "[ERROR] One of our connections could not connect. Hopefully somebody else can.." << std::endl;
-        discard_connection(connit);
+        server->supervisor->on_failure(connit->get());
+        {
+            // Often the server turning away one connection too many. With
+            // a ramp, put it aside rather than keep knocking, the ramp
+            // brings it back if it wants more. One is always left trying.
+            std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+            ++server->interval_errors;
+            if (server->ramp && !winding_down() &&
+                    (server->shed > 0 || active_connections(server) > 1))
+            {
+                server->shed -= std::min<size_t>(server->shed, 1);
+                server->supervisor->forget(connit->get());
+                make_dormant(connit, server);
+                return;
+            }
+        }
+
+        if (server->supervisor->failures(connit->get()) < server->info->max_connect_failures)
+        {
+            std::cerr << "[WARN] One of our connections could not connect. Retrying after a backoff.." << std::endl;
+            (*connit)->close();
+            schedule_reconnect(connit, server);
+        }
+        else
+        {
+            std::cerr << "[ERROR] One of our connections could not connect. Hopefully somebody else can.." << std::endl;
+            server->supervisor->forget(connit->get());
+            discard_connection(connit, server);
+        }
     }
     else if (result == p2u::nntp::connect_result::INVALID_CREDENTIALS)
     {
         std::cerr << "[ERROR] One of our connections reported invalid credentials. Hopefully there is someone else.." << std::endl;
-        discard_connection(connit);
+        server->supervisor->forget(connit->get());
+        discard_connection(connit, server);
     }
-    else
+    else if (!park_spare(connit, server))
     {
         on_conn_becomes_ready(connit);
     }
 }
 
+void p2u::nntp::usenet::schedule_reconnect(connection_handle_iterator connit,
+                                           conn_info_element* server)
+{
+    // Called without m_bfm. The supervisor's timers run on the first shard,
+    // the connection may live on another one.
+    auto conn = connit->get();
+    {
+        std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+        return_prefetched(connit);
+    }
+
+    bool scheduled = server->supervisor->schedule(conn, [conn]()
+            {
+                conn->get_io_service().post([conn]()
+                        {
+                            conn->async_connect();
+                        });
+            });
+
+    if (!scheduled)
+    {
+        // We are winding down, it won't be needed again
+        std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+        m_closing.splice(m_closing.end(), m_scheduler.busy(), connit);
+        check_wound_down();
+    }
+}
+
+void p2u::nntp::usenet::stop_reconnecting()
+{
+    // Must be called with m_bfm held
+    for (auto& server : m_conninfo)
+    {
+        auto cancelled = server->supervisor->stop();
+        for (auto slot : cancelled)
+        {
+            auto& busy = m_scheduler.busy();
+            auto it = std::find_if(busy.begin(), busy.end(),
+                    [slot](const connection_handle& conn)
+                    {
+                        return conn.get() == slot;
+                    });
+            if (it != busy.end())
+            {
+                retire_connection(*it);
+                busy.erase(it);
+            }
+        }
+    }
+}
+
 void p2u::nntp::usenet::on_stat_finished(connection_handle_iterator conn,
+                                         conn_info_element* server,
                                          const std::string& msgid,
                                          p2u::nntp::stat_result stat_result)
 {
+    std::shared_ptr<p2u::nntp::article> unacknowledged;
+    {
+        std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+        auto it = m_unacknowledged.find(msgid);
+        if (it != m_unacknowledged.end())
+        {
+            unacknowledged = it->second;
+
+            // A connection error just retries the STAT
+            if (stat_result != p2u::nntp::stat_result::CONNECTION_ERROR)
+            {
+                m_unacknowledged.erase(it);
+            }
+        }
+    }
+
     if (stat_result == p2u::nntp::stat_result::CONNECTION_ERROR)
     {
         std::cout << "[ERROR] Stat for " << msgid << " failed with connection error. Retrying.." << std::endl;
-        std::lock_guard<std::mutex> _lock{m_bfm};
-        m_queue.push_back(std::bind(&p2u::nntp::usenet::start_async_stat, this, std::placeholders::_1, msgid));
+        {
+            // Same server, it's the one that has to know
+            std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+            ++server->interval_errors;
+            work_item item;
+            item.type = work_item::kind::STAT;
+            item.priority = post_priority::VERIFY;
+            item.msgid = msgid;
+            dispatch_local(std::move(item), server);
+        }
 
         (*conn)->close();
-        (*conn)->async_connect();
+        server->supervisor->on_failure(conn->get());
+        schedule_reconnect(conn, server);
+
+        std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+        promote_spare(server);
+    }
+    else if (unacknowledged)
+    {
+        server->supervisor->on_success(conn->get());
+        if (stat_result == p2u::nntp::stat_result::ARTICLE_EXISTS)
+        {
+            {
+                std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+                ++m_num_landed;
+                m_bytes_not_reposted += unacknowledged->get_payload_size();
+            }
+
+            if (m_slot_finish_post)
+            {
+                m_slot_finish_post(unacknowledged);
+            }
+        }
+        else
+        {
+            // Requeue before this connection looks for work again, so that
+            // we don't start winding down with the re-upload still pending
+            retry_post(unacknowledged, nullptr, false);
+        }
+        on_conn_becomes_ready(conn);
     }
     else
     {
+        server->supervisor->on_success(conn->get());
         on_conn_becomes_ready(conn);
         // Pass through to our observers
         if (m_slot_finish_stat)
@@ -183,111 +654,1032 @@ void p2u::nntp::usenet::on_stat_finished(connection_handle_iterator conn,
     }
 }
 
-void p2u::nntp::usenet::dispatch_or_queue(const queued_command& cmd, bool front)
+void p2u::nntp::usenet::verify_unacknowledged(const std::shared_ptr<p2u::nntp::article>& msg,
+                                               conn_info_element* server)
+{
+    // Most of the time only the 240 got lost. A STAT costs a round trip,
+    // re-uploading costs the whole article and leaves a duplicate behind.
+    // Only the server we sent it to can tell, another provider would just
+    // say it has never heard of it.
+    const auto& msgid = msg->get_header().msgid;
+    std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+    m_unacknowledged[msgid] = msg;
+    ++m_num_unacknowledged;
+
+    work_item item;
+    item.type = work_item::kind::STAT;
+    item.priority = post_priority::VERIFY;
+    item.msgid = msgid;
+    dispatch_local(std::move(item), server);
+}
+
+void p2u::nntp::usenet::dispatch_local(work_item&& item, conn_info_element* server)
+{
+    // Must be called with m_bfm held. Stamped in case it has to wait.
+    item.queued = std::chrono::steady_clock::now();
+    connection_handle_iterator conn;
+    if (m_scheduler.place_local(item, server->id, conn))
+    {
+        // Never queued, so it didn't wait
+        item.queued = std::chrono::steady_clock::time_point{};
+        start_work(conn, item);
+    }
+}
+
+void p2u::nntp::usenet::orphan_local(conn_info_element* server)
 {
-    std::lock_guard<std::mutex> _lock{m_bfm};
+    // Must be called with m_bfm held
+    if (m_scheduler.orphan(server->id))
+    {
+        drain_to_ready();
+    }
+}
 
-    if (m_ready.size() > 0)
+void p2u::nntp::usenet::on_ramp_timer(const boost::system::error_code& ec)
+{
+    if (ec)
     {
-        // Get the iterator to the connection_handle that will enqueue the task
-        auto it = m_ready.begin();
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_ramp_last);
+    m_ramp_last = now;
 
-        // Transfer it into the busy list. This does not invalidate the iterator
-        m_busy.splice(m_busy.begin(), m_ready, it);
-        cmd(it);
+    std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+    if (!m_ramp_active || (winding_down() && m_scheduler.queued() == 0))
+    {
+        // stop_ramp() came too late to cancel us, or there is nothing
+        // left to ramp up for
+        return;
     }
-    else
+
+    // More connections can only help while work is waiting for one
+    bool backlog = m_scheduler.queued() > 0 && m_scheduler.idle() == 0;
+    for (auto& server : m_conninfo)
     {
-        if (front)
+        if (!server->ramp)
         {
-            m_queue.push_front(cmd);
+            continue;
         }
-        else
+
+        auto bytes = server->interval_bytes;
+        auto errors = server->interval_errors;
+        auto decision = server->ramp->on_interval(bytes, server->interval_posts,
+                server->interval_busy, errors, backlog);
+        server->interval_bytes = 0;
+        server->interval_posts = 0;
+        server->interval_busy = std::chrono::milliseconds{0};
+        server->interval_errors = 0;
+
+        // Even on hold, connections may have been put aside since
+        apply_ramp(server.get(), decision.target);
+        if (decision.what == p2u::nntp::connection_ramp::action::HOLD)
         {
-            m_queue.push_back(cmd);
+            continue;
         }
+
+        std::cerr << "[INFO] " << server->info->serveraddr << ":" << server->info->port
+            << " - " << (decision.what == p2u::nntp::connection_ramp::action::GROW ? "up" : "down")
+            << " to " << decision.target << " connections, " << decision.reason << " ("
+            << bytes * 1000 / 1024 / std::max<std::int64_t>(elapsed.count(), 1) << " KB/s, "
+            << errors << " errors)" << std::endl;
     }
+
+    m_ramp_timer.expires_from_now(boost::posix_time::milliseconds(RAMP_INTERVAL_MS));
+    m_ramp_timer.async_wait(std::bind(&p2u::nntp::usenet::on_ramp_timer, this, std::placeholders::_1));
 }
 
-void p2u::nntp::usenet::discard_connection(connection_handle_iterator conn)
+void p2u::nntp::usenet::stop_ramp()
 {
-    std::lock_guard<std::mutex> _lock{m_bfm};
-    m_busy.erase(conn);
-
-    std::cerr << "[INFO] Number of connections left: " << m_busy.size() + m_ready.size() << std::endl;
-
-    if (m_busy.size() == 0 && m_ready.size() == 0)
+    // Must be called with m_bfm held
+    //
+    // A pending wait would keep the first shard running
+    if (!m_ramp_active)
     {
-        // We have no more connections to work with, so we can't do any work
-        std::cerr << "[FATAL] No more connections to work with. " << std::endl;
-        m_work.reset();
+        return;
     }
+
+    m_ramp_active = false;
+    home_service().post([this]()
+            {
+                m_ramp_timer.cancel();
+            });
 }
 
-void p2u::nntp::usenet::on_post_finished(connection_handle_iterator connit,
-                                const std::shared_ptr<p2u::nntp::article>& msg,
-                                p2u::nntp::post_result post_result)
+void p2u::nntp::usenet::on_keepalive_timer(const boost::system::error_code& ec)
 {
-
-    if (post_result == p2u::nntp::post_result::POSTING_NOT_PERMITTED)
+    if (ec)
     {
-        std::cerr << "[ERROR] Posting not permitted on one of our connections. Disconnecting and hoping that someone else can do our job..." << std::endl;
-        (*connit)->close();
-
-        discard_connection(connit);
-        dispatch_or_queue(std::bind(&p2u::nntp::usenet::start_async_post, this, std::placeholders::_1, msg));
+        return;
     }
-    else if (post_result == p2u::nntp::post_result::POST_FAILURE)
+
+    std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+    if (!m_keepalive_active || winding_down())
     {
-        if (m_slot_post_failed)
-        {
-            m_slot_post_failed(msg);
-        }
-        on_conn_becomes_ready(connit);
+        m_keepalive_active = false;
+        return;
     }
-    else if (post_result ==
-            p2u::nntp::post_result::POST_FAILURE_CONNECTION_ERROR)
+
+    auto now = std::chrono::steady_clock::now();
+    auto due = [this, now](const connection_handle& conn, const conn_info_element* server)
     {
+        return server && server->info->idle_keepalive > 0 &&
+            now - m_idle_since[conn.get()] >= std::chrono::seconds{server->info->idle_keepalive};
+    };
 
-        (*connit)->close();
-        (*connit)->async_connect();
-        if (m_slot_post_failed)
+    auto& ready = m_scheduler.ready();
+    for (auto it = ready.begin(); it != ready.end();)
+    {
+        auto conn = it++;
+        auto server = server_of(*conn);
+        if (due(*conn, server))
         {
-            m_slot_post_failed(msg);
+            m_scheduler.take_ready(conn);
+            send_keepalive(conn, server);
         }
     }
-    else
+
+    for (auto& server : m_conninfo)
     {
-        on_conn_becomes_ready(connit);
-        if (m_slot_finish_post)
+        auto& spares = server->spares;
+        for (auto it = spares.begin(); it != spares.end();)
         {
-            m_slot_finish_post(msg);
+            auto conn = it++;
+            if (due(*conn, server.get()))
+            {
+                m_scheduler.busy().splice(m_scheduler.busy().end(), spares, conn);
+                send_keepalive(conn, server.get());
+            }
         }
     }
+
+    m_keepalive_timer.expires_from_now(boost::posix_time::milliseconds(KEEPALIVE_CHECK_INTERVAL_MS));
+    m_keepalive_timer.async_wait(std::bind(&p2u::nntp::usenet::on_keepalive_timer, this, std::placeholders::_1));
 }
 
-void p2u::nntp::usenet::join()
+void p2u::nntp::usenet::stop_keepalive()
 {
-    for(auto& thread : m_iothreads)
+    // Must be called with m_bfm held
+    //
+    // A pending wait would keep the first shard running
+    if (!m_keepalive_active)
     {
-        thread.join();
+        return;
     }
+
+    m_keepalive_active = false;
+    home_service().post([this]()
+            {
+                m_keepalive_timer.cancel();
+            });
 }
 
-void p2u::nntp::usenet::stop()
+void p2u::nntp::usenet::send_keepalive(connection_handle_iterator conn,
+                                       conn_info_element* server)
 {
-    m_work.reset();
+    // Must be called with m_bfm held. The connection is busy, so
+    // nobody hands it work meanwhile. The DATE goes out on its own shard.
+    ++server->keepalives;
+    (*conn)->get_io_service().post([this, conn, server]()
+            {
+                if (!(*conn)->async_keepalive())
+                {
+                    on_keepalive(conn, server, false);
+                }
+            });
 }
 
-void p2u::nntp::usenet::start()
+void p2u::nntp::usenet::on_keepalive(connection_handle_iterator connit,
+                                     conn_info_element* server, bool alive)
 {
-    m_work = std::make_unique<boost::asio::io_service::work>(m_iosvc);
-    for (size_t i = 0; i < m_numthreads; ++i)
+    if (alive)
     {
-        m_iothreads.emplace_back([this](){ m_iosvc.run(); });
+        // Back where it came from, or wherever it is needed now
+        if (!park_spare(connit, server))
+        {
+            on_conn_becomes_ready(connit);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+        ++server->keepalive_drops;
+    }
+
+    // Now rather than with the next article
+    std::cerr << "[INFO] " << server->info->serveraddr << ":" << server->info->port
+        << " - an idle connection was dropped. Reconnecting.." << std::endl;
+    (*connit)->close();
+    schedule_reconnect(connit, server);
+}
+
+void p2u::nntp::usenet::apply_ramp(conn_info_element* server, size_t target)
+{
+    // Must be called with m_bfm held
+    server->load.set_connections(target);
+
+    auto active = active_connections(server);
+    auto wanted = active - std::min(active, server->shed);
+
+    // Keep what was about to go first, then wake up more
+    while (wanted < target && server->shed > 0)
+    {
+        --server->shed;
+        ++wanted;
+    }
+    while (wanted < target && !server->dormant.empty())
+    {
+        wake_dormant(server);
+        ++wanted;
+    }
+
+    // Idle ones go right away, busy ones once they are done
+    while (wanted > target)
+    {
+        auto& ready = m_scheduler.ready();
+        auto it = std::find_if(ready.begin(), ready.end(), [server](const connection_handle& conn)
+                {
+                    return &conn->get_connection_info() == server->info.get();
+                });
+        if (it != ready.end())
+        {
+            m_scheduler.take_ready(it);
+            make_dormant(it, server);
+        }
+        else
+        {
+            ++server->shed;
+        }
+        --wanted;
+    }
+}
+
+size_t p2u::nntp::usenet::active_connections(const conn_info_element* server) const
+{
+    // Must be called with m_bfm held
+    auto mine = [server](const connection_handle& conn)
+    {
+        return &conn->get_connection_info() == server->info.get();
+    };
+    const auto& busy = m_scheduler.busy();
+    const auto& ready = m_scheduler.ready();
+    return std::count_if(busy.begin(), busy.end(), mine) +
+        std::count_if(ready.begin(), ready.end(), mine);
+}
+
+void p2u::nntp::usenet::wake_dormant(conn_info_element* server)
+{
+    // Must be called with m_bfm held
+    auto connit = server->dormant.begin();
+    m_scheduler.busy().splice(m_scheduler.busy().end(), server->dormant, connit);
+
+    // schedule_reconnect takes m_bfm itself
+    home_service().post([this, connit, server]()
+            {
+                schedule_reconnect(connit, server);
+            });
+}
+
+void p2u::nntp::usenet::make_dormant(connection_handle_iterator connit,
+                                     conn_info_element* server)
+{
+    // Must be called with m_bfm held, the connection busy
+    return_prefetched(connit);
+    server->dormant.splice(server->dormant.end(), m_scheduler.busy(), connit);
+
+    auto ptr = connit->get();
+    ptr->get_io_service().post([ptr]()
+            {
+                ptr->close();
+            });
+}
+
+void p2u::nntp::usenet::retire_connection(const connection_handle& conn)
+{
+    // Must be called with m_bfm held, or once the io threads are gone
+    for (auto& server : m_conninfo)
+    {
+        if (server->info.get() != &conn->get_connection_info())
+        {
+            continue;
+        }
+
+        auto compression = conn->get_compression_report();
+        server->compression.bytes += compression.bytes;
+        server->compression.sessions += compression.sessions;
+        server->compression.payload_sessions += compression.payload_sessions;
+
+        const auto& stats = conn->get_transfer_statistics();
+        if (stats.articles > 0)
+        {
+            server->transfers.push_back(stats);
+            for (auto& shard : m_shards)
+            {
+                if (&shard->iosvc == &conn->get_io_service())
+                {
+                    shard->transfers.push_back(stats);
+                }
+            }
+            if (!conn->get_bind_address().is_unspecified())
+            {
+                server->source_transfers[conn->get_bind_address().to_string()].push_back(stats);
+            }
+        }
+        return;
+    }
+}
+
+bool p2u::nntp::usenet::no_connections_left() const
+{
+    // Must be called with m_bfm held
+    return m_scheduler.busy().empty() && m_scheduler.ready().empty();
+}
+
+bool p2u::nntp::usenet::park_spare(connection_handle_iterator conn,
+                                   conn_info_element* server)
+{
+    std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+
+    // Once we are winding down, every connection goes through the ready
+    // list so it gets disconnected. Nor does it sit out while work waits
+    // for its server.
+    if (winding_down() || server->spares.size() >= server->info->spare_connections ||
+            m_scheduler.has_local(server->id))
+    {
+        return false;
+    }
+
+    server->spares.splice(server->spares.end(), m_scheduler.busy(), conn);
+    m_idle_since[conn->get()] = std::chrono::steady_clock::now();
+    return true;
+}
+
+bool p2u::nntp::usenet::promote_spare(conn_info_element* server)
+{
+    // Must be called with m_bfm held
+    if (server->spares.empty())
+    {
+        return false;
+    }
+
+    auto spare = server->spares.begin();
+    m_scheduler.busy().splice(m_scheduler.busy().end(), server->spares, spare);
+    ++server->spare_swaps;
+
+    // on_conn_becomes_ready takes m_bfm itself. It runs on the spare's own
+    // thread, like all of its handlers.
+    (*spare)->get_io_service().post([this, spare]()
+            {
+                on_conn_becomes_ready(spare);
+            });
+    return true;
+}
+
+void p2u::nntp::usenet::discard_connection(connection_handle_iterator conn,
+                                           conn_info_element* server)
+{
+    server->health->forget(conn->get());
+
+    bool stranded = false;
+    {
+        std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+        return_prefetched(conn);
+        m_scheduler.forget(conn);
+        m_idle_since.erase(conn->get());
+        retire_connection(*conn);
+        m_scheduler.busy().erase(conn);
+
+        // Take over the slot. If that server has no spare but nothing is left to
+        // post with, any spare will do.
+        if (!promote_spare(server) && no_connections_left())
+        {
+            for (auto& other : m_conninfo)
+            {
+                if (promote_spare(other.get()))
+                {
+                    break;
+                }
+            }
+        }
+
+        // Rather than give up, bring back one the ramp had put aside
+        if (no_connections_left() && !(winding_down() && m_scheduler.queued() == 0))
+        {
+            for (auto& other : m_conninfo)
+            {
+                if (!other->dormant.empty())
+                {
+                    wake_dormant(other.get());
+                    break;
+                }
+            }
+        }
+
+        orphan_local(server);
+
+        std::cerr << "[INFO] Number of connections left: " << m_scheduler.busy().size() + m_scheduler.ready().size() << std::endl;
+
+        if (no_connections_left())
+        {
+            // We have no more connections to work with, so we can't do any work
+            std::cerr << "[FATAL] No more connections to work with. " << std::endl;
+            m_winding_down = true;
+            m_work.clear();
+            stop_ramp();
+            stop_keepalive();
+
+            // Nobody is going to drain the queue, so don't leave producers hanging
+            m_stranded.store(true);
+            {
+                std::lock_guard<std::mutex> _space_lock{m_space_lock};
+            }
+            m_queuecv.notify_all();
+            stranded = true;
+        }
+        else
+        {
+            check_wound_down();
+        }
+    }
+
+    // Not with m_bfm held, it's user code
+    if (stranded && m_slot_stranded)
+    {
+        m_slot_stranded();
+    }
+}
+
+void p2u::nntp::usenet::on_post_finished(connection_handle_iterator connit,
+                                conn_info_element* server,
+                                const std::shared_ptr<p2u::nntp::article>& msg,
+                                p2u::nntp::post_result post_result)
+{
+    bool lost_race = false;
+    bool recycle = false;
+    std::chrono::steady_clock::time_point started;
+    if (post_result == p2u::nntp::post_result::POST_SUCCESS)
+    {
+        // Both lock themselves. Done up front, so the connection can be
+        // given its next article while we hold m_bfm anyway.
+        server->supervisor->on_success(connit->get());
+        recycle = server->health->record(connit->get(), (*connit)->get_transfer_statistics());
+    }
+
+    {
+        std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+        std::shared_ptr<hedge_state> hedge;
+        conn_info_element* owner = nullptr;
+        auto it = m_inflight.find(msg.get());
+        if (it != m_inflight.end())
+        {
+            started = it->second.started;
+            hedge = it->second.hedge;
+            owner = it->second.server;
+            m_inflight.erase(it);
+        }
+
+        if (owner)
+        {
+            auto bytes = msg->get_payload_size();
+            if (hedge && hedge->settled)
+            {
+                owner->load.on_abandoned(bytes);
+            }
+            else if (post_result == p2u::nntp::post_result::POST_SUCCESS)
+            {
+                owner->load.on_posted(bytes, std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - started));
+            }
+            else
+            {
+                owner->load.on_failed(bytes);
+            }
+        }
+
+        if (hedge && hedge->settled)
+        {
+            lost_race = true;
+        }
+        else if (hedge && post_result == p2u::nntp::post_result::POST_SUCCESS)
+        {
+            // We won. Cut the others off so the job doesn't wait for them.
+            hedge->settled = true;
+            if (hedge->racers.front() != msg.get())
+            {
+                ++m_num_hedges_won;
+            }
+
+            // Their entries stay until their handlers come back, so they
+            // are recognised as losers
+            for (auto racer : hedge->racers)
+            {
+                auto other = m_inflight.find(racer);
+                if (other != m_inflight.end())
+                {
+                    auto conn = other->second.conn;
+                    conn->get_io_service().post([conn]()
+                            {
+                                conn->close();
+                            });
+                }
+            }
+        }
+        else if (hedge)
+        {
+            // Failed, but another racer may still make it
+            lost_race = std::any_of(hedge->racers.begin(), hedge->racers.end(),
+                    [this](const article* racer)
+                    {
+                        return m_inflight.count(racer) > 0;
+                    });
+        }
+
+        if (!lost_race && post_result == p2u::nntp::post_result::POST_SUCCESS)
+        {
+            m_post_failures.erase(msg.get());
+            server->interval_bytes += msg->get_payload_size();
+            ++server->interval_posts;
+            if (started != std::chrono::steady_clock::time_point{})
+            {
+                server->interval_busy += std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - started);
+            }
+
+            // Not worth it once we're winding down
+            recycle = recycle && !winding_down();
+            if (!recycle)
+            {
+                find_work(connit);
+            }
+        }
+    }
+
+    if (lost_race)
+    {
+        // Only the connection needs looking after. The winner closed it,
+        // or is about to, even if our answer got in first.
+        (*connit)->close();
+        schedule_reconnect(connit, server);
+        return;
+    }
+
+    if (post_result == p2u::nntp::post_result::POSTING_NOT_PERMITTED)
+    {
+        std::cerr << "[ERROR] Posting not permitted on one of our connections. Disconnecting and hoping that someone else can do our job..." << std::endl;
+        (*connit)->close();
+
+        discard_connection(connit, server);
+
+        // Not the article's fault, so it doesn't count as a failure
+        dispatch_post(msg, server);
+    }
+    else if (post_result == p2u::nntp::post_result::POST_FAILURE)
+    {
+        int code = (*connit)->get_last_response_code();
+        auto action = p2u::nntp::classify_post_failure(code);
+        {
+            std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+            ++m_failure_actions[static_cast<size_t>(action)];
+
+            // Transient failures are what throttling looks like
+            if (action == p2u::nntp::post_failure_action::RESCHEDULE)
+            {
+                ++server->interval_errors;
+            }
+        }
+
+        // Before the connection looks for its next article. If this was the
+        // last one, it would find nothing queued and wind the job down
+        // while the retry is still on its way.
+        switch (action)
+        {
+            case p2u::nntp::post_failure_action::SKIP:
+                std::cerr << "[ERROR] Server rejected " << msg->get_header().msgid << " (" << code << "). Skipping it." << std::endl;
+                give_up_post(msg);
+                break;
+            case p2u::nntp::post_failure_action::REAUTHENTICATE:
+                retry_post(msg, nullptr, false);
+                break;
+            case p2u::nntp::post_failure_action::MOVE_SERVER:
+                retry_post(msg, server, false);
+                break;
+            default:
+                retry_post(msg, nullptr, true);
+                break;
+        }
+
+        if (action == p2u::nntp::post_failure_action::REAUTHENTICATE ||
+                code == 400 || code == 503)
+        {
+            // The server is done with this session. Connecting again logs
+            // us back in, after a backoff if it keeps happening.
+            (*connit)->close();
+            if (action != p2u::nntp::post_failure_action::REAUTHENTICATE)
+            {
+                server->supervisor->on_failure(connit->get());
+            }
+            schedule_reconnect(connit, server);
+
+            std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+            promote_spare(server);
+        }
+        else
+        {
+            on_conn_becomes_ready(connit);
+        }
+    }
+    else if (post_result == p2u::nntp::post_result::POST_FAILURE_CONNECTION_ERROR ||
+            post_result == p2u::nntp::post_result::POST_FAILURE_UNACKNOWLEDGED)
+    {
+
+        (*connit)->close();
+        server->supervisor->on_failure(connit->get());
+        schedule_reconnect(connit, server);
+        {
+            // The broken one reconnects in the background and becomes the
+            // next spare
+            std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+            ++server->interval_errors;
+            promote_spare(server);
+        }
+
+        if (post_result == p2u::nntp::post_result::POST_FAILURE_UNACKNOWLEDGED)
+        {
+            verify_unacknowledged(msg, server);
+        }
+        else
+        {
+            // The connection was the problem, any other one will do
+            retry_post(msg, nullptr, false);
+        }
+    }
+    else
+    {
+        if (started != std::chrono::steady_clock::time_point{})
+        {
+            server->latency->record(p2u::nntp::latency_phase::POST_COMPLETE,
+                    std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - started));
+        }
+
+        // Otherwise it has moved on to its next article already
+        if (recycle)
+        {
+            std::cerr << "[INFO] Recycling a connection that fell far behind the others" << std::endl;
+            (*connit)->close();
+            schedule_reconnect(connit, server);
+
+            std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+            promote_spare(server);
+        }
+
+        if (m_slot_finish_post)
+        {
+            m_slot_finish_post(msg);
+        }
+    }
+}
+
+void p2u::nntp::usenet::retry_post(const std::shared_ptr<p2u::nntp::article>& msg,
+                                   conn_info_element* avoid,
+                                   bool delayed)
+{
+    unsigned int failures;
+    {
+        std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+        failures = ++m_post_failures[msg.get()];
+    }
+
+    if (m_retry->exhausted(failures))
+    {
+        std::cerr << "[ERROR] Too many failures while posting " << msg->get_header().msgid << ". Giving up on it." << std::endl;
+        give_up_post(msg);
+        return;
+    }
+
+    if (m_slot_post_retry)
+    {
+        m_slot_post_retry(msg);
+    }
+
+    if (delayed)
+    {
+        {
+            std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+            ++m_num_delayed;
+        }
+
+        m_delayed.schedule(m_retry->delay_for(failures), [this, msg, avoid]()
+                {
+                    // Under the same lock, so it is never in neither place
+                    std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+                    --m_num_delayed;
+                    place_post(msg, avoid);
+                });
+    }
+    else
+    {
+        dispatch_post(msg, avoid);
+    }
+}
+
+void p2u::nntp::usenet::give_up_post(const std::shared_ptr<p2u::nntp::article>& msg)
+{
+    {
+        std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+        m_post_failures.erase(msg.get());
+        ++m_num_given_up;
+    }
+
+    if (m_slot_post_failed)
+    {
+        m_slot_post_failed(msg);
     }
 }
 
+void p2u::nntp::usenet::dispatch_post(const std::shared_ptr<p2u::nntp::article>& msg,
+                                      conn_info_element* avoid)
+{
+    std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+    place_post(msg, avoid);
+}
+
+void p2u::nntp::usenet::place_post(const std::shared_ptr<p2u::nntp::article>& msg,
+                                   conn_info_element* avoid)
+{
+    // Must be called with m_bfm held
+    work_item item;
+    item.type = work_item::kind::POST;
+    item.priority = post_priority::RETRY;
+    item.msg = msg;
+    item.avoid = avoid ? avoid->id : NO_SERVER;
+    item.queued = std::chrono::steady_clock::now();
+
+    connection_handle_iterator conn;
+    if (m_scheduler.place(item, conn))
+    {
+        start_async_post(conn, msg);
+    }
+}
+
+p2u::nntp::usenet::conn_info_element* p2u::nntp::usenet::server_of(const connection_handle& conn) const
+{
+    for (const auto& server : m_conninfo)
+    {
+        if (server->info.get() == &conn->get_connection_info())
+        {
+            return server.get();
+        }
+    }
+    return nullptr;
+}
+
+void p2u::nntp::usenet::start_tail_mode()
+{
+    // Must be called with m_bfm held
+    if (m_tail_active)
+    {
+        return;
+    }
+
+    m_tail_active = true;
+    m_tail_timer.expires_from_now(boost::posix_time::milliseconds(0));
+    m_tail_timer.async_wait(std::bind(&p2u::nntp::usenet::on_tail_timer, this, std::placeholders::_1));
+}
+
+void p2u::nntp::usenet::on_tail_timer(const boost::system::error_code& ec)
+{
+    if (ec)
+    {
+        return;
+    }
+
+    hedge_stragglers();
+
+    std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+    if (m_inflight.empty())
+    {
+        m_tail_active = false;
+        return;
+    }
+
+    m_tail_timer.expires_from_now(boost::posix_time::milliseconds(TAIL_CHECK_INTERVAL_MS));
+    m_tail_timer.async_wait(std::bind(&p2u::nntp::usenet::on_tail_timer, this, std::placeholders::_1));
+}
+
+void p2u::nntp::usenet::hedge_stragglers()
+{
+    struct candidate
+    {
+        std::shared_ptr<article> msg;
+        conn_info_element* server;
+        std::shared_ptr<hedge_state> hedge;
+    };
+
+    std::vector<candidate> candidates;
+    {
+        std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+        auto now = std::chrono::steady_clock::now();
+        size_t idle = m_scheduler.ready().size();
+
+        for (auto& entry : m_inflight)
+        {
+            auto& post = entry.second;
+            if (idle == 0)
+            {
+                break;
+            }
+
+            // Once per article, and never a copy of a copy
+            if (post.hedge || !post.server || post.server->info->hedge_percentile <= 0 ||
+                    post.msg->is_cancelled())
+            {
+                continue;
+            }
+
+            auto threshold = post.server->latency->percentile(
+                    p2u::nntp::latency_phase::POST_COMPLETE, post.server->info->hedge_percentile);
+            if (threshold.count() <= 0 || now - post.started < threshold)
+            {
+                continue;
+            }
+
+            post.hedge = std::make_shared<hedge_state>();
+            post.hedge->racers.push_back(entry.first);
+            candidates.push_back(candidate{post.msg, post.server, post.hedge});
+            --idle;
+        }
+    }
+
+    for (auto& straggler : candidates)
+    {
+        // Copying and renaming happens outside the lock, the callback is
+        // user code
+        auto copy = std::make_shared<article>(*straggler.msg);
+        if (m_slot_post_hedge)
+        {
+            m_slot_post_hedge(copy);
+        }
+
+        std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+
+        // It may have finished in the meantime
+        if (straggler.hedge->settled || m_inflight.count(straggler.msg.get()) == 0)
+        {
+            continue;
+        }
+
+        auto it = m_scheduler.pick_ready(straggler.server->id);
+        if (it == m_scheduler.ready().end())
+        {
+            continue;
+        }
+
+        m_scheduler.take_ready(it);
+        straggler.hedge->racers.push_back(copy.get());
+        ++m_num_hedged;
+
+        std::cerr << "[INFO] Racing straggling post " << straggler.msg->get_header().msgid
+            << " against a copy as " << copy->get_header().msgid << std::endl;
+        start_async_post(it, copy, straggler.hedge);
+    }
+}
+
+std::vector<std::unique_ptr<p2u::nntp::usenet::io_shard>> p2u::nntp::usenet::make_shards(size_t iothreads)
+{
+    std::vector<std::unique_ptr<io_shard>> shards;
+    for (size_t i = 0; i < shard_count(iothreads); ++i)
+    {
+        shards.emplace_back(std::make_unique<io_shard>());
+    }
+    return shards;
+}
+
+boost::asio::io_service& p2u::nntp::usenet::home_service()
+{
+    return m_shards.front()->iosvc;
+}
+
+p2u::nntp::usenet::io_shard& p2u::nntp::usenet::least_loaded_shard()
+{
+    return **std::min_element(m_shards.begin(), m_shards.end(),
+            [](const std::unique_ptr<io_shard>& a, const std::unique_ptr<io_shard>& b)
+            {
+                return a->num_connections < b->num_connections;
+            });
+}
+
+bool p2u::nntp::usenet::winding_down() const
+{
+    // Must be called with m_bfm held
+    return m_winding_down;
+}
+
+void p2u::nntp::usenet::join()
+{
+    for (auto& shard : m_shards)
+    {
+        if (shard->thread.joinable())
+        {
+            shard->thread.join();
+        }
+    }
+
+    // Nothing is in flight anymore
+    for (const auto& conn : m_closing)
+    {
+        retire_connection(conn);
+    }
+    m_closing.clear();
+
+    for (auto& server : m_conninfo)
+    {
+        for (const auto& conn : server->dormant)
+        {
+            retire_connection(conn);
+        }
+        server->dormant.clear();
+    }
+}
+
+void p2u::nntp::usenet::stop()
+{
+    std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+    m_winding_down = true;
+
+    // Everybody may be idle already
+    check_wound_down();
+}
+
+void p2u::nntp::usenet::start()
+{
+    std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+    for (size_t i = 0; i < m_shards.size(); ++i)
+    {
+        auto& shard = *m_shards[i];
+
+        // A shard nobody was put on would only idle. The first one always
+        // runs, the timers of the whole job live there.
+        if (i > 0 && shard.num_connections == 0)
+        {
+            continue;
+        }
+
+        m_work.emplace_back(std::make_unique<boost::asio::io_service::work>(shard.iosvc));
+        shard.thread = std::thread([&shard]()
+                {
+                    if (shard.cpu >= 0)
+                    {
+                        // Before the first handler runs, so the buffers and
+                        // TLS state this thread allocates are local
+                        auto error = p2u::util::place_this_thread({shard.cpu});
+                        if (!error.empty())
+                        {
+                            std::cerr << "[WARN] Could not place io thread on CPU "
+                                << shard.cpu << ": " << error << std::endl;
+                        }
+                    }
+                    shard.iosvc.run();
+                });
+    }
+
+    if (std::any_of(m_conninfo.begin(), m_conninfo.end(),
+                [](const std::unique_ptr<conn_info_element>& server) { return server->ramp != nullptr; }))
+    {
+        // Posted, so the timer is only ever touched on the first shard
+        m_ramp_active = true;
+        home_service().post([this]()
+                {
+                    m_ramp_last = std::chrono::steady_clock::now();
+                    m_ramp_timer.expires_from_now(boost::posix_time::milliseconds(RAMP_INTERVAL_MS));
+                    m_ramp_timer.async_wait(std::bind(&p2u::nntp::usenet::on_ramp_timer, this, std::placeholders::_1));
+                });
+    }
+
+    if (std::any_of(m_conninfo.begin(), m_conninfo.end(),
+                [](const std::unique_ptr<conn_info_element>& server) { return server->info->idle_keepalive > 0; }))
+    {
+        m_keepalive_active = true;
+        home_service().post([this]()
+                {
+                    m_keepalive_timer.expires_from_now(boost::posix_time::milliseconds(KEEPALIVE_CHECK_INTERVAL_MS));
+                    m_keepalive_timer.async_wait(std::bind(&p2u::nntp::usenet::on_keepalive_timer, this, std::placeholders::_1));
+                });
+    }
+}
+
+void p2u::nntp::usenet::set_post_retry_callback(const post_event_callback& func)
+{
+    m_slot_post_retry = func;
+}
+
+void p2u::nntp::usenet::set_post_hedge_callback(const post_event_callback& func)
+{
+    m_slot_post_hedge = func;
+}
+
 void p2u::nntp::usenet::set_post_failed_callback(const post_event_callback& func)
 {
     m_slot_post_failed = func;
@@ -298,6 +1690,16 @@ void p2u::nntp::usenet::set_post_finished_callback(const post_event_callback& fu
     m_slot_finish_post = func;
 }
 
+void p2u::nntp::usenet::set_post_cancelled_callback(const post_event_callback& func)
+{
+    m_slot_post_cancelled = func;
+}
+
+void p2u::nntp::usenet::set_stranded_callback(const stranded_callback& func)
+{
+    m_slot_stranded = func;
+}
+
 void p2u::nntp::usenet::set_stat_finished_callback(const on_finish_stat& func)
 {
     m_slot_finish_stat = func;
@@ -306,25 +1708,350 @@ void p2u::nntp::usenet::set_stat_finished_callback(const on_finish_stat& func)
 size_t p2u::nntp::usenet::get_queue_size() const
 {
     // Intentionally NOT guarding it with a mutex, see note in header
-    return m_queue.size();
+    return m_scheduler.queued();
 }
 
 
 void p2u::nntp::usenet::add_connections(const p2u::nntp::connection_info& conninfo,
                                         size_t num_connections)
 {
-    m_conninfo.emplace_back(std::make_unique<p2u::nntp::connection_info>(conninfo), num_connections);
-    auto& it = m_conninfo.back();
+    m_conninfo.emplace_back(std::make_unique<conn_info_element>(
+            std::make_unique<p2u::nntp::connection_info>(conninfo), num_connections,
+            std::make_shared<p2u::nntp::resolver_cache>(home_service(), conninfo.serveraddr,
+                conninfo.port, conninfo.dns_cache_ttl),
+            std::make_unique<p2u::nntp::connect_supervisor>(home_service(), conninfo.connect_rate,
+                conninfo.connect_backoff_ms, conninfo.max_connect_backoff_ms),
+            std::make_shared<p2u::nntp::latency_tracker>(
+                std::chrono::milliseconds{conninfo.min_timeout_ms},
+                std::chrono::seconds{m_optimeout}, conninfo.timeout_multiplier),
+            std::make_unique<p2u::nntp::health_monitor>(conninfo.recycle_below,
+                conninfo.recycle_after)));
+    auto server = m_conninfo.back().get();
+    server->upload_limit = std::make_shared<p2u::asio::token_bucket>(conninfo.max_upload_rate * 1024);
+    auto spares = std::min<size_t>(num_connections, conninfo.spare_connections);
+    auto posting = num_connections - spares;
+
+    // The rest are made up front but only connected when the ramp asks
+    auto connected = num_connections;
+    if (conninfo.initial_connections > 0 && conninfo.initial_connections < posting)
+    {
+        server->ramp = std::make_unique<p2u::nntp::connection_ramp>(conninfo.initial_connections, posting);
+        connected = server->ramp->target() + spares;
+    }
+    server->load.set_connections(server->ramp ? server->ramp->target() : posting);
 
-    std::lock_guard<std::mutex> _lock{m_bfm};
+    auto sources = spread_over(conninfo.bind_addresses, num_connections);
+
+    std::vector<connection_handle_iterator> added;
+    std::unique_lock<p2u::util::counting_mutex> _lock{m_bfm};
+    server->id = m_scheduler.add_server(&server->load);
     for (size_t i = 0; i < num_connections; ++i)
     {
-        m_busy.emplace_back(std::make_unique<p2u::nntp::connection>(m_iosvc,
-                    *it.info, m_optimeout));
-        auto connit = std::prev(m_busy.end());
-        (*connit)->set_post_handler(std::bind(&p2u::nntp::usenet::on_post_finished, this, connit, std::placeholders::_1, std::placeholders::_2));
-        (*connit)->set_stat_handler(std::bind(&p2u::nntp::usenet::on_stat_finished, this, connit, std::placeholders::_1, std::placeholders::_2));
-        (*connit)->set_connect_handler(std::bind(&p2u::nntp::usenet::on_connected, this, connit, std::placeholders::_1));
-        (*connit)->async_connect();
+        auto& shard = least_loaded_shard();
+        ++shard.num_connections;
+        auto& busy = m_scheduler.busy();
+        busy.emplace_back(std::make_unique<p2u::nntp::connection>(shard.iosvc,
+                    *server->info, m_optimeout));
+        auto connit = std::prev(busy.end());
+        if (!sources.empty())
+        {
+            (*connit)->set_bind_address(sources[i]);
+        }
+        (*connit)->set_resolver_cache(server->resolver);
+        (*connit)->set_timer_wheel(shard.wheel);
+        (*connit)->set_latency_tracker(server->latency);
+        (*connit)->add_rate_limit(m_upload_limit);
+        (*connit)->add_rate_limit(server->upload_limit);
+        (*connit)->set_post_handler(std::bind(&p2u::nntp::usenet::on_post_finished, this, connit, server, std::placeholders::_1, std::placeholders::_2));
+        (*connit)->set_stat_handler(std::bind(&p2u::nntp::usenet::on_stat_finished, this, connit, server, std::placeholders::_1, std::placeholders::_2));
+        (*connit)->set_keepalive_handler(std::bind(&p2u::nntp::usenet::on_keepalive, this, connit, server, std::placeholders::_1));
+        (*connit)->set_connect_handler(std::bind(&p2u::nntp::usenet::on_connected, this, connit, server, std::placeholders::_1));
+        added.push_back(connit);
+    }
+
+    while (added.size() > connected)
+    {
+        server->dormant.splice(server->dormant.begin(), m_scheduler.busy(), added.back());
+        added.pop_back();
+    }
+    _lock.unlock();
+
+    // The supervisor spreads the initial connects out as well
+    for (auto connit : added)
+    {
+        schedule_reconnect(connit, server);
+    }
+}
+
+void p2u::nntp::usenet::set_upload_rate(std::uint64_t kb_per_second)
+{
+    m_upload_limit->set_rate(kb_per_second * 1024);
+}
+
+void p2u::nntp::usenet::set_server_upload_rate(size_t server, std::uint64_t kb_per_second)
+{
+    if (server >= m_conninfo.size())
+    {
+        throw std::out_of_range("No such server");
+    }
+    m_conninfo[server]->upload_limit->set_rate(kb_per_second * 1024);
+}
+
+void p2u::nntp::usenet::set_connection_upload_rate(size_t server, std::uint64_t kb_per_second)
+{
+    if (server >= m_conninfo.size())
+    {
+        throw std::out_of_range("No such server");
+    }
+
+    auto info = m_conninfo[server]->info.get();
+    auto update = [this, info, kb_per_second](std::list<connection_handle>& conns)
+    {
+        for (auto& conn : conns)
+        {
+            if (&conn->get_connection_info() == info)
+            {
+                // The socket belongs to the connection's io thread
+                auto ptr = conn.get();
+                ptr->get_io_service().post([ptr, kb_per_second]()
+                        {
+                            ptr->set_rate_limit(kb_per_second * 1024);
+                        });
+            }
+        }
+    };
+
+    std::lock_guard<p2u::util::counting_mutex> _lock{m_bfm};
+    update(m_scheduler.ready());
+    update(m_scheduler.busy());
+    update(m_closing);
+    update(m_conninfo[server]->spares);
+    update(m_conninfo[server]->dormant);
+}
+
+void p2u::nntp::usenet::write_statistics(std::ostream& stream) const
+{
+    if (m_upload_limit->limited())
+    {
+        stream << "[STATS] upload limit: " << m_upload_limit->get_rate() / 1024
+            << " KB/s, writes held back " << std::chrono::duration_cast<std::chrono::milliseconds>(
+                    m_upload_limit->get_held_back()).count() << " ms in total" << std::endl;
+    }
+
+    if (m_conninfo.size() > 1)
+    {
+        stream << "[STATS] dispatch policy: " << to_string(m_scheduler.get_dispatch_policy().mode()) << std::endl;
+    }
+
+    for (const auto& server : m_conninfo)
+    {
+        stream << "[STATS] " << server->info->serveraddr << ":" << server->info->port
+            << " - " << server->supervisor->get_statistics() << std::endl;
+        if (m_conninfo.size() > 1)
+        {
+            stream << "[STATS] " << server->info->serveraddr << ":" << server->info->port
+                << " - " << server->load << std::endl;
+        }
+        stream << "[STATS] " << server->info->serveraddr << ":" << server->info->port
+            << " - " << server->health->get_statistics() << std::endl;
+        auto routed = m_scheduler.routed(server->id);
+        auto stolen = m_scheduler.stolen(server->id);
+        if (routed > 0 || stolen > 0)
+        {
+            stream << "[STATS] " << server->info->serveraddr << ":" << server->info->port
+                << " - retries routed here: " << routed
+                << ", articles stolen from other servers: " << stolen << std::endl;
+        }
+        if (server->ramp)
+        {
+            stream << "[STATS] " << server->info->serveraddr << ":" << server->info->port
+                << " - " << server->ramp->get_statistics() << std::endl;
+        }
+        if (server->info->spare_connections > 0)
+        {
+            stream << "[STATS] " << server->info->serveraddr << ":" << server->info->port
+                << " - spare connections: " << server->info->spare_connections
+                << ", swapped in: " << server->spare_swaps << std::endl;
+        }
+        if (server->keepalives > 0)
+        {
+            stream << "[STATS] " << server->info->serveraddr << ":" << server->info->port
+                << " - keepalives sent to idle connections: " << server->keepalives
+                << ", found dropped: " << server->keepalive_drops << std::endl;
+        }
+        if (server->upload_limit->limited() || server->info->max_connection_upload_rate > 0)
+        {
+            stream << "[STATS] " << server->info->serveraddr << ":" << server->info->port
+                << " - upload limit: " << server->upload_limit->get_rate() / 1024
+                << " KB/s, per connection: " << server->info->max_connection_upload_rate
+                << " KB/s, server limit held writes back " << std::chrono::duration_cast<std::chrono::milliseconds>(
+                        server->upload_limit->get_held_back()).count() << " ms in total" << std::endl;
+        }
+        if (server->compression.sessions > 0)
+        {
+            const auto& bytes = server->compression.bytes;
+            stream << "[STATS] " << server->info->serveraddr << ":" << server->info->port
+                << " - compression: " << server->compression.sessions << " sessions, sent "
+                << bytes.sent / 1024 << " KB as " << bytes.sent_compressed / 1024 << " KB, received "
+                << bytes.received << " bytes as " << bytes.received_compressed << " bytes, zlib "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(bytes.cpu).count()
+                << " ms, articles compressed on " << server->compression.payload_sessions
+                << " sessions" << std::endl;
+        }
+        if (!server->transfers.empty())
+        {
+            // Per connection, so that socket profiles can be compared
+            // independent of how many connections were used
+            double total = 0, slowest = 0, fastest = 0;
+            for (const auto& transfer : server->transfers)
+            {
+                double rate = kb_per_second(transfer);
+                total += rate;
+                slowest = (slowest == 0) ? rate : std::min(slowest, rate);
+                fastest = std::max(fastest, rate);
+            }
+
+            stream << "[STATS] " << server->info->serveraddr << ":" << server->info->port
+                << " - throughput per connection: avg " << static_cast<size_t>(total / server->transfers.size())
+                << " KB/s, min " << static_cast<size_t>(slowest)
+                << " KB/s, max " << static_cast<size_t>(fastest)
+                << " KB/s (" << server->transfers.size() << " connections)" << std::endl;
+        }
+
+        for (const auto& source : server->source_transfers)
+        {
+            // Connections of one source run side by side, so their rates add
+            std::uint64_t bytes = 0;
+            double rate = 0;
+            for (const auto& transfer : source.second)
+            {
+                bytes += transfer.bytes;
+                rate += kb_per_second(transfer);
+            }
+
+            stream << "[STATS] " << server->info->serveraddr << ":" << server->info->port
+                << " - from " << source.first << ": " << bytes / 1024 << " KB, "
+                << static_cast<size_t>(rate) << " KB/s (" << source.second.size()
+                << " connections)" << std::endl;
+        }
+
+        stream << "[STATS] " << server->info->serveraddr << ":" << server->info->port
+            << " - latency ";
+        server->latency->write_statistics(stream);
+        stream << std::endl;
+    }
+
+    size_t num_failures = m_num_given_up;
+    for (auto count : m_failure_actions)
+    {
+        num_failures += count;
+    }
+
+    if (num_failures > 0)
+    {
+        stream << "[STATS] post failures:";
+        for (size_t i = 0; i < m_failure_actions.size(); ++i)
+        {
+            stream << " " << to_string(static_cast<p2u::nntp::post_failure_action>(i))
+                << " " << m_failure_actions[i] << ",";
+        }
+        stream << " given up " << m_num_given_up << std::endl;
+    }
+
+    if (m_num_cancelled > 0)
+    {
+        stream << "[STATS] cancelled posts dropped from the queue: " << m_num_cancelled << std::endl;
+    }
+
+    if (m_num_hedged > 0)
+    {
+        stream << "[STATS] straggling posts raced: " << m_num_hedged
+            << ", won by the copy: " << m_num_hedges_won << std::endl;
+    }
+
+    if (m_num_unacknowledged > 0)
+    {
+        stream << "[STATS] unacknowledged posts: " << m_num_unacknowledged
+            << ", found on server: " << m_num_landed
+            << " (" << m_bytes_not_reposted / 1024 << " KB not re-uploaded)" << std::endl;
+    }
+
+    if (std::any_of(m_waits.begin(), m_waits.end(), [](const queue_wait& wait) { return wait.items > 0; }))
+    {
+        stream << "[STATS] queue wait:";
+        for (size_t i = 0; i < m_waits.size(); ++i)
+        {
+            const auto& wait = m_waits[i];
+            if (wait.items > 0)
+            {
+                stream << " " << to_string(static_cast<post_priority>(i)) << " " << wait.items
+                    << " items, avg " << wait.total.count() / wait.items / 1000
+                    << " ms, max " << wait.longest.count() / 1000 << " ms;";
+            }
+        }
+        stream << std::endl;
+    }
+
+    std::uint64_t dispatched = 0;
+    for (const auto& server : m_conninfo)
+    {
+        dispatched += server->load.dispatched();
+    }
+    if (dispatched > 0)
+    {
+        stream << "[STATS] dispatch lock taken " << m_bfm.acquisitions() << " times, "
+            << std::fixed << std::setprecision(2)
+            << static_cast<double>(m_bfm.acquisitions()) / dispatched
+            << " per article posted" << std::defaultfloat << std::endl;
+    }
+
+    p2u::asio::timer_wheel::statistics wheels;
+    for (const auto& shard : m_shards)
+    {
+        wheels += shard->wheel->get_statistics();
+    }
+    stream << "[STATS] " << wheels << std::endl;
+
+    if (m_shards.size() > 1)
+    {
+        stream << "[STATS] io threads: " << m_shards.size() << ", connections per thread:";
+        for (const auto& shard : m_shards)
+        {
+            stream << " " << shard->num_connections;
+        }
+        stream << std::endl;
+    }
+
+    // Connections of one node run side by side, so their rates add
+    std::map<int, std::vector<const io_shard*>> nodes;
+    for (const auto& shard : m_shards)
+    {
+        if (shard->node >= 0)
+        {
+            nodes[shard->node].push_back(shard.get());
+        }
+    }
+    for (const auto& node : nodes)
+    {
+        std::uint64_t bytes = 0;
+        double rate = 0;
+        size_t connections = 0;
+        p2u::util::cpu_list cpus;
+        for (auto shard : node.second)
+        {
+            for (const auto& transfer : shard->transfers)
+            {
+                bytes += transfer.bytes;
+                rate += kb_per_second(transfer);
+            }
+            connections += shard->transfers.size();
+            cpus.push_back(shard->cpu);
+        }
+        std::sort(cpus.begin(), cpus.end());
+        cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+
+        stream << "[STATS] NUMA node " << node.first << ": " << bytes / 1024 << " KB, "
+            << static_cast<size_t>(rate) << " KB/s (" << connections
+            << " connections, io threads on CPUs " << p2u::util::to_string(cpus) << ")" << std::endl;
     }
 }
@@ -9,14 +9,30 @@
  */
 
 #include <boost/asio.hpp>
+#include <array>
+#include <chrono>
 #include <list>
+#include <map>
 #include <memory>
 #include <deque>
 #include <vector>
 #include <thread>
+#include <atomic>
 #include <condition_variable>
 #include <unordered_map>
 #include "connection.hpp"
+#include "connection_info.hpp"
+#include "resolver_cache.hpp"
+#include "connect_supervisor.hpp"
+#include "retry_policy.hpp"
+#include "health_monitor.hpp"
+#include "dispatch_policy.hpp"
+#include "connection_ramp.hpp"
+#include "work_scheduler.hpp"
+#include "../util/delay_queue.hpp"
+#include "../util/token_bucket.hpp"
+#include "../util/counting_mutex.hpp"
+#include "../util/cpu_affinity.hpp"
 
 namespace p2u
 {
@@ -24,36 +40,170 @@ namespace p2u
     {
         class article;
 
+        // How often to look for straggling posts at the end of a job
+        const int TAIL_CHECK_INTERVAL_MS = 200;
+
+        // How often servers with a connection ramp are measured
+        const int RAMP_INTERVAL_MS = 2000;
+
+        // How often idle connections are looked at for a keepalive. They
+        // get one once they sat idle for their server's idle_keepalive.
+        const int KEEPALIVE_CHECK_INTERVAL_MS = 5000;
+
+        // Until set_operation_timeout() says otherwise. Zero would let a
+        // hung post hold its connection forever.
+        const int DEFAULT_OPERATION_TIMEOUT = 30;
+
         class usenet
         {
             private:
+                using connection_handle =
+                    std::unique_ptr<p2u::nntp::connection>;
+
+                using connection_handle_iterator =
+                    std::list<connection_handle>::iterator;
+
+                struct conn_info_element;
+
+                // What the queue holds. Typed rather than a bound
+                // std::function, so queueing doesn't allocate.
+                struct work_item
+                {
+                    enum class kind
+                    {
+                        NONE,
+                        POST,
+                        STAT
+                    };
+
+                    kind type = kind::NONE;
+                    post_priority priority = post_priority::DATA;
+                    std::shared_ptr<article> msg;
+                    std::string msgid;
+                    std::chrono::steady_clock::time_point queued;
+
+                    // A server that failed it and mustn't steal it back
+                    size_t avoid = NO_SERVER;
+
+                    // A STAT only means something on the server the article
+                    // went to
+                    bool stealable() const
+                    {
+                        return type == kind::POST;
+                    }
+                };
+
+                using scheduler = work_scheduler<connection_handle, work_item>;
+
+                // Everything we know about one [Server] section. Owned
+                // through a unique_ptr so connections can keep a pointer to
+                // it no matter how many servers are added later.
                 struct conn_info_element
                 {
                     std::unique_ptr<connection_info> info;
                     size_t num_connections;
-
-                    conn_info_element(std::unique_ptr<connection_info> c, size_t n)
-                        : info{std::move(c)}, num_connections{std::move(n)}
+                    std::shared_ptr<resolver_cache> resolver;
+                    std::unique_ptr<connect_supervisor> supervisor;
+                    std::shared_ptr<latency_tracker> latency;
+                    std::unique_ptr<health_monitor> health;
+
+                    // Shared by all connections to this server
+                    std::shared_ptr<p2u::asio::token_bucket> upload_limit;
+
+                    // What the dispatch policy goes by. Guarded by m_bfm.
+                    server_load load;
+
+                    // Connected and authenticated, but kept out of the
+                    // ready list so they can take over from a connection
+                    // that just broke. Guarded by m_bfm.
+                    std::list<connection_handle> spares;
+                    size_t spare_swaps = 0;
+
+                    // DATEs sent to idle connections, and how many of those
+                    // turned out dropped. Guarded by m_bfm.
+                    size_t keepalives = 0;
+                    size_t keepalive_drops = 0;
+
+                    // What m_scheduler knows it by
+                    size_t id = NO_SERVER;
+
+                    // Set if the number of connections is found out as we
+                    // go. The ones it doesn't want right now sit in dormant,
+                    // not connected, and shed is how many busy ones go
+                    // there once they finish their post. What was posted
+                    // and what went wrong since it last looked is counted
+                    // for every server. Guarded by m_bfm.
+                    std::unique_ptr<connection_ramp> ramp;
+                    std::list<connection_handle> dormant;
+                    size_t shed = 0;
+                    std::uint64_t interval_bytes = 0;
+                    size_t interval_posts = 0;
+                    std::chrono::milliseconds interval_busy{0};
+                    size_t interval_errors = 0;
+
+                    // Filled in as connections go away
+                    compression_report compression;
+                    std::vector<transfer_statistics> transfers;
+                    std::map<std::string, std::vector<transfer_statistics>> source_transfers;
+
+                    conn_info_element(std::unique_ptr<connection_info> c, size_t n,
+                                      std::shared_ptr<resolver_cache> r,
+                                      std::unique_ptr<connect_supervisor> s,
+                                      std::shared_ptr<latency_tracker> l,
+                                      std::unique_ptr<health_monitor> h)
+                        : info{std::move(c)}, num_connections{std::move(n)},
+                          resolver{std::move(r)}, supervisor{std::move(s)},
+                          latency{std::move(l)}, health{std::move(h)}
                     {
 
                     }
                 };
 
-                using connection_handle =
-                    std::unique_ptr<p2u::nntp::connection>;
-
-                using connection_handle_iterator =
-                    std::list<connection_handle>::iterator;
-
-                using queued_command = std::function<void(connection_handle_iterator)>;
-
                 using post_event_callback = std::function<void(const std::shared_ptr<p2u::nntp::article>&)>;
                 using on_finish_validate = std::function<void(const std::string& str)>;
                 using on_finish_stat = std::function<void(const std::string&, stat_result)>;
+                using stranded_callback = std::function<void()>;
+
+                // One io_service per IO thread. A connection is pinned to
+                // one shard for its whole life, so its handlers never run
+                // concurrently and it needs no strand. Whatever is done to it
+                // from elsewhere is posted there. What connections of
+                // different shards share is guarded by m_bfm, atomic, or
+                // locks itself (token buckets, trackers, supervisors).
+                struct io_shard
+                {
+                    boost::asio::io_service iosvc{1};
+                    std::thread thread;
+
+                    // Operation timeouts of the connections on this shard
+                    std::shared_ptr<p2u::asio::timer_wheel> wheel;
+                    size_t num_connections = 0;
+
+                    // Where the thread is pinned, -1 if it isn't
+                    int cpu = -1;
+                    int node = -1;
 
-                // Async-IO service
-                boost::asio::io_service m_iosvc;
-                std::unique_ptr<boost::asio::io_service::work> m_work;
+                    // Of the connections that lived here. Guarded by m_bfm.
+                    std::vector<p2u::nntp::transfer_statistics> transfers;
+
+                    io_shard()
+                        : wheel{std::make_shared<p2u::asio::timer_wheel>(iosvc)}
+                    {
+
+                    }
+                };
+
+                // The first shard also runs what belongs to no connection:
+                // retry backoffs, the tail timer, DNS and connect pacing.
+                std::vector<std::unique_ptr<io_shard>> m_shards;
+
+                // Keep the shards running while an idle connection may
+                // still be handed something. Dropped once every connection
+                // is closing or gone. Guarded by m_bfm.
+                std::vector<std::unique_ptr<boost::asio::io_service::work>> m_work;
+
+                // Shared by every connection, on top of the per-server ones
+                std::shared_ptr<p2u::asio::token_bucket> m_upload_limit;
 
                 // The big fat mutex that we have to use that guards the ready
                 // and busy lists along with the queue.
@@ -87,63 +237,255 @@ namespace p2u
                 // If these events occured simultaneously, we will end up with
                 // a connection that moves to the free list and a remaining item
                 // in the queue. No work will progress.
-
-                std::mutex m_bfm;
-                // We maintain two lists that represent "ready" connections
-                // (that are connected and are ready to start posting)
-                // and "busy" connections (connections that are currently
-                // in the process of connecting, authenticating, or posting)
+                //
+                // Producers no longer take it, though. They push into a
+                // lock-free ring and only come here if m_scheduler.idle()
+                // says a connection is waiting for work. A connection going
+                // idle bumps that count and then looks at the ring once more.
+                // With a full fence between the store and the load on both
+                // sides, at least one of them sees the other, which is the
+                // same guarantee the single lock gave us:
+                //
+                // enqueue(item)              on_ready(connection)
+                // -------------              --------------------
+                // [1] Push item              [1] Grab m_bfm, pop: nothing
+                // [2] Fence                  [2] make_ready, ++idle
+                // [3] idle() > 0?            [3] Fence
+                // [4] Grab m_bfm, dispatch   [4] Pop again
+                //
+                // Everything else (the ready and busy lists, spares,
+                // in-flight posts) is still guarded by m_bfm. Connections
+                // are picked from the ready list by server and by load,
+                // which a lock-free stack couldn't do. It counts how often
+                // it is taken, which is reported with the statistics as a
+                // cost per article.
+                p2u::util::counting_mutex m_bfm;
+
+                // The queue, and the two lists that represent "ready"
+                // connections (that are connected and are ready to start
+                // posting) and "busy" connections (connections that are
+                // currently in the process of connecting, authenticating,
+                // or posting). Decides which connection gets what. Guarded
+                // by m_bfm, but for the pushes and counts above.
                 //
                 // We use an std::list because it offers an O(1) splice operation.
                 // Having a separate list for ready connections also allows us
                 // to get the next available connection in O(1) time.
-                std::list<connection_handle> m_ready;
-                std::list<connection_handle> m_busy;
+                scheduler m_scheduler;
 
+                // Connections that are saying goodbye. They must outlive
+                // their last async operation, so they're only destroyed in
+                // join().
+                std::list<connection_handle> m_closing;
 
-                // Queue of messages to be delivered.
+
+                // Producers block once this many are queued, zero never
                 size_t m_maxsize;
+
+                // How long what was taken off the queue had waited, per
+                // class. Guarded by m_bfm.
+                struct queue_wait
+                {
+                    size_t items = 0;
+                    std::chrono::microseconds total{0};
+                    std::chrono::microseconds longest{0};
+                };
+                std::array<queue_wait, static_cast<size_t>(post_priority::NUM_PRIORITIES)> m_waits;
+
+                // Producers blocked on a full queue wait here rather than on
+                // m_bfm
+                std::mutex m_space_lock;
                 std::condition_variable m_queuecv;
-                std::deque<queued_command> m_queue;
+                std::atomic<size_t> m_waiting_producers;
+
+                // Set once no connection is left to drain the queue
+                std::atomic<bool> m_stranded;
+
+                // Posts whose acknowledgement got lost, by message-id, while
+                // a STAT finds out whether they made it. Guarded by m_bfm.
+                std::unordered_map<std::string, std::shared_ptr<article>> m_unacknowledged;
+                size_t m_num_unacknowledged;
+                size_t m_num_landed;
+                std::uint64_t m_bytes_not_reposted;
+
+                // Retries waiting out their backoff. The queue lets go of
+                // one before it is back in the queue or on a connection, so
+                // they are counted here until then, which is what the wind
+                // down goes by. Guarded by m_bfm.
+                p2u::asio::delay_queue m_delayed;
+                size_t m_num_delayed;
+                std::unique_ptr<retry_policy> m_retry;
+
+                // Failures so far of articles still in flight. Guarded by
+                // m_bfm.
+                std::unordered_map<const article*, unsigned int> m_post_failures;
+                std::array<size_t, static_cast<size_t>(post_failure_action::NUM_ACTIONS)> m_failure_actions;
+                size_t m_num_given_up;
+
+                // Articles dropped instead of sent because they were
+                // cancelled. Guarded by m_bfm.
+                size_t m_num_cancelled;
+
+                // Racing a straggler against a copy of itself at the end of
+                // a job. The first racer to get its article posted settles
+                // it, the others are cut off.
+                struct hedge_state
+                {
+                    bool settled = false;
+                    std::vector<const article*> racers;
+                };
+
+                struct inflight_post
+                {
+                    std::shared_ptr<article> msg;
+                    connection* conn;
+                    conn_info_element* server;
+                    std::chrono::steady_clock::time_point started;
+                    std::shared_ptr<hedge_state> hedge;
+                };
+
+                // Posts handed to a connection and not finished yet. Guarded
+                // by m_bfm.
+                std::unordered_map<const article*, inflight_post> m_inflight;
+                boost::asio::deadline_timer m_tail_timer;
+                bool m_tail_active;
+                size_t m_num_hedged;
+                size_t m_num_hedges_won;
+
+                // Measures the servers that have a connection ramp. Runs on
+                // the first shard until the job winds down. m_ramp_active
+                // is guarded by m_bfm.
+                boost::asio::deadline_timer m_ramp_timer;
+                std::chrono::steady_clock::time_point m_ramp_last;
+                bool m_ramp_active;
+
+                // Keeps idle connections, ready or spare, from going
+                // stale between jobs. Runs on the first shard until the job
+                // winds down. Guarded by m_bfm, like when each connection
+                // last went idle.
+                boost::asio::deadline_timer m_keepalive_timer;
+                bool m_keepalive_active;
+                std::unordered_map<const connection*, std::chrono::steady_clock::time_point> m_idle_since;
+
+                // Set by stop(), no new work is coming. Guarded by m_bfm.
+                bool m_winding_down;
 
 
-                // IO threadpool.
-                size_t m_numthreads;
-                std::vector<std::thread> m_iothreads;
                 int m_optimeout;
 
 
-                std::vector<conn_info_element> m_conninfo;
+                std::vector<std::unique_ptr<conn_info_element>> m_conninfo;
 
                 post_event_callback m_slot_finish_post;
                 post_event_callback m_slot_post_failed;
+                post_event_callback m_slot_post_retry;
+                post_event_callback m_slot_post_hedge;
+                post_event_callback m_slot_post_cancelled;
                 on_finish_validate m_slot_finish_validate;
                 on_finish_stat m_slot_finish_stat;
+                stranded_callback m_slot_stranded;
 
 
                 void on_conn_becomes_ready(connection_handle_iterator conn);
+                void find_work(connection_handle_iterator conn);
 
                 void on_post_finished(connection_handle_iterator conn,
+                        conn_info_element* server,
                         const std::shared_ptr<p2u::nntp::article>& msg,
                         p2u::nntp::post_result post_result);
 
                 void on_stat_finished(connection_handle_iterator conn,
+                        conn_info_element* server,
                         const std::string& msgid,
                         p2u::nntp::stat_result stat_result);
 
                 void on_connected(connection_handle_iterator conn,
+                        conn_info_element* server,
                         p2u::nntp::connect_result result);
 
+                void schedule_reconnect(connection_handle_iterator conn,
+                        conn_info_element* server);
+
+                void stop_reconnecting();
+
+                /**
+                 * Hands the connection a post and tracks it in m_inflight. If
+                 * the connection turns out to be closed, the article goes
+                 * back into the queue, or is dropped from its race if it is
+                 * a hedge, and the connection reconnects.
+                 */
                 void start_async_post(connection_handle_iterator conn,
-                                     const std::shared_ptr<article>& msg);
+                                     const std::shared_ptr<article>& msg,
+                                     const std::shared_ptr<hedge_state>& hedge = nullptr);
 
                 void start_async_stat(connection_handle_iterator conn,
                                      const std::string& msgid);
 
-                void dispatch_or_queue(const queued_command& cmd, bool front=false);
+                void verify_unacknowledged(const std::shared_ptr<article>& msg,
+                        conn_info_element* server);
 
-                void discard_connection(connection_handle_iterator conn);
+                /**
+                 * Posts it again unless it failed too often. A delayed retry
+                 * waits out the backoff first. Avoid is a server the article
+                 * should rather not go to again, if another one is idle.
+                 */
+                void retry_post(const std::shared_ptr<article>& msg,
+                        conn_info_element* avoid, bool delayed);
+                void give_up_post(const std::shared_ptr<article>& msg);
+
+                conn_info_element* server_of(const connection_handle& conn) const;
+                void start_tail_mode();
+                void on_tail_timer(const boost::system::error_code& ec);
+                void hedge_stragglers();
+                void dispatch_post(const std::shared_ptr<article>& msg,
+                        conn_info_element* avoid);
+                void place_post(const std::shared_ptr<article>& msg,
+                        conn_info_element* avoid);
+                void dispatch_local(work_item&& item, conn_info_element* server);
+                void orphan_local(conn_info_element* server);
+
+                void on_ramp_timer(const boost::system::error_code& ec);
+                void stop_ramp();
+                void apply_ramp(conn_info_element* server, size_t target);
+                size_t active_connections(const conn_info_element* server) const;
+                void wake_dormant(conn_info_element* server);
+                void make_dormant(connection_handle_iterator conn,
+                        conn_info_element* server);
+
+                void on_keepalive_timer(const boost::system::error_code& ec);
+                void stop_keepalive();
+                void send_keepalive(connection_handle_iterator conn,
+                        conn_info_element* server);
+                void on_keepalive(connection_handle_iterator conn,
+                        conn_info_element* server, bool alive);
+
+                static std::vector<std::unique_ptr<io_shard>> make_shards(size_t iothreads);
+                boost::asio::io_service& home_service();
+                io_shard& least_loaded_shard();
+                bool winding_down() const;
+                void wind_down();
+                void check_wound_down();
+
+                void enqueue(work_item&& item, bool bypass_wait);
+                void wait_for_room();
+                void queue_work(work_item&& item);
+                void on_popped();
+                void return_prefetched(connection_handle_iterator conn);
+                void start_work(connection_handle_iterator conn, const work_item& item);
+                void drain_to_ready();
+
+                void discard_connection(connection_handle_iterator conn,
+                        conn_info_element* server);
+                bool park_spare(connection_handle_iterator conn,
+                        conn_info_element* server);
+                bool promote_spare(conn_info_element* server);
+                void retire_connection(const connection_handle& conn);
+                bool no_connections_left() const;
             public:
+                /**
+                 * Zero iothreads means one per core. Connections are spread
+                 * evenly over the threads as they are added.
+                 */
                 usenet(size_t iothreads);
                 usenet(size_t iothreads, size_t max_queue_size);
                 usenet(const usenet& other) = delete;
@@ -151,11 +493,61 @@ namespace p2u
                 usenet& operator=(usenet& other) = delete;
                 ~usenet();
 
+                /**
+                 * The longest any single operation may take, and the ceiling
+                 * of the learned timeouts, in seconds. Zero turns timeouts
+                 * off. DEFAULT_OPERATION_TIMEOUT unless set. Must be called
+                 * before add_connections(), throws std::logic_error
+                 * otherwise.
+                 */
                 void set_operation_timeout(int seconds);
 
+                /**
+                 * An article is given up on after max_failures failed
+                 * attempts. Transient failures wait base_delay, doubling
+                 * per failure up to max_delay.
+                 */
+                void set_retry_policy(unsigned int max_failures,
+                        std::chrono::milliseconds base_delay,
+                        std::chrono::milliseconds max_delay);
+
+                /**
+                 * Weighted by default. Only matters with more than one
+                 * server.
+                 */
+                void set_dispatch_policy(std::unique_ptr<dispatch_policy> policy);
+
+                /**
+                 * How many articles a busy connection may take off the
+                 * queue at once. Fewer are taken while the queue is short
+                 * or connections are idle. One turns look-ahead off.
+                 */
+                void set_prefetch_depth(size_t depth);
+
+                /**
+                 * Pins the io threads to these CPUs, one CPU per thread and
+                 * round robin if there are more threads than CPUs. Each
+                 * thread prefers memory of its CPU's NUMA node. Must be
+                 * called before start().
+                 */
+                void set_thread_affinity(const p2u::util::cpu_list& cpus);
+
                 void add_connections(const connection_info& conninfo,
                                      size_t num_connections);
 
+                /**
+                 * Caps what all connections together send, in KB/s. Zero
+                 * lifts the cap. Can be changed while posting.
+                 */
+                void set_upload_rate(std::uint64_t kb_per_second);
+
+                /**
+                 * The same for the connections to one server, counted in the
+                 * order they were added, together and each on its own.
+                 */
+                void set_server_upload_rate(size_t server, std::uint64_t kb_per_second);
+                void set_connection_upload_rate(size_t server, std::uint64_t kb_per_second);
+
                 /**
                  * Enqueues an article to be sent. If max queue size is non zero
                  * and the queue is == max queue size, this will block the
@@ -165,13 +557,51 @@ namespace p2u
                 // TODO: Make these functions delgate to a generic function
                 // template <class F, class Args...>
                 // void execute_or_defer(F func, Args... args);
-                void enqueue_post(const std::shared_ptr<article>& msg, bool bypass_wait=false);
-                void enqueue_stat(const std::string& msgid);
+                void enqueue_post(const std::shared_ptr<article>& msg,
+                        post_priority priority=post_priority::DATA, bool bypass_wait=false);
+
+                /**
+                 * Queued as VERIFY, it jumps the line. Queued as DATA or
+                 * RECOVERY, it stays behind the posts queued before it in
+                 * that class, which is what validating a job needs.
+                 */
+                void enqueue_stat(const std::string& msgid,
+                        post_priority priority=post_priority::VERIFY);
 
                 void set_post_finished_callback(const post_event_callback& func);
+                /**
+                 * Called right before a failed article is posted again, e.g.
+                 * to give it a new message-id.
+                 */
+                void set_post_retry_callback(const post_event_callback& func);
+
+                /**
+                 * Called with a copy of a straggling article that is about
+                 * to be raced against the original. It needs a message-id of
+                 * its own.
+                 */
+                void set_post_hedge_callback(const post_event_callback& func);
+
+                /**
+                 * Called when an article was given up on
+                 */
                 void set_post_failed_callback(const post_event_callback& func);
+
+                /**
+                 * Called when an article was dropped instead of sent,
+                 * because it was cancelled (see article::set_cancel_flag)
+                 * while it waited in the queue or for a retry.
+                 */
+                void set_post_cancelled_callback(const post_event_callback& func);
                 void set_stat_finished_callback(const on_finish_stat& func);
 
+                /**
+                 * Called once the last connection is gone, e.g. because
+                 * none could log in. What is still queued won't be posted,
+                 * and nothing more is reported about it.
+                 */
+                void set_stranded_callback(const stranded_callback& func);
+
                 /**
                  * Note: This method's interface is inherently racy. The caller
                  * should call this method *AFTER* he has joined() with us,
@@ -186,6 +616,12 @@ namespace p2u
                  */
                 size_t get_queue_size() const;
 
+                /**
+                 * Human readable per-server statistics, meant to be printed
+                 * once the job is done.
+                 */
+                void write_statistics(std::ostream& stream) const;
+
                 void start();
                 void stop();
                 void join();
@@ -0,0 +1,18 @@
+#include "work_scheduler.hpp"
+
+const char* p2u::nntp::to_string(post_priority priority)
+{
+    switch (priority)
+    {
+        case post_priority::RETRY:
+            return "retry";
+        case post_priority::VERIFY:
+            return "verify";
+        case post_priority::DATA:
+            return "data";
+        case post_priority::RECOVERY:
+            return "recovery";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,686 @@
+#ifndef NNTP_WORK_SCHEDULER_HPP_
+#define NNTP_WORK_SCHEDULER_HPP_
+
+/**
+ * Which connection gets what work: the queue of each class, what waits for
+ * one server, the look-ahead batches of busy connections, and which idle
+ * connection a retry or a STAT goes to. It knows nothing of connecting or
+ * posting, so usenet and misc/simulate_dispatch drive the same one, usenet
+ * with m_bfm held and the simulation on virtual time.
+ *
+ * Connections are in the ready or the busy list. The owner splices them to
+ * lists of its own (spares, dormant, closing) and back as it likes. A
+ * connection is known by its node, which splicing doesn't move. Servers are
+ * known by the id add_server() gave them.
+ *
+ * An Item has a post_priority priority, a size_t avoid, the server that
+ * mustn't steal it back or NO_SERVER, and a bool stealable() const, false
+ * if it only means something on the server it waits for.
+ *
+ * Nothing locks itself. Only try_push(), queued() and idle() may be called
+ * without the owner's lock, everything else must be called with it held.
+ */
+
+#include <boost/noncopyable.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "dispatch_policy.hpp"
+#include "../util/make_unique.hpp"
+#include "../util/mpmc_ring.hpp"
+
+namespace p2u
+{
+    namespace nntp
+    {
+        // Ring sizes when the queue is unbounded, and for the commands that
+        // jump the line. Anything beyond spills into a locked deque.
+        const size_t DEFAULT_QUEUE_CAPACITY = 4096;
+        const size_t URGENT_QUEUE_CAPACITY = 256;
+
+        // Articles a busy connection takes from the shared queue at once
+        const size_t DEFAULT_PREFETCH_DEPTH = 4;
+
+        // No server in particular
+        const size_t NO_SERVER = std::numeric_limits<size_t>::max();
+
+        // What something is queued as. Served in this order, first come
+        // first served within a class, so retries don't wait behind the
+        // backlog and recovery data goes out last.
+        enum class post_priority
+        {
+            // Articles that failed and are posted again
+            RETRY,
+
+            // STATs, e.g. of posts whose acknowledgement got lost
+            VERIFY,
+
+            DATA,
+
+            // PAR2 volumes and the like, only needed if something is lost
+            RECOVERY,
+
+            NUM_PRIORITIES
+        };
+
+        const char* to_string(post_priority priority);
+
+        template <class Connection, class Item>
+        class work_scheduler : private boost::noncopyable
+        {
+            public:
+                using connection_list = std::list<Connection>;
+                using iterator = typename connection_list::iterator;
+
+                // The server a connection belongs to, or NO_SERVER
+                using server_function = std::function<size_t(const Connection&)>;
+
+            private:
+                static const size_t NUM_CLASSES = static_cast<size_t>(post_priority::NUM_PRIORITIES);
+
+                struct server_slot
+                {
+                    const server_load* load;
+
+                    // Retries kept away from the server that failed them,
+                    // and STATs of what was posted here. Its connections
+                    // look here first, the others only steal once they run
+                    // dry, and never what isn't stealable.
+                    std::deque<Item> queue;
+                    size_t routed = 0;
+                    size_t stolen = 0;
+
+                    explicit server_slot(const server_load* l)
+                        : load{l}
+                    {
+
+                    }
+                };
+
+                server_function m_server_of;
+                std::vector<server_slot> m_servers;
+
+                // Idle connections in the order they went idle, and those
+                // connecting, posting or otherwise taken
+                connection_list m_ready;
+                connection_list m_busy;
+
+                // One ring per class, pushed to without the lock. Retries
+                // only ever come with the lock held, so they have no ring.
+                p2u::util::mpmc_ring<Item> m_queue;
+                p2u::util::mpmc_ring<Item> m_urgent;
+                p2u::util::mpmc_ring<Item> m_recovery;
+
+                // Retries, and pushes that found their ring full. Served
+                // after the ring of their class. How many at the front of
+                // each were handed back from a look-ahead batch, they are
+                // older than anything in the ring and go first.
+                std::array<std::deque<Item>, NUM_CLASSES> m_overflow;
+                std::array<size_t, NUM_CLASSES> m_returned;
+
+                // Items in all of the above, in the per-server queues and
+                // in the look-ahead batches, and m_ready.size()
+                std::atomic<size_t> m_queued;
+                std::atomic<size_t> m_num_idle;
+
+                // Taken off the queue ahead of time by each busy connection,
+                // so it comes back for work once per batch rather than once
+                // per article. Idle connections steal from them.
+                size_t m_prefetch_depth;
+                std::unordered_map<const Connection*, std::deque<Item>> m_prefetched;
+
+                // Which server gets an article when several are idle
+                std::unique_ptr<dispatch_policy> m_dispatch;
+
+                p2u::util::mpmc_ring<Item>* ring_for(post_priority priority)
+                {
+                    switch (priority)
+                    {
+                        case post_priority::VERIFY:
+                            return &m_urgent;
+                        case post_priority::DATA:
+                            return &m_queue;
+                        case post_priority::RECOVERY:
+                            return &m_recovery;
+                        default:
+                            return nullptr;
+                    }
+                }
+
+                void taken()
+                {
+                    m_queued.fetch_sub(1);
+                }
+
+                // Leaves m_queued alone
+                bool take_shared(Item& item, post_priority lowest=post_priority::RECOVERY)
+                {
+                    for (size_t i = 0; i <= static_cast<size_t>(lowest); ++i)
+                    {
+                        auto& overflow = m_overflow[i];
+                        if (m_returned[i] > 0)
+                        {
+                            --m_returned[i];
+                            item = std::move(overflow.front());
+                            overflow.pop_front();
+                            return true;
+                        }
+
+                        auto ring = ring_for(static_cast<post_priority>(i));
+                        if (ring && ring->try_pop(item))
+                        {
+                            return true;
+                        }
+
+                        if (!overflow.empty())
+                        {
+                            item = std::move(overflow.front());
+                            overflow.pop_front();
+                            return true;
+                        }
+                    }
+                    return false;
+                }
+
+                bool pop_local(Item& item, size_t server)
+                {
+                    if (server == NO_SERVER || m_servers[server].queue.empty())
+                    {
+                        return false;
+                    }
+
+                    auto& queue = m_servers[server].queue;
+                    item = std::move(queue.front());
+                    queue.pop_front();
+                    taken();
+                    return true;
+                }
+
+                bool steal_work(Item& item, size_t thief)
+                {
+                    // From the back, the owner works from the front. A retry
+                    // that failed on the thief waits for the server it was
+                    // routed to.
+                    for (size_t victim = 0; victim < m_servers.size(); ++victim)
+                    {
+                        auto& queue = m_servers[victim].queue;
+                        if (victim == thief || queue.empty())
+                        {
+                            continue;
+                        }
+
+                        auto it = std::find_if(queue.rbegin(), queue.rend(), [thief](const Item& candidate)
+                                {
+                                    return candidate.stealable() && candidate.avoid != thief;
+                                });
+                        if (it == queue.rend())
+                        {
+                            continue;
+                        }
+
+                        item = std::move(*it);
+                        queue.erase(std::next(it).base());
+                        if (thief != NO_SERVER)
+                        {
+                            ++m_servers[thief].stolen;
+                        }
+                        taken();
+                        return true;
+                    }
+                    return false;
+                }
+
+                bool steal_prefetched(Item& item, const Connection* thief)
+                {
+                    for (auto& entry : m_prefetched)
+                    {
+                        auto& batch = entry.second;
+                        if (entry.first == thief || batch.empty())
+                        {
+                            continue;
+                        }
+
+                        item = std::move(batch.back());
+                        batch.pop_back();
+                        taken();
+                        return true;
+                    }
+                    return false;
+                }
+
+                bool route_away(Item& item)
+                {
+                    // To a server that will come back for work, chosen like
+                    // an idle one
+                    std::vector<size_t> servers;
+                    std::vector<const server_load*> candidates;
+                    for (size_t server = 0; server < m_servers.size(); ++server)
+                    {
+                        if (server != item.avoid && has_workers(server))
+                        {
+                            servers.push_back(server);
+                            candidates.push_back(m_servers[server].load);
+                        }
+                    }
+
+                    if (candidates.empty())
+                    {
+                        return false;
+                    }
+
+                    auto& slot = m_servers[servers[candidates.size() == 1 ? 0 : m_dispatch->choose(candidates)]];
+                    m_queued.fetch_add(1);
+                    slot.queue.push_back(std::move(item));
+                    ++slot.routed;
+                    return true;
+                }
+
+            public:
+                /**
+                 * Zero capacity rings hold DEFAULT_QUEUE_CAPACITY
+                 */
+                work_scheduler(size_t capacity, server_function server_of)
+                    : m_server_of{std::move(server_of)},
+                      m_queue{capacity != 0 ? capacity : DEFAULT_QUEUE_CAPACITY},
+                      m_urgent{URGENT_QUEUE_CAPACITY},
+                      m_recovery{capacity != 0 ? capacity : DEFAULT_QUEUE_CAPACITY},
+                      m_returned{}, m_queued{0}, m_num_idle{0},
+                      m_prefetch_depth{DEFAULT_PREFETCH_DEPTH},
+                      m_dispatch{std::make_unique<weighted_dispatch>()}
+                {
+
+                }
+
+                /**
+                 * Returns the server's id. The load is what the dispatch
+                 * policy goes by, it must outlive the scheduler.
+                 */
+                size_t add_server(const server_load* load)
+                {
+                    m_servers.emplace_back(load);
+                    return m_servers.size() - 1;
+                }
+
+                void set_dispatch_policy(std::unique_ptr<dispatch_policy> policy)
+                {
+                    m_dispatch = std::move(policy);
+                }
+
+                const dispatch_policy& get_dispatch_policy() const
+                {
+                    return *m_dispatch;
+                }
+
+                /**
+                 * How many articles a busy connection may take off the
+                 * queue at once. Fewer are taken while the queue is short
+                 * or connections are idle.
+                 */
+                void set_prefetch_depth(size_t depth)
+                {
+                    m_prefetch_depth = std::max<size_t>(depth, 1);
+                }
+
+                size_t get_prefetch_depth() const
+                {
+                    return m_prefetch_depth;
+                }
+
+                /**
+                 * Splicing in or out of the ready list is take_ready(),
+                 * make_ready() and release_ready()'s business
+                 */
+                connection_list& ready()
+                {
+                    return m_ready;
+                }
+
+                const connection_list& ready() const
+                {
+                    return m_ready;
+                }
+
+                connection_list& busy()
+                {
+                    return m_busy;
+                }
+
+                const connection_list& busy() const
+                {
+                    return m_busy;
+                }
+
+                size_t queued() const
+                {
+                    return m_queued.load();
+                }
+
+                size_t idle() const
+                {
+                    return m_num_idle.load();
+                }
+
+                /**
+                 * Without the lock. Counted first, so that queued() never
+                 * drops below what is really queued. Returns false if the
+                 * ring of its class is full or it has none, then the item
+                 * is left alone and must go to push_overflow().
+                 */
+                bool try_push(Item&& item)
+                {
+                    m_queued.fetch_add(1);
+                    auto ring = ring_for(item.priority);
+                    return ring && ring->try_push(std::move(item));
+                }
+
+                // After a failed try_push(), which counted it already
+                void push_overflow(Item&& item)
+                {
+                    m_overflow[static_cast<size_t>(item.priority)].push_back(std::move(item));
+                }
+
+                // Never blocks
+                void push(Item&& item)
+                {
+                    if (!try_push(std::move(item)))
+                    {
+                        push_overflow(std::move(item));
+                    }
+                }
+
+                /**
+                 * The next item of the shared queue, by class. Every item
+                 * handed out is no longer counted by queued().
+                 */
+                bool take(Item& item)
+                {
+                    if (!take_shared(item))
+                    {
+                        return false;
+                    }
+
+                    taken();
+                    return true;
+                }
+
+                /**
+                 * For a connection that is done with what it had. What was
+                 * routed to its server and what jumps the line come before
+                 * its own batch, then the shared queue, and only then what
+                 * waits for some other server or connection.
+                 */
+                bool next_work(Item& item, iterator conn)
+                {
+                    auto server = m_server_of(*conn);
+                    if (pop_local(item, server))
+                    {
+                        return true;
+                    }
+                    if (take_shared(item, post_priority::VERIFY))
+                    {
+                        taken();
+                        return true;
+                    }
+
+                    auto& batch = m_prefetched[&*conn];
+                    if (batch.empty())
+                    {
+                        // A whole batch only while there is plenty left for
+                        // everybody else. Near the end, or with connections
+                        // idle, one at a time.
+                        size_t depth = 1;
+                        if (m_num_idle.load() == 0)
+                        {
+                            depth = std::min(m_prefetch_depth,
+                                    1 + m_queued.load() / std::max<size_t>(m_busy.size(), 1));
+                        }
+
+                        Item next;
+                        while (batch.size() < depth && take_shared(next))
+                        {
+                            batch.push_back(std::move(next));
+                        }
+                    }
+
+                    if (!batch.empty())
+                    {
+                        item = std::move(batch.front());
+                        batch.pop_front();
+                        taken();
+                        return true;
+                    }
+
+                    return steal_work(item, server) || steal_prefetched(item, &*conn);
+                }
+
+                /**
+                 * Pairs the next item of the shared queue with an idle
+                 * connection, which is taken. False once either runs out.
+                 */
+                bool drain(iterator& conn, Item& item)
+                {
+                    if (m_ready.empty() || !take(item))
+                    {
+                        return false;
+                    }
+
+                    conn = pick_ready(NO_SERVER);
+                    take_ready(conn);
+                    return true;
+                }
+
+                /**
+                 * The first idle connection of every server, in the order
+                 * they went idle, goes to the dispatch policy. Rather not
+                 * one of the server to avoid, if some other server is idle.
+                 * ready().end() if none is idle.
+                 */
+                iterator pick_ready(size_t avoid)
+                {
+                    std::vector<iterator> firsts;
+                    std::vector<const server_load*> candidates;
+                    for (auto it = m_ready.begin(); it != m_ready.end() && candidates.size() < m_servers.size(); ++it)
+                    {
+                        auto server = m_server_of(*it);
+                        if (server == NO_SERVER || server == avoid ||
+                                std::find(candidates.begin(), candidates.end(), m_servers[server].load) != candidates.end())
+                        {
+                            continue;
+                        }
+
+                        firsts.push_back(it);
+                        candidates.push_back(m_servers[server].load);
+                    }
+
+                    if (candidates.empty())
+                    {
+                        return m_ready.begin();
+                    }
+                    if (candidates.size() == 1)
+                    {
+                        return firsts.front();
+                    }
+                    return firsts[m_dispatch->choose(candidates)];
+                }
+
+                // From ready to busy
+                void take_ready(iterator conn)
+                {
+                    m_busy.splice(m_busy.begin(), m_ready, conn);
+                    m_num_idle.fetch_sub(1);
+                }
+
+                // From busy to the back of ready
+                void make_ready(iterator conn)
+                {
+                    m_ready.splice(m_ready.end(), m_busy, conn);
+                    m_num_idle.fetch_add(1);
+                }
+
+                // Every idle connection, e.g. to disconnect them
+                void release_ready(connection_list& to)
+                {
+                    to.splice(to.end(), m_ready);
+                    m_num_idle.store(0);
+                }
+
+                /**
+                 * A retry, which rather goes to another server than the one
+                 * it avoids. If none of those is idle, it waits for one that
+                 * will come back for work. Returns true with conn taken for
+                 * the caller to start it on, otherwise it was queued.
+                 */
+                bool place(Item& item, iterator& conn)
+                {
+                    auto it = pick_ready(item.avoid);
+                    bool only_avoided = it != m_ready.end() && item.avoid != NO_SERVER &&
+                        m_server_of(*it) == item.avoid;
+                    if (it != m_ready.end() && !only_avoided)
+                    {
+                        take_ready(it);
+                        conn = it;
+                        return true;
+                    }
+
+                    if (item.avoid != NO_SERVER && route_away(item))
+                    {
+                        return false;
+                    }
+
+                    if (it != m_ready.end())
+                    {
+                        take_ready(it);
+                        conn = it;
+                        return true;
+                    }
+
+                    item.avoid = NO_SERVER;
+                    push(std::move(item));
+                    return false;
+                }
+
+                /**
+                 * To one of the server's own connections, ahead of
+                 * everything else it has waiting. If it has none left, to
+                 * the shared queue, better some server than none. Returns
+                 * true with conn taken like place().
+                 */
+                bool place_local(Item& item, size_t server, iterator& conn)
+                {
+                    auto it = std::find_if(m_ready.begin(), m_ready.end(), [this, server](const Connection& candidate)
+                            {
+                                return m_server_of(candidate) == server;
+                            });
+
+                    if (it != m_ready.end())
+                    {
+                        take_ready(it);
+                        conn = it;
+                        return true;
+                    }
+
+                    if (has_workers(server))
+                    {
+                        m_queued.fetch_add(1);
+                        m_servers[server].queue.push_front(std::move(item));
+                    }
+                    else
+                    {
+                        push(std::move(item));
+                    }
+                    return false;
+                }
+
+                /**
+                 * Whether the server has connections that will come back
+                 * for work, sooner or later. Those spliced elsewhere don't
+                 * count.
+                 */
+                bool has_workers(size_t server) const
+                {
+                    auto mine = [this, server](const Connection& conn)
+                    {
+                        return m_server_of(conn) == server;
+                    };
+                    return std::any_of(m_busy.begin(), m_busy.end(), mine) ||
+                        std::any_of(m_ready.begin(), m_ready.end(), mine);
+                }
+
+                bool has_local(size_t server) const
+                {
+                    return !m_servers[server].queue.empty();
+                }
+
+                /**
+                 * Once the server lost its last connection, what waited for
+                 * it goes back to everybody. Returns true if something did,
+                 * idle connections won't look by themselves.
+                 */
+                bool orphan(size_t server)
+                {
+                    auto& queue = m_servers[server].queue;
+                    if (queue.empty() || has_workers(server))
+                    {
+                        return false;
+                    }
+
+                    for (auto& item : queue)
+                    {
+                        item.avoid = NO_SERVER;
+                        m_overflow[static_cast<size_t>(item.priority)].push_back(std::move(item));
+                    }
+                    queue.clear();
+                    return true;
+                }
+
+                /**
+                 * The connection broke or is put aside. What it took ahead
+                 * of time is still counted as queued, it only goes back
+                 * where others can see it. Returns true if there was any,
+                 * idle connections won't look by themselves.
+                 */
+                bool return_batch(iterator conn)
+                {
+                    auto it = m_prefetched.find(&*conn);
+                    if (it == m_prefetched.end() || it->second.empty())
+                    {
+                        return false;
+                    }
+
+                    auto& batch = it->second;
+                    for (auto item = batch.rbegin(); item != batch.rend(); ++item)
+                    {
+                        m_overflow[static_cast<size_t>(item->priority)].push_front(std::move(*item));
+                        ++m_returned[static_cast<size_t>(item->priority)];
+                    }
+                    batch.clear();
+                    return true;
+                }
+
+                // Before the connection's node is erased, after return_batch()
+                void forget(iterator conn)
+                {
+                    m_prefetched.erase(&*conn);
+                }
+
+                // Retries routed to the server, and what its connections stole
+                size_t routed(size_t server) const
+                {
+                    return m_servers[server].routed;
+                }
+
+                size_t stolen(size_t server) const
+                {
+                    return m_servers[server].stolen;
+                }
+        };
+    }
+}
+#endif
@@ -0,0 +1,61 @@
+#include "nzb.hpp"
+#include <boost/algorithm/string/replace.hpp>
+#include <chrono>
+
+std::string ghetto_xml_escape(const std::string& str)
+{
+    auto escaped = str;
+    boost::algorithm::replace_all(escaped, "\"", "&quot;");
+    boost::algorithm::replace_all(escaped, "'", "&apos;");
+    boost::algorithm::replace_all(escaped, "<", "&lt;");
+    boost::algorithm::replace_all(escaped, ">", "&gt;");
+    boost::algorithm::replace_all(escaped, ">", "&amp;");
+    return escaped;
+}
+
+void write_nzb(std::ostream& stream, const fileset& files, const nzb_details& cfg, const std::vector<piece_size_map>& piece_sizes, const std::string& nonce, const msgid_exceptions_map& exceptions)
+{
+    auto epoch_time = std::chrono::system_clock::now().time_since_epoch().count();
+
+    stream << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << std::endl;
+    stream << "<!DOCTYPE nzb PUBLIC \"-//newzBin//DTD NZB 1.1//END\" \"http://www.newzbin.com/DTD/nzb/nzb-1.1.dtd\">" << std::endl;
+    stream << "<nzb xmlns=\"http://www.newzbin.com/DTD/2003/nzb\">" << std::endl;
+    stream << std::endl;
+
+    for (size_t i = 0; i < files.get_num_files(); ++i)
+    {
+        stream << "<file poster=\"" << ghetto_xml_escape(cfg.from)
+            << "\" date=\"" << epoch_time
+            << "\" subject=\""
+            << ghetto_xml_escape(files.get_usenet_subject(cfg.subject, i, 0)) << "\">" << std::endl;
+
+        stream << "<groups>" << std::endl;
+        for (const auto& group : cfg.groups)
+        {
+            stream << "<group>" << group << "</group>" << std::endl;
+        }
+        stream << "</groups>" << std::endl;
+
+        stream << "<segments>" << std::endl;
+        for (size_t pieceIndex = 0; pieceIndex < files.get_num_pieces(i); ++pieceIndex)
+        {
+            auto it = piece_sizes[i].find(pieceIndex);
+
+            auto exception_it = exceptions.find({i, pieceIndex});
+            const auto& actual_nonce = exception_it == exceptions.end() ? nonce : exception_it->second;
+            auto msg_id = fileset::get_usenet_message_id(actual_nonce, cfg.msgiddomain, i, pieceIndex);
+            boost::algorithm::replace_all(msg_id, "<", "");
+            boost::algorithm::replace_all(msg_id, ">", "");
+
+            stream << "<segment bytes=\"" << it->second
+                << "\" number=\"" << pieceIndex + 1
+                << "\">" << msg_id
+                << "</segment>" << std::endl;
+        }
+
+        stream << "</segments>" << std::endl;
+        stream << "</file>" << std::endl;
+    }
+
+    stream << "</nzb>" << std::endl;
+}
@@ -0,0 +1,30 @@
+#ifndef NZB_HPP_
+#define NZB_HPP_
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "fileset.hpp"
+
+// Pieces that landed under another nonce than the job's, e.g. after a retry
+using msgid_exceptions_map = std::map<filepiece_key, std::string>;
+
+// Encoded size of each piece of one file
+using piece_size_map = std::map<size_t, size_t>;
+
+// What the file elements of an NZB repeat
+struct nzb_details
+{
+    std::string from;
+    std::string subject;
+    std::vector<std::string> groups;
+    std::string msgiddomain;
+};
+
+std::string ghetto_xml_escape(const std::string& str);
+
+void write_nzb(std::ostream& stream, const fileset& files, const nzb_details& cfg, const std::vector<piece_size_map>& piece_sizes, const std::string& nonce, const msgid_exceptions_map& exceptions);
+
+#endif
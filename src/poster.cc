@@ -0,0 +1,585 @@
+#include "poster.hpp"
+#include "article_tools.hpp"
+#include "nzb.hpp"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+struct p2u::poster::job
+{
+    size_t id = 0;
+    job_options options;
+    nzb_details details;
+    segment_callback on_segment;
+    done_callback on_done;
+
+    // Only the scheduler touches these once the job is accepted
+    fileset files;
+    std::vector<filepiece_key> order;
+    size_t next = 0;
+
+    // A piece was taken out of turn but isn't queued yet
+    bool encoding = false;
+    bool cancelled = false;
+    bool aborted = false;
+    size_t queued = 0;
+
+    // Set along with cancelled, for usenet to drop what is still queued
+    std::shared_ptr<std::atomic<bool>> cancel_flag = std::make_shared<std::atomic<bool>>(false);
+
+    std::string nonce;
+    std::vector<piece_size_map> piece_sizes;
+    msgid_exceptions_map exceptions;
+    std::vector<std::string> msgids;
+
+    size_t total = 0;
+    size_t posted = 0;
+    size_t failed = 0;
+    size_t dropped = 0;
+    std::uint64_t bytes = 0;
+    std::chrono::steady_clock::time_point started;
+
+    job(fileset input, const job_options& opts, const segment_callback& segment, const done_callback& done)
+        : options(opts), on_segment{segment}, on_done{done}, files{std::move(input)}
+    {
+
+    }
+};
+
+p2u::poster::poster(p2u::nntp::usenet& usenet)
+    : m_usenet(usenet), m_next_id{1}, m_started{false}, m_stopping{false},
+      m_stranded{false}
+{
+    using std::placeholders::_1;
+    m_usenet.set_post_finished_callback(std::bind(&poster::on_post_finished, this, _1));
+    m_usenet.set_post_failed_callback(std::bind(&poster::on_post_failed, this, _1));
+    m_usenet.set_post_retry_callback(std::bind(&poster::on_post_retry, this, _1));
+    m_usenet.set_post_hedge_callback(std::bind(&poster::on_post_hedge, this, _1));
+    m_usenet.set_post_cancelled_callback(std::bind(&poster::on_post_cancelled, this, _1));
+    m_usenet.set_stranded_callback(std::bind(&poster::on_stranded, this));
+}
+
+p2u::poster::~poster()
+{
+    shutdown();
+}
+
+void p2u::poster::set_thread_affinity(const p2u::util::cpu_list& cpus)
+{
+    m_encoder_cpus = cpus;
+}
+
+void p2u::poster::start()
+{
+    m_usenet.start();
+    m_started = true;
+
+    // After the io threads, which would inherit its placement
+    m_scheduler = std::thread([this]()
+            {
+                if (!m_encoder_cpus.empty())
+                {
+                    auto error = p2u::util::place_this_thread(m_encoder_cpus);
+                    if (!error.empty())
+                    {
+                        std::cerr << "[WARN] Could not place the encoder on CPUs "
+                            << p2u::util::to_string(m_encoder_cpus) << ": " << error << std::endl;
+                    }
+                }
+                schedule();
+            });
+}
+
+size_t p2u::poster::submit_files(const std::vector<boost::filesystem::path>& paths,
+        const job_options& options, const segment_callback& on_segment, const done_callback& on_done)
+{
+    namespace fs = boost::filesystem;
+
+    fileset files{options.article_size};
+    auto add_postitem = [&files](const fs::path& path)
+    {
+        if (!files.add_file(path))
+        {
+            throw std::runtime_error{"Cannot read " + path.string()};
+        }
+    };
+
+    for (const auto& path : paths)
+    {
+        if (fs::is_directory(path))
+        {
+            for (auto it = fs::recursive_directory_iterator{path}; it != fs::recursive_directory_iterator{}; ++it)
+            {
+                if (fs::is_regular_file(it->path()))
+                {
+                    add_postitem(it->path());
+                }
+            }
+        }
+        else if (fs::is_regular_file(path))
+        {
+            add_postitem(path);
+        }
+        else
+        {
+            throw std::runtime_error{path.string() + " is neither a file nor a directory"};
+        }
+    }
+
+    // A single directory names the job like a single file does
+    auto named = options;
+    if (named.subject.empty() && paths.size() == 1)
+    {
+        named.subject = paths.front().filename().generic_string();
+    }
+    return submit(std::move(files), named, on_segment, on_done);
+}
+
+size_t p2u::poster::submit_buffers(std::vector<std::pair<std::string, std::vector<char>>> buffers,
+        const job_options& options, const segment_callback& on_segment, const done_callback& on_done)
+{
+    auto named = options;
+    if (named.subject.empty() && buffers.size() == 1)
+    {
+        named.subject = buffers.front().first;
+    }
+
+    fileset files{options.article_size};
+    for (auto& buffer : buffers)
+    {
+        files.add_buffer(buffer.first, std::move(buffer.second));
+    }
+    return submit(std::move(files), named, on_segment, on_done);
+}
+
+size_t p2u::poster::submit(fileset files, const job_options& options,
+        const segment_callback& on_segment, const done_callback& on_done)
+{
+    if (files.get_num_files() == 0)
+    {
+        throw std::runtime_error{"No files to post"};
+    }
+    if (options.groups.empty())
+    {
+        throw std::runtime_error{"Need at least one group to post to"};
+    }
+    if (options.subject.empty())
+    {
+        throw std::runtime_error{"Need a subject for more than one file"};
+    }
+
+    auto owner = std::make_shared<job>(std::move(files), options, on_segment, on_done);
+    owner->details = nzb_details{options.from, options.subject, options.groups, options.msgid_domain};
+    owner->nonce = get_run_nonce(NONCE_LENGTH);
+    owner->order = owner->files.get_post_order(options.order);
+    owner->piece_sizes.resize(owner->files.get_num_files());
+    owner->total = owner->order.size();
+    owner->started = std::chrono::steady_clock::now();
+
+    job_result result;
+    bool done = false;
+    {
+        std::lock_guard<std::mutex> _lock{m_lock};
+        if (m_stopping)
+        {
+            throw std::runtime_error{"Shutting down"};
+        }
+        if (m_stranded)
+        {
+            throw std::runtime_error{"No connections left"};
+        }
+
+        owner->id = m_next_id++;
+        m_jobs[owner->id] = owner;
+        if (owner->total > 0)
+        {
+            m_turns.push_back(owner);
+            m_wakeup.notify_all();
+        }
+        else
+        {
+            done = settle(owner, result);
+        }
+    }
+
+    std::cerr << "[INFO] Job " << owner->id << ": " << options.subject << ", "
+        << owner->files.get_num_files() << " files, " << owner->total << " pieces" << std::endl;
+
+    if (done && on_done)
+    {
+        on_done(result);
+    }
+    return owner->id;
+}
+
+bool p2u::poster::cancel(size_t id)
+{
+    job_result result;
+    done_callback on_done;
+    bool done = false;
+    {
+        std::lock_guard<std::mutex> _lock{m_lock};
+        auto it = m_jobs.find(id);
+        if (it == m_jobs.end())
+        {
+            return false;
+        }
+
+        auto owner = it->second;
+        owner->cancelled = true;
+        owner->cancel_flag->store(true);
+        m_turns.erase(std::remove(m_turns.begin(), m_turns.end(), owner), m_turns.end());
+        done = settle(owner, result);
+        on_done = owner->on_done;
+    }
+
+    if (done && on_done)
+    {
+        on_done(result);
+    }
+    return true;
+}
+
+void p2u::poster::shutdown()
+{
+    {
+        std::lock_guard<std::mutex> _lock{m_lock};
+        m_stopping = true;
+        m_wakeup.notify_all();
+    }
+
+    if (m_scheduler.joinable())
+    {
+        m_scheduler.join();
+    }
+
+    if (m_started)
+    {
+        m_started = false;
+        m_usenet.stop();
+        m_usenet.join();
+    }
+}
+
+void p2u::poster::write_statistics(std::ostream& stream) const
+{
+    m_usenet.write_statistics(stream);
+}
+
+std::shared_ptr<p2u::poster::job> p2u::poster::owner_of(const std::string& msgid) const
+{
+    auto it = m_owners.find(msgid);
+    return it == m_owners.end() ? nullptr : it->second;
+}
+
+bool p2u::poster::settle(const std::shared_ptr<job>& owner, job_result& result)
+{
+    auto outstanding = owner->cancelled ? owner->queued : owner->total;
+    if (owner->encoding || owner->posted + owner->failed + owner->dropped < outstanding)
+    {
+        return false;
+    }
+
+    conclude(owner, result);
+    return true;
+}
+
+void p2u::poster::conclude(const std::shared_ptr<job>& owner, job_result& result)
+{
+    result.job = owner->id;
+    result.posted = owner->posted;
+    result.failed = owner->failed;
+    result.total = owner->total;
+    result.bytes = owner->bytes;
+    result.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - owner->started);
+    result.cancelled = owner->cancelled;
+    result.dropped = owner->dropped;
+    result.aborted = owner->aborted;
+
+    // Every piece was encoded, the scheduler is done with the files
+    if (!owner->cancelled && !owner->aborted)
+    {
+        std::ostringstream nzb;
+        write_nzb(nzb, owner->files, owner->details, owner->piece_sizes, owner->nonce, owner->exceptions);
+        result.nzb = nzb.str();
+    }
+
+    std::cerr << "[INFO] Job " << owner->id
+        << (owner->aborted ? " aborted, " : owner->cancelled ? " cancelled, " : " ")
+        << "posted " << owner->bytes << " bytes in " << result.elapsed.count() << " ms, "
+        << owner->failed << " article(s) failed";
+    if (owner->dropped > 0)
+    {
+        std::cerr << ", " << owner->dropped << " dropped from the queue";
+    }
+    std::cerr << std::endl;
+
+    for (const auto& msgid : owner->msgids)
+    {
+        m_owners.erase(msgid);
+    }
+    m_jobs.erase(owner->id);
+    m_wakeup.notify_all();
+}
+
+p2u::nntp::post_priority p2u::poster::priority_of(const job& owner, size_t file_index)
+{
+    return owner.options.defer_recovery && owner.files.is_recovery_file(file_index) ?
+        p2u::nntp::post_priority::RECOVERY : p2u::nntp::post_priority::DATA;
+}
+
+void p2u::poster::on_piece(const std::shared_ptr<p2u::nntp::article>& article, bool posted)
+{
+    segment_event event;
+    segment_callback on_segment;
+    job_result result;
+    done_callback on_done;
+    bool done = false;
+    {
+        std::lock_guard<std::mutex> _lock{m_lock};
+        const auto& msgid = article->get_header().msgid;
+        auto owner = owner_of(msgid);
+        if (!owner)
+        {
+            return;
+        }
+
+        auto key = fileset::get_key_from_message_id(msgid);
+        if (posted)
+        {
+            // Note down the message id the piece actually landed under
+            auto nonce = fileset::get_nonce_from_message_id(msgid);
+            if (nonce != owner->nonce)
+            {
+                owner->exceptions[key] = nonce;
+            }
+            else
+            {
+                owner->exceptions.erase(key);
+            }
+
+            ++owner->posted;
+            owner->bytes += article->get_payload_size();
+        }
+        else
+        {
+            ++owner->failed;
+        }
+
+        event.job = owner->id;
+        event.file_index = key.file_index;
+        event.piece_index = key.piece_index;
+        event.posted = posted;
+        event.article = article;
+        event.pieces_done = owner->posted + owner->failed;
+        event.pieces_total = owner->total;
+        event.bytes_posted = owner->bytes;
+        event.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - owner->started);
+
+        on_segment = owner->on_segment;
+        on_done = owner->on_done;
+        done = settle(owner, result);
+    }
+
+    if (on_segment)
+    {
+        on_segment(event);
+    }
+    if (done && on_done)
+    {
+        on_done(result);
+    }
+}
+
+void p2u::poster::on_post_finished(const std::shared_ptr<p2u::nntp::article>& article)
+{
+    on_piece(article, true);
+}
+
+void p2u::poster::on_post_failed(const std::shared_ptr<p2u::nntp::article>& article)
+{
+    std::cerr << "[ERROR] Giving up on " << article->get_header().msgid << std::endl;
+    on_piece(article, false);
+}
+
+void p2u::poster::on_post_retry(const std::shared_ptr<p2u::nntp::article>& article)
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    auto owner = owner_of(article->get_header().msgid);
+    renew_message_id(article, owner ? owner->options.msgid_domain : "post2usenet");
+    if (owner)
+    {
+        m_owners[article->get_header().msgid] = owner;
+        owner->msgids.push_back(article->get_header().msgid);
+    }
+
+    std::cerr << "[WARN] Posting " << article->get_header().subject << " failed. Requeued with message id "
+        << article->get_header().msgid << std::endl;
+}
+
+void p2u::poster::on_post_hedge(const std::shared_ptr<p2u::nntp::article>& article)
+{
+    // A copy of a straggler, still under the original's message id
+    std::lock_guard<std::mutex> _lock{m_lock};
+    auto owner = owner_of(article->get_header().msgid);
+    renew_message_id(article, owner ? owner->options.msgid_domain : "post2usenet");
+    if (owner)
+    {
+        m_owners[article->get_header().msgid] = owner;
+        owner->msgids.push_back(article->get_header().msgid);
+    }
+}
+
+void p2u::poster::on_post_cancelled(const std::shared_ptr<p2u::nntp::article>& article)
+{
+    job_result result;
+    done_callback on_done;
+    bool done = false;
+    {
+        std::lock_guard<std::mutex> _lock{m_lock};
+        auto owner = owner_of(article->get_header().msgid);
+        if (!owner)
+        {
+            return;
+        }
+
+        ++owner->dropped;
+        on_done = owner->on_done;
+        done = settle(owner, result);
+    }
+
+    if (done && on_done)
+    {
+        on_done(result);
+    }
+}
+
+void p2u::poster::on_stranded()
+{
+    std::vector<std::pair<done_callback, job_result>> finished;
+    {
+        std::lock_guard<std::mutex> _lock{m_lock};
+        m_stranded = true;
+        m_turns.clear();
+
+        // Whatever they still wait for will never come. A piece being
+        // encoded is thrown away by the scheduler.
+        auto jobs = m_jobs;
+        for (const auto& entry : jobs)
+        {
+            auto owner = entry.second;
+            owner->aborted = true;
+            job_result result;
+            conclude(owner, result);
+            finished.emplace_back(owner->on_done, result);
+        }
+    }
+
+    for (const auto& done : finished)
+    {
+        if (done.first)
+        {
+            done.first(done.second);
+        }
+    }
+}
+
+void p2u::poster::schedule()
+{
+    while (true)
+    {
+        std::shared_ptr<job> turn;
+        filepiece_key key;
+        bool last = false;
+        {
+            std::unique_lock<std::mutex> lock{m_lock};
+            m_wakeup.wait(lock, [this]()
+                    {
+                        return !m_turns.empty() || (m_stopping && m_jobs.empty());
+                    });
+            if (m_turns.empty())
+            {
+                return;
+            }
+
+            // One piece per job in turn
+            turn = m_turns.front();
+            m_turns.pop_front();
+            key = turn->order[turn->next++];
+            turn->encoding = true;
+            last = turn->next == turn->order.size();
+            if (!last)
+            {
+                m_turns.push_back(turn);
+            }
+        }
+
+        auto chunk = turn->files.get_chunk(key.file_index, key.piece_index);
+        auto size = chunk.size();
+
+        p2u::nntp::header header;
+        header.from = turn->options.from;
+        header.subject = turn->files.get_usenet_subject(turn->options.subject, key.file_index, key.piece_index);
+        header.msgid = fileset::get_usenet_message_id(turn->nonce, turn->options.msgid_domain, key.file_index, key.piece_index);
+        header.newsgroups = turn->options.groups;
+
+        auto article = std::make_shared<p2u::nntp::article>(header);
+        article->add_payload_piece(std::move(chunk));
+        article->set_cancel_flag(turn->cancel_flag);
+
+        job_result result;
+        bool done = false;
+        {
+            std::lock_guard<std::mutex> _lock{m_lock};
+            turn->encoding = false;
+            if (turn->aborted)
+            {
+                // Nothing left to post it with, the job is over already
+                article.reset();
+            }
+            else if (turn->cancelled)
+            {
+                // Cancelled while we were at it
+                done = settle(turn, result);
+                article.reset();
+            }
+            else
+            {
+                turn->piece_sizes[key.file_index][key.piece_index] = size;
+                m_owners[header.msgid] = turn;
+                turn->msgids.push_back(header.msgid);
+                ++turn->queued;
+            }
+        }
+
+        if (!article)
+        {
+            if (done && turn->on_done)
+            {
+                turn->on_done(result);
+            }
+            continue;
+        }
+
+        // All as data unless asked otherwise. The recovery class is shared
+        // by every job, one job's PAR2 would wait for all the others' data.
+        // Each job's own order has them last anyway.
+        m_usenet.enqueue_post(article, priority_of(*turn, key.file_index));
+
+        if (last && turn->options.validate)
+        {
+            // TODO: A retried piece landed under another message-id, which
+            // isn't what is checked here. In the class of the posts, so
+            // they stay behind them.
+            for (const auto& piece : turn->order)
+            {
+                m_usenet.enqueue_stat(fileset::get_usenet_message_id(turn->nonce,
+                            turn->options.msgid_domain, piece.file_index, piece.piece_index),
+                        priority_of(*turn, piece.file_index));
+            }
+        }
+    }
+}
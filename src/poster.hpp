@@ -0,0 +1,228 @@
+#ifndef POSTER_HPP_
+#define POSTER_HPP_
+
+/**
+ * Posting jobs in-process, the library's entry point.
+ *
+ * A poster drives one usenet, i.e. one pool of connections, for any number
+ * of jobs over its lifetime. A job is a set of files, from disk or from
+ * memory, that is posted under one subject and ends up in one NZB. Jobs run
+ * side by side: they take turns at having a piece encoded and queued, so
+ * each gets an equal share of the connections whatever its size.
+ *
+ *     p2u::nntp::usenet usenet{0};
+ *     usenet.set_operation_timeout(30);
+ *     usenet.set_retry_policy(3, std::chrono::seconds{1}, std::chrono::seconds{60});
+ *     usenet.add_connections(server, 20);
+ *
+ *     p2u::poster poster{usenet};
+ *     poster.start();
+ *     poster.submit_files({"/srv/upload/My.Upload"}, options, on_segment, on_done);
+ *     ...
+ *     poster.shutdown();
+ *
+ * The callbacks run on the io threads. They must not block, and may call
+ * submit() and cancel().
+ */
+
+#include <boost/filesystem.hpp>
+#include <boost/noncopyable.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "fileset.hpp"
+#include "nntp/usenet.hpp"
+#include "util/cpu_affinity.hpp"
+
+namespace p2u
+{
+    struct job_options
+    {
+        std::string from;
+
+        // Defaults to the file name if there is only one file
+        std::string subject;
+
+        std::vector<std::string> groups;
+        std::string msgid_domain = "post2usenet";
+        size_t article_size = 700000;
+        post_order order = post_order::FILE_IN_ORDER;
+
+        // Queue recovery files in a class of their own, only served once
+        // nothing else waits. Only for a job that runs alone, next to
+        // others its recovery files would wait for all of their data.
+        bool defer_recovery = false;
+
+        // Once every piece is queued, STAT each under the message-id it was
+        // first given. The results go to the usenet's stat callback, which
+        // the poster leaves alone.
+        bool validate = false;
+    };
+
+    // A piece of a job that was posted, or given up on
+    struct segment_event
+    {
+        size_t job = 0;
+        size_t file_index = 0;
+        size_t piece_index = 0;
+        bool posted = false;
+
+        // Along with the message-id it went out under. Given up on, it is
+        // what couldn't be posted, e.g. to keep it for posting by hand.
+        std::shared_ptr<const p2u::nntp::article> article;
+
+        // How far the job is
+        size_t pieces_done = 0;
+        size_t pieces_total = 0;
+        std::uint64_t bytes_posted = 0;
+        std::chrono::milliseconds elapsed{0};
+    };
+
+    struct job_result
+    {
+        size_t job = 0;
+        size_t posted = 0;
+        size_t failed = 0;
+        size_t total = 0;
+        std::uint64_t bytes = 0;
+        std::chrono::milliseconds elapsed{0};
+
+        // Pieces not queued yet when it was cancelled were left out, those
+        // still waiting in the queue were dropped
+        bool cancelled = false;
+        size_t dropped = 0;
+
+        // No connection was left to post it with. What wasn't posted or
+        // given up on by then is counted nowhere.
+        bool aborted = false;
+
+        // The whole document, empty for a cancelled or aborted job
+        std::string nzb;
+    };
+
+    class poster : private boost::noncopyable
+    {
+        public:
+            using segment_callback = std::function<void(const segment_event&)>;
+            using done_callback = std::function<void(const job_result&)>;
+
+        private:
+            struct job;
+
+            p2u::nntp::usenet& m_usenet;
+            p2u::util::cpu_list m_encoder_cpus;
+
+            // Encodes and queues the pieces of all jobs
+            std::thread m_scheduler;
+
+            // Guards everything below. The usenet callbacks come in on any
+            // io thread.
+            std::mutex m_lock;
+            std::condition_variable m_wakeup;
+            size_t m_next_id;
+            bool m_started;
+            bool m_stopping;
+
+            // Set once usenet has no connection left
+            bool m_stranded;
+
+            // Jobs not done yet, by id
+            std::map<size_t, std::shared_ptr<job>> m_jobs;
+
+            // Jobs with pieces left to queue, in the order of their next turn
+            std::deque<std::shared_ptr<job>> m_turns;
+
+            // Which job an article belongs to, by every message-id it was
+            // given. Dropped when the job is done.
+            std::unordered_map<std::string, std::shared_ptr<job>> m_owners;
+
+            size_t submit(fileset files, const job_options& options,
+                    const segment_callback& on_segment, const done_callback& on_done);
+
+            // With m_lock held
+            std::shared_ptr<job> owner_of(const std::string& msgid) const;
+
+            // With m_lock held. If nothing of the job is outstanding, fills
+            // in its result and forgets it.
+            bool settle(const std::shared_ptr<job>& owner, job_result& result);
+            void conclude(const std::shared_ptr<job>& owner, job_result& result);
+
+            static p2u::nntp::post_priority priority_of(const job& owner, size_t file_index);
+
+            void on_post_finished(const std::shared_ptr<p2u::nntp::article>& article);
+            void on_post_failed(const std::shared_ptr<p2u::nntp::article>& article);
+            void on_post_retry(const std::shared_ptr<p2u::nntp::article>& article);
+            void on_post_hedge(const std::shared_ptr<p2u::nntp::article>& article);
+            void on_post_cancelled(const std::shared_ptr<p2u::nntp::article>& article);
+            void on_piece(const std::shared_ptr<p2u::nntp::article>& article, bool posted);
+            void on_stranded();
+
+            void schedule();
+
+        public:
+            /**
+             * The usenet is to be set up with its connections, but not
+             * started. The poster takes over its callbacks.
+             */
+            explicit poster(p2u::nntp::usenet& usenet);
+
+            // Shuts down if that wasn't done
+            ~poster();
+
+            /**
+             * Pins the thread that encodes, see usenet::set_thread_affinity.
+             * Must be called before start().
+             */
+            void set_thread_affinity(const p2u::util::cpu_list& cpus);
+
+            // Connects and starts taking jobs
+            void start();
+
+            /**
+             * Posts files, and the files in directories recursively. Returns
+             * the job's id. Throws std::runtime_error if there is nothing to
+             * post, no group, no subject for more than one file, once shut
+             * down, or once no connection is left.
+             */
+            size_t submit_files(const std::vector<boost::filesystem::path>& paths,
+                    const job_options& options,
+                    const segment_callback& on_segment, const done_callback& on_done);
+
+            /**
+             * The same for files in memory, as pairs of a name and the data.
+             */
+            size_t submit_buffers(std::vector<std::pair<std::string, std::vector<char>>> buffers,
+                    const job_options& options,
+                    const segment_callback& on_segment, const done_callback& on_done);
+
+            /**
+             * Queues nothing more of the job, and drops what still waits in
+             * the queue or for a retry. Pieces a connection is sending
+             * already are let finish, the job is done once they are
+             * through. Returns false if the job is done already.
+             */
+            bool cancel(size_t job);
+
+            /**
+             * Stops taking jobs, waits for the running ones and disconnects.
+             */
+            void shutdown();
+
+            // Of the connections, once shut down
+            void write_statistics(std::ostream& stream) const;
+    };
+}
+
+#endif
@@ -6,9 +6,13 @@
 #include <boost/program_options.hpp>
 #include <boost/property_tree/ini_parser.hpp>
 #include <algorithm>
+#include <iterator>
 #include "program_config.hpp"
 
 
+// Seconds, see socket_options::keepalive_idle
+static const int DAEMON_TCP_KEEPALIVE_IDLE = 60;
+
 static void read_nonzero_string(boost::property_tree::ptree& ptree,
                                const std::string& key,
                                std::string& dst)
@@ -47,6 +51,15 @@ static void read_boolean_value(boost::property_tree::ptree& ptree,
 
 }
 
+static void read_optional_boolean_value(boost::property_tree::ptree& ptree,
+                                        const std::string& key,
+                                        bool& dst)
+{
+    if (ptree.find(key) == ptree.not_found())
+        return;
+    read_boolean_value(ptree, key, dst);
+}
+
 template <class T>
 static void read_numeric_value(boost::property_tree::ptree& ptree,
                                const std::string& key,
@@ -61,6 +74,64 @@ static void read_numeric_value(boost::property_tree::ptree& ptree,
     dst = it->second.get_value<T>();
 }
 
+template <class T>
+static void read_optional_numeric_value(boost::property_tree::ptree& ptree,
+                                        const std::string& key,
+                                        T& dst)
+{
+    if (ptree.find(key) == ptree.not_found())
+        return;
+    read_numeric_value(ptree, key, dst);
+}
+
+// "addr[*weight], addr[*weight], ..."
+static void read_optional_bind_addresses(boost::property_tree::ptree& ptree,
+                                         const std::string& key,
+                                         std::vector<p2u::nntp::bind_address>& dst)
+{
+    std::string str;
+    read_optional_string(ptree, key, str);
+    if (str.empty())
+        return;
+
+    std::vector<std::string> items;
+    boost::algorithm::split(items, str, boost::algorithm::is_any_of(","));
+    for (auto& item : items)
+    {
+        boost::algorithm::trim(item);
+        if (item.empty())
+            continue;
+
+        p2u::nntp::bind_address bind;
+        auto star = item.find('*');
+        boost::system::error_code ec;
+        bind.address = boost::asio::ip::address::from_string(
+                boost::algorithm::trim_copy(item.substr(0, star)), ec);
+        if (ec)
+        {
+            throw std::runtime_error{std::string("Invalid address in ") + key + ": " + item};
+        }
+
+        if (star != std::string::npos)
+        {
+            try
+            {
+                bind.weight = std::stoul(item.substr(star + 1));
+            }
+            catch (const std::exception&)
+            {
+                bind.weight = 0;
+            }
+
+            if (bind.weight == 0)
+            {
+                throw std::runtime_error{std::string("Invalid weight in ") + key + ": " + item};
+            }
+        }
+
+        dst.push_back(bind);
+    }
+}
 
 static void read_server_configuration(boost::property_tree::ptree& tree_node,
                                       prog_config& cfg)
@@ -73,11 +144,51 @@ static void read_server_configuration(boost::property_tree::ptree& tree_node,
     read_nonzero_string(tree_node, "Username", conn.username);
     read_nonzero_string(tree_node, "Password", conn.password);
     read_boolean_value(tree_node, "TLS", conn.tls);
+    read_optional_boolean_value(tree_node, "KernelTLS", conn.ktls);
+    read_optional_boolean_value(tree_node, "Compress", conn.compress);
+    read_optional_numeric_value(tree_node, "DnsCacheTtl", conn.dns_cache_ttl);
+    read_optional_numeric_value(tree_node, "ConnectRate", conn.connect_rate);
+    read_optional_numeric_value(tree_node, "ConnectBackoff", conn.connect_backoff_ms);
+    read_optional_numeric_value(tree_node, "MaxConnectBackoff", conn.max_connect_backoff_ms);
+    read_optional_numeric_value(tree_node, "MaxConnectFailures", conn.max_connect_failures);
+    read_optional_numeric_value(tree_node, "MinTimeout", conn.min_timeout_ms);
+    read_optional_numeric_value(tree_node, "TimeoutMultiplier", conn.timeout_multiplier);
+    read_optional_numeric_value(tree_node, "RecycleBelow", conn.recycle_below);
+    read_optional_numeric_value(tree_node, "RecycleAfter", conn.recycle_after);
+    read_optional_numeric_value(tree_node, "HedgePercentile", conn.hedge_percentile);
+    read_optional_numeric_value(tree_node, "IdleKeepAlive", conn.idle_keepalive);
+    read_optional_numeric_value(tree_node, "MaxUploadRate", conn.max_upload_rate);
+    read_optional_numeric_value(tree_node, "MaxConnectionUploadRate", conn.max_connection_upload_rate);
+
+    // Socket tuning
+    read_optional_numeric_value(tree_node, "SendBuffer", conn.socket.send_buffer);
+    read_optional_numeric_value(tree_node, "ReceiveBuffer", conn.socket.receive_buffer);
+    read_optional_boolean_value(tree_node, "NoDelay", conn.socket.no_delay);
+    read_optional_numeric_value(tree_node, "NotSentLowat", conn.socket.notsent_lowat);
+    read_optional_string(tree_node, "CongestionControl", conn.socket.congestion);
+    read_optional_numeric_value(tree_node, "UserTimeout", conn.socket.user_timeout_ms);
+    read_optional_numeric_value(tree_node, "KeepAlive", conn.socket.keepalive_idle);
+
+    read_optional_bind_addresses(tree_node, "BindAddresses", conn.bind_addresses);
 
     // Num Connections
     int num_connections;
     read_numeric_value(tree_node, "Connections", num_connections);
 
+    // Spares count against Connections, so at least one has to be left to post
+    read_optional_numeric_value(tree_node, "SpareConnections", conn.spare_connections);
+    if (num_connections > 0 && conn.spare_connections >= static_cast<unsigned int>(num_connections))
+    {
+        throw std::runtime_error{"SpareConnections must be less than Connections"};
+    }
+
+    // Ramped up from here as long as more connections pay off
+    read_optional_numeric_value(tree_node, "InitialConnections", conn.initial_connections);
+    if (num_connections > 0 && conn.initial_connections > static_cast<unsigned int>(num_connections))
+    {
+        throw std::runtime_error{"InitialConnections must not be more than Connections"};
+    }
+
     cfg.servers.push_back(std::make_pair(std::move(conn), num_connections));
 }
 
@@ -102,7 +213,42 @@ static void read_configuration_file(const boost::filesystem::path& path,
     read_numeric_value(global_section, "ArticleSize", cfg.article_size);
     read_numeric_value(global_section, "ArticleQueueSize", cfg.queue_size);
     read_numeric_value(global_section, "OperationTimeout", cfg.operation_timeout);
+    read_optional_numeric_value(global_section, "MaxPostFailures", cfg.max_post_failures);
+    read_optional_numeric_value(global_section, "RetryDelay", cfg.retry_delay_ms);
+    read_optional_numeric_value(global_section, "MaxRetryDelay", cfg.max_retry_delay_ms);
+    read_optional_numeric_value(global_section, "MaxUploadRate", cfg.max_upload_rate);
     read_optional_string(global_section, "MsgIdDomain", cfg.msgiddomain);
+    read_optional_numeric_value(global_section, "PrefetchDepth", cfg.prefetch_depth);
+
+    std::string dispatch;
+    read_optional_string(global_section, "DispatchPolicy", dispatch);
+    if (!dispatch.empty())
+    {
+        cfg.dispatch = p2u::nntp::parse_dispatch_mode(dispatch);
+    }
+
+    std::string order;
+    read_optional_string(global_section, "PostOrder", order);
+    if (!order.empty())
+    {
+        cfg.order = parse_post_order(order);
+    }
+
+    std::string cpus;
+    read_optional_string(global_section, "IoThreadCpus", cpus);
+    if (!cpus.empty())
+    {
+        cfg.io_thread_cpus = p2u::util::parse_cpu_list(cpus);
+    }
+
+    cpus.clear();
+    read_optional_string(global_section, "EncoderCpus", cpus);
+    if (!cpus.empty())
+    {
+        cfg.encoder_cpus = p2u::util::parse_cpu_list(cpus);
+    }
+
+    read_optional_string(global_section, "Interface", cfg.interface);
 
     if (cfg.msgiddomain.empty()) {
         cfg.msgiddomain = "post2usenet";
@@ -123,7 +269,7 @@ namespace po = boost::program_options;
 
 static void read_cmdline_args(const po::variables_map& vm, prog_config& cfg)
 {
-    cfg.io_threads = vm["iothreads"].as<int>();
+    cfg.io_threads = std::max(vm["iothreads"].as<int>(), 0);
 
     if (vm.count("articlesize"))
     {
@@ -138,13 +284,21 @@ static void read_cmdline_args(const po::variables_map& vm, prog_config& cfg)
     cfg.validate_posts = vm.count("validate");
     cfg.raw = vm["raw"].as<bool>();
 
-    auto& files = vm["file"].as<std::vector<std::string>>();
+    if (vm.count("file"))
+    {
+        auto& files = vm["file"].as<std::vector<std::string>>();
 
-    std::transform(files.begin(), files.end(), std::back_inserter(cfg.files),
-            [](const std::string& p)
-            {
-                return boost::filesystem::path(p);
-            });
+        std::transform(files.begin(), files.end(), std::back_inserter(cfg.files),
+                [](const std::string& p)
+                {
+                    return boost::filesystem::path(p);
+                });
+    }
+
+    if (vm.count("daemon"))
+    {
+        cfg.daemon_socket = vm["daemon"].as<std::string>();
+    }
 
     if (vm.count("group"))
     {
@@ -155,14 +309,74 @@ static void read_cmdline_args(const po::variables_map& vm, prog_config& cfg)
     {
         cfg.nzboutput = vm["output"].as<std::string>();
     }
+
+    if (vm.count("order"))
+    {
+        cfg.order = parse_post_order(vm["order"].as<std::string>());
+    }
 }
 
-bool load_program_config(int argc, const char* argv[], prog_config& cfg)
+static void resolve_thread_placement(prog_config& cfg)
 {
-    po::options_description hidden{"So secret!"};
-    hidden.add_options()
-        ("iothreads", po::value<int>()->default_value(1), "Number of IO threads to use. 1 IO thread is usually fine.");
+    if (!cfg.interface.empty())
+    {
+        auto nic = p2u::util::inspect_interface(cfg.interface);
+        if (nic.local_cpus.empty())
+        {
+            std::cerr << "[INFO] " << nic.interface
+                << " doesn't tell which CPUs are close to it, threads stay where configured" << std::endl;
+        }
+        else
+        {
+            std::cerr << "[INFO] " << nic.interface;
+            if (nic.node >= 0)
+            {
+                std::cerr << " is on NUMA node " << nic.node << ",";
+            }
+            std::cerr << " local CPUs " << p2u::util::to_string(nic.local_cpus);
+            if (!nic.irq_cpus.empty())
+            {
+                std::cerr << ", interrupts on CPUs " << p2u::util::to_string(nic.irq_cpus);
+            }
+            std::cerr << std::endl;
 
+            if (cfg.io_thread_cpus.empty())
+            {
+                cfg.io_thread_cpus = p2u::util::io_cpus_for(nic);
+            }
+            if (cfg.encoder_cpus.empty())
+            {
+                cfg.encoder_cpus = nic.local_cpus;
+            }
+        }
+
+        // Only hints, whoever set the CPUs may know better
+        p2u::util::cpu_list remote, shared;
+        std::set_difference(cfg.io_thread_cpus.begin(), cfg.io_thread_cpus.end(),
+                nic.local_cpus.begin(), nic.local_cpus.end(), std::back_inserter(remote));
+        std::set_intersection(cfg.io_thread_cpus.begin(), cfg.io_thread_cpus.end(),
+                nic.irq_cpus.begin(), nic.irq_cpus.end(), std::back_inserter(shared));
+        if (!nic.local_cpus.empty() && !remote.empty())
+        {
+            std::cerr << "[WARN] io threads on CPUs " << p2u::util::to_string(remote)
+                << " are not local to " << nic.interface << std::endl;
+        }
+        if (!shared.empty())
+        {
+            std::cerr << "[WARN] io threads on CPUs " << p2u::util::to_string(shared)
+                << " share them with the interrupts of " << nic.interface << std::endl;
+        }
+    }
+
+    // One thread per CPU given, unless told otherwise
+    if (cfg.io_threads == 0)
+    {
+        cfg.io_threads = cfg.io_thread_cpus.size();
+    }
+}
+
+bool load_program_config(int argc, const char* argv[], prog_config& cfg)
+{
     po::options_description cli{"Command line arguments"};
 
     cli.add_options()
@@ -174,13 +388,16 @@ bool load_program_config(int argc, const char* argv[], prog_config& cfg)
         ("config,c", po::value<std::string>(), "Specifies configuration file path")
         ("output,o", po::value<std::string>(), "Specifies output NZB file/directory")
         ("group,g", po::value<std::vector<std::string>>(), "Groups to post to")
-        ("file", po::value<std::vector<std::string>>()->required(), "File or directory to post");
+        ("iothreads,t", po::value<int>()->default_value(0), "Number of IO threads. Connections are spread evenly over them. 0 uses one per core")
+        ("order", po::value<std::string>(), "Order to post files in: file-in-order, smallest-first or round-robin. PAR2 files always go last. Overrides PostOrder")
+        ("daemon,d", po::value<std::string>(), "Run as a daemon that keeps its connections open and takes jobs on this Unix socket")
+        ("file", po::value<std::vector<std::string>>(), "File or directory to post");
 
     po::positional_options_description positionalopts;
     positionalopts.add("file", -1);
 
     po::options_description all_cli;
-    all_cli.add(hidden).add(cli);
+    all_cli.add(cli);
 
     po::variables_map vm;
     try
@@ -201,7 +418,7 @@ bool load_program_config(int argc, const char* argv[], prog_config& cfg)
         return false;
     }
 
-    if (vm.count("file") < 1)
+    if (vm.count("file") < 1 && vm.count("daemon") < 1)
     {
         std::cout << "Missing files" << std::endl;
         return false;
@@ -235,8 +452,25 @@ bool load_program_config(int argc, const char* argv[], prog_config& cfg)
         }
 
         read_cmdline_args(vm, cfg);
+        resolve_thread_placement(cfg);
+
+        // A daemon's connections sit idle between jobs. Unless told
+        // otherwise, have the kernel probe them too, so a path that died
+        // quietly shows without waiting for the next keepalive to time out.
+        if (!cfg.daemon_socket.empty())
+        {
+            for (auto& server : cfg.servers)
+            {
+                auto& socket = server.first.socket;
+                if (socket.keepalive_idle == 0)
+                {
+                    socket.keepalive_idle = DAEMON_TCP_KEEPALIVE_IDLE;
+                }
+            }
+        }
 
-        if (cfg.groups.size() < 1)
+        // Jobs bring their own
+        if (cfg.groups.size() < 1 && cfg.daemon_socket.empty())
         {
             std::cout << "Need at least one group to post to!" << std::endl;
             return false;
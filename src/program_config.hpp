@@ -1,11 +1,15 @@
 #ifndef PROGRAM_CONFIG_HPP_
 #define PROGRAM_CONFIG_HPP_
 
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <boost/filesystem.hpp>
 
 #include "nntp/connection_info.hpp"
+#include "nntp/dispatch_policy.hpp"
+#include "fileset.hpp"
+#include "util/cpu_affinity.hpp"
 
 struct prog_config
 {
@@ -17,11 +21,36 @@ struct prog_config
     size_t io_threads;
     size_t queue_size;
     int operation_timeout;
+    unsigned int max_post_failures = 3;
+    int retry_delay_ms = 1000;
+    int max_retry_delay_ms = 60000;
+
+    // KB/s over all servers, zero is unlimited
+    std::uint64_t max_upload_rate = 0;
+
+    // Which server gets an article when several have idle connections
+    p2u::nntp::dispatch_mode dispatch = p2u::nntp::dispatch_mode::WEIGHTED;
+
+    // Articles a connection takes off the queue at once
+    size_t prefetch_depth = 4;
+
+    post_order order = post_order::FILE_IN_ORDER;
+
+    // CPUs for the io threads and for the thread that encodes. Empty leaves
+    // them to the scheduler, or to where the interface below sits.
+    p2u::util::cpu_list io_thread_cpus;
+    p2u::util::cpu_list encoder_cpus;
+
+    // NIC the posts go out through, to place threads next to it
+    std::string interface;
     bool validate_posts;
     bool raw;
     std::vector<boost::filesystem::path> files;
     std::vector<std::string> groups;
     std::string nzboutput;
+
+    // Unix socket to take jobs on, instead of posting files and exiting
+    std::string daemon_socket;
 };
 
 bool load_program_config(int argc, const char* argv[], prog_config& cfg);
@@ -0,0 +1,22 @@
+#include "backoff.hpp"
+#include <algorithm>
+#include <cstdint>
+
+std::chrono::milliseconds p2u::util::jittered_backoff(std::chrono::milliseconds base,
+        std::chrono::milliseconds max, unsigned int attempt, std::mt19937& rng)
+{
+    if (attempt == 0)
+    {
+        return std::chrono::milliseconds{0};
+    }
+
+    std::int64_t delay = base.count();
+    for (unsigned int i = 1; i < attempt && delay < max.count(); ++i)
+    {
+        delay *= 2;
+    }
+    delay = std::min<std::int64_t>(delay, max.count());
+
+    std::uniform_int_distribution<std::int64_t> jitter{0, delay / 2};
+    return std::chrono::milliseconds{delay - delay / 2 + jitter(rng)};
+}
@@ -0,0 +1,28 @@
+#ifndef UTIL_BACKOFF_HPP_
+#define UTIL_BACKOFF_HPP_
+
+/**
+ * Exponential backoff with equal jitter.
+ *
+ * Used for reconnects and for retrying posts alike. Half of the delay is
+ * kept and the other half randomized, so that whatever failed together
+ * doesn't come back together.
+ */
+
+#include <chrono>
+#include <random>
+
+namespace p2u
+{
+    namespace util
+    {
+        /**
+         * base * 2^(attempt - 1), capped at max, with equal jitter. Zero for
+         * attempt zero. The generator isn't locked, that is up to the
+         * caller.
+         */
+        std::chrono::milliseconds jittered_backoff(std::chrono::milliseconds base,
+                std::chrono::milliseconds max, unsigned int attempt, std::mt19937& rng);
+    }
+}
+#endif
@@ -0,0 +1,135 @@
+#include "connect_race.hpp"
+
+p2u::asio::connect_race::connect_race(boost::asio::io_service& io_service,
+                                      const std::vector<boost::asio::ip::tcp::endpoint>& endpoints,
+                                      boost::posix_time::time_duration stagger,
+                                      const connect_handler& handler,
+                                      const socket_setup& setup)
+    : m_iosvc(io_service), m_endpoints{endpoints}, m_stagger_timer{io_service},
+      m_stagger{stagger}, m_handler{handler}, m_setup{setup}, m_next{0}, m_pending{0}, m_done{false}
+{
+
+}
+
+std::shared_ptr<p2u::asio::connect_race> p2u::asio::connect_race::start(
+        boost::asio::io_service& io_service,
+        const std::vector<boost::asio::ip::tcp::endpoint>& endpoints,
+        boost::posix_time::time_duration stagger,
+        const connect_handler& handler,
+        const socket_setup& setup)
+{
+    std::shared_ptr<connect_race> race{new connect_race(io_service, endpoints, stagger, handler, setup)};
+
+    if (endpoints.empty())
+    {
+        io_service.post([race]()
+                {
+                    race->finish(boost::asio::error::host_not_found, nullptr);
+                });
+    }
+    else
+    {
+        race->try_next();
+    }
+
+    return race;
+}
+
+void p2u::asio::connect_race::try_next()
+{
+    size_t index = m_next++;
+
+    m_sockets.emplace_back(new boost::asio::ip::tcp::socket(m_iosvc));
+    ++m_pending;
+
+    auto self = shared_from_this();
+    boost::system::error_code ec;
+    m_sockets[index]->open(m_endpoints[index].protocol(), ec);
+    if (!ec && m_setup)
+    {
+        ec = m_setup(*m_sockets[index]);
+    }
+
+    if (ec)
+    {
+        m_iosvc.post([self, index, ec]()
+                {
+                    self->on_attempt(index, ec);
+                });
+        return;
+    }
+
+    m_sockets[index]->async_connect(m_endpoints[index],
+            [self, index](const boost::system::error_code& ec)
+            {
+                self->on_attempt(index, ec);
+            });
+
+    if (m_next < m_endpoints.size())
+    {
+        m_stagger_timer.expires_from_now(m_stagger);
+        m_stagger_timer.async_wait([self](const boost::system::error_code& ec)
+                {
+                    if (!ec && !self->m_done && self->m_next < self->m_endpoints.size())
+                    {
+                        self->try_next();
+                    }
+                });
+    }
+}
+
+void p2u::asio::connect_race::on_attempt(size_t index, const boost::system::error_code& ec)
+{
+    --m_pending;
+
+    if (m_done)
+    {
+        return;
+    }
+
+    if (!ec)
+    {
+        finish(ec, std::move(m_sockets[index]));
+        return;
+    }
+
+    m_last_error = ec;
+    m_sockets[index]->close();
+
+    if (m_next < m_endpoints.size())
+    {
+        // Don't wait out the stagger delay for an address that already failed
+        try_next();
+    }
+    else if (m_pending == 0)
+    {
+        finish(m_last_error, nullptr);
+    }
+}
+
+void p2u::asio::connect_race::finish(const boost::system::error_code& ec, socket_ptr winner)
+{
+    auto self = shared_from_this();
+
+    m_done = true;
+    m_stagger_timer.cancel();
+
+    boost::system::error_code ignored;
+    for (auto& sock : m_sockets)
+    {
+        if (sock)
+        {
+            sock->close(ignored);
+        }
+    }
+
+    m_handler(ec, std::move(winner));
+}
+
+void p2u::asio::connect_race::cancel()
+{
+    if (!m_done)
+    {
+        finish(boost::asio::error::operation_aborted, nullptr);
+    }
+}
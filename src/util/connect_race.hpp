@@ -0,0 +1,77 @@
+#ifndef UTIL_CONNECT_RACE_HPP_
+#define UTIL_CONNECT_RACE_HPP_
+
+/**
+ * Happy Eyeballs style connect (RFC 8305).
+ *
+ * Endpoints are tried in order. The next one is started whenever the previous
+ * attempt hasn't connected within the stagger delay, or right away when it
+ * fails. The first socket to connect wins and every other attempt is
+ * dropped, so one dead address costs us a couple hundred milliseconds
+ * instead of a full connect timeout.
+ */
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace p2u
+{
+    namespace asio
+    {
+        class connect_race : public std::enable_shared_from_this<connect_race>,
+                             private boost::noncopyable
+        {
+            public:
+                using socket_ptr = std::unique_ptr<boost::asio::ip::tcp::socket>;
+
+                // On failure the socket is null
+                using connect_handler = std::function<void(const boost::system::error_code&, socket_ptr)>;
+
+                // Called on every socket after it was opened, before it
+                // connects. An error fails that attempt.
+                using socket_setup = std::function<boost::system::error_code(boost::asio::ip::tcp::socket&)>;
+
+            private:
+                boost::asio::io_service& m_iosvc;
+                std::vector<boost::asio::ip::tcp::endpoint> m_endpoints;
+                std::vector<socket_ptr> m_sockets;
+                boost::asio::deadline_timer m_stagger_timer;
+                boost::posix_time::time_duration m_stagger;
+                connect_handler m_handler;
+                socket_setup m_setup;
+
+                size_t m_next;
+                size_t m_pending;
+                bool m_done;
+                boost::system::error_code m_last_error;
+
+                connect_race(boost::asio::io_service& io_service,
+                             const std::vector<boost::asio::ip::tcp::endpoint>& endpoints,
+                             boost::posix_time::time_duration stagger,
+                             const connect_handler& handler,
+                             const socket_setup& setup);
+
+                void try_next();
+                void on_attempt(size_t index, const boost::system::error_code& ec);
+                void finish(const boost::system::error_code& ec, socket_ptr winner);
+
+            public:
+                static std::shared_ptr<connect_race> start(
+                        boost::asio::io_service& io_service,
+                        const std::vector<boost::asio::ip::tcp::endpoint>& endpoints,
+                        boost::posix_time::time_duration stagger,
+                        const connect_handler& handler,
+                        const socket_setup& setup = socket_setup{});
+
+                /**
+                 * Abandons all attempts. The handler is called with
+                 * operation_aborted unless the race was already decided.
+                 */
+                void cancel();
+        };
+    }
+}
+#endif
@@ -0,0 +1,56 @@
+#ifndef UTIL_COUNTING_MUTEX_HPP_
+#define UTIL_COUNTING_MUTEX_HPP_
+
+/**
+ * A std::mutex that counts how often it was taken.
+ *
+ * Meant for hot locks whose traffic we want to report, e.g. how many times
+ * per article the dispatch lock is taken. The count is bumped while the
+ * lock is held, so it costs one uncontended relaxed increment.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <boost/noncopyable.hpp>
+
+namespace p2u
+{
+    namespace util
+    {
+        class counting_mutex : private boost::noncopyable
+        {
+            private:
+                std::mutex m_mutex;
+                std::atomic<std::uint64_t> m_acquisitions{0};
+
+            public:
+                void lock()
+                {
+                    m_mutex.lock();
+                    m_acquisitions.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                bool try_lock()
+                {
+                    if (!m_mutex.try_lock())
+                    {
+                        return false;
+                    }
+                    m_acquisitions.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+
+                void unlock()
+                {
+                    m_mutex.unlock();
+                }
+
+                std::uint64_t acquisitions() const
+                {
+                    return m_acquisitions.load(std::memory_order_relaxed);
+                }
+        };
+    }
+}
+#endif
@@ -0,0 +1,277 @@
+#include "cpu_affinity.hpp"
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <stdexcept>
+
+namespace
+{
+    // First line of a sysfs or procfs file, empty if it can't be read
+    std::string read_line(const std::string& path)
+    {
+        std::ifstream file{path};
+        std::string line;
+        std::getline(file, line);
+        boost::algorithm::trim(line);
+        return line;
+    }
+
+    p2u::util::cpu_list read_cpu_list(const std::string& path)
+    {
+        auto line = read_line(path);
+        if (line.empty())
+        {
+            return {};
+        }
+
+        try
+        {
+            return p2u::util::parse_cpu_list(line);
+        }
+        catch (const std::runtime_error&)
+        {
+            return {};
+        }
+    }
+}
+
+p2u::util::cpu_list p2u::util::parse_cpu_list(const std::string& str)
+{
+    std::vector<std::string> items;
+    boost::algorithm::split(items, str, boost::algorithm::is_any_of(","));
+
+    std::set<int> cpus;
+    for (auto& item : items)
+    {
+        boost::algorithm::trim(item);
+        if (item.empty())
+        {
+            continue;
+        }
+
+        try
+        {
+            size_t end = 0;
+            auto dash = item.find('-');
+            int first = std::stoi(item.substr(0, dash), &end);
+            if (end != item.substr(0, dash).size() || first < 0)
+            {
+                throw std::invalid_argument{item};
+            }
+
+            int last = first;
+            if (dash != std::string::npos)
+            {
+                last = std::stoi(item.substr(dash + 1), &end);
+                if (end != item.size() - dash - 1 || last < first)
+                {
+                    throw std::invalid_argument{item};
+                }
+            }
+
+            for (int cpu = first; cpu <= last; ++cpu)
+            {
+                cpus.insert(cpu);
+            }
+        }
+        catch (const std::logic_error&)
+        {
+            throw std::runtime_error{"Invalid CPU list \"" + str + "\""};
+        }
+    }
+
+    if (cpus.empty())
+    {
+        throw std::runtime_error{"Invalid CPU list \"" + str + "\""};
+    }
+    return cpu_list(cpus.begin(), cpus.end());
+}
+
+std::string p2u::util::to_string(const cpu_list& cpus)
+{
+    std::string result;
+    for (size_t i = 0; i < cpus.size(); )
+    {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+        {
+            ++j;
+        }
+
+        if (!result.empty())
+        {
+            result += ",";
+        }
+        result += std::to_string(cpus[i]);
+        if (j > i)
+        {
+            result += "-" + std::to_string(cpus[j]);
+        }
+        i = j + 1;
+    }
+    return result;
+}
+
+int p2u::util::numa_node_of_cpu(int cpu)
+{
+    namespace fs = boost::filesystem;
+
+    boost::system::error_code ec;
+    fs::path dir{"/sys/devices/system/cpu/cpu" + std::to_string(cpu)};
+    for (fs::directory_iterator it{dir, ec}, end; !ec && it != end; it.increment(ec))
+    {
+        auto name = it->path().filename().string();
+        if (boost::algorithm::starts_with(name, "node") && name.size() > 4
+                && std::all_of(name.begin() + 4, name.end(), ::isdigit))
+        {
+            return std::stoi(name.substr(4));
+        }
+    }
+
+    // No node links without NUMA support, but the CPU may still be there
+    return fs::exists(dir) ? 0 : -1;
+}
+
+p2u::util::cpu_list p2u::util::cpus_of_node(int node)
+{
+    return read_cpu_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+}
+
+std::string p2u::util::pin_this_thread(const cpu_list& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+    {
+        if (cpu >= CPU_SETSIZE)
+        {
+            return "CPU " + std::to_string(cpu) + " is out of range";
+        }
+        CPU_SET(cpu, &set);
+    }
+
+    int err = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+    if (err != 0)
+    {
+        return std::strerror(err);
+    }
+    return {};
+}
+
+std::string p2u::util::prefer_numa_node(int node)
+{
+    if (node < 0 || node >= static_cast<int>(8 * sizeof(unsigned long)))
+    {
+        return "no such node";
+    }
+
+    // glibc has no wrapper, that is in libnuma
+    unsigned long mask = 1UL << node;
+    if (::syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, 8 * sizeof(mask)) != 0)
+    {
+        return std::strerror(errno);
+    }
+    return {};
+}
+
+std::string p2u::util::place_this_thread(const cpu_list& cpus)
+{
+    auto error = pin_this_thread(cpus);
+    if (!error.empty() || cpus.empty())
+    {
+        return error;
+    }
+
+    int node = numa_node_of_cpu(cpus.front());
+    if (node >= 0 && std::all_of(cpus.begin(), cpus.end(),
+                [node](int cpu) { return numa_node_of_cpu(cpu) == node; }))
+    {
+        return prefer_numa_node(node);
+    }
+    return {};
+}
+
+p2u::util::nic_placement p2u::util::inspect_interface(const std::string& name)
+{
+    namespace fs = boost::filesystem;
+
+    fs::path netdev{"/sys/class/net/" + name};
+    if (name.empty() || name.find('/') != std::string::npos || !fs::exists(netdev))
+    {
+        throw std::runtime_error{"No network interface named \"" + name + "\""};
+    }
+
+    nic_placement result;
+    result.interface = name;
+
+    // Virtual interfaces have no device
+    auto device = netdev / "device";
+    auto node = read_line((device / "numa_node").string());
+    if (!node.empty())
+    {
+        try
+        {
+            result.node = std::stoi(node);
+        }
+        catch (const std::logic_error&)
+        {
+        }
+    }
+
+    result.local_cpus = read_cpu_list((device / "local_cpulist").string());
+    if (result.local_cpus.empty() && result.node >= 0)
+    {
+        result.local_cpus = cpus_of_node(result.node);
+    }
+
+    // One MSI-X vector per queue on anything recent, else the legacy line
+    std::vector<std::string> irqs;
+    boost::system::error_code ec;
+    for (fs::directory_iterator it{device / "msi_irqs", ec}, end; !ec && it != end; it.increment(ec))
+    {
+        irqs.push_back(it->path().filename().string());
+    }
+    if (irqs.empty())
+    {
+        auto irq = read_line((device / "irq").string());
+        if (!irq.empty() && irq != "0")
+        {
+            irqs.push_back(irq);
+        }
+    }
+
+    std::set<int> irq_cpus;
+    for (const auto& irq : irqs)
+    {
+        // What the interrupt controller actually does, where the kernel
+        // tells, rather than what was asked for
+        auto cpus = read_cpu_list("/proc/irq/" + irq + "/effective_affinity_list");
+        if (cpus.empty())
+        {
+            cpus = read_cpu_list("/proc/irq/" + irq + "/smp_affinity_list");
+        }
+        irq_cpus.insert(cpus.begin(), cpus.end());
+    }
+    result.irq_cpus.assign(irq_cpus.begin(), irq_cpus.end());
+
+    return result;
+}
+
+p2u::util::cpu_list p2u::util::io_cpus_for(const nic_placement& nic)
+{
+    cpu_list result;
+    std::set_difference(nic.local_cpus.begin(), nic.local_cpus.end(),
+            nic.irq_cpus.begin(), nic.irq_cpus.end(), std::back_inserter(result));
+    return result.empty() ? nic.local_cpus : result;
+}
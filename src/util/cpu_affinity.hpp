@@ -0,0 +1,85 @@
+#ifndef UTIL_CPU_AFFINITY_HPP_
+#define UTIL_CPU_AFFINITY_HPP_
+
+/**
+ * Thread placement on multi-socket machines.
+ *
+ * On a box with several NUMA nodes, an io thread the scheduler moves to the
+ * other socket encrypts payloads that live in the first socket's memory and
+ * hands them to a NIC hanging off the first socket's PCIe lanes. Pinning
+ * threads to the NIC's node, and making them allocate there, keeps all of
+ * that local.
+ *
+ * Everything is read from sysfs, so there is no libnuma to link. On machines
+ * without NUMA every CPU is on node 0.
+ */
+
+#include <string>
+#include <vector>
+
+namespace p2u
+{
+    namespace util
+    {
+        using cpu_list = std::vector<int>;
+
+        /**
+         * Parses the kernel's list format, e.g. "0-3,8,10-11". Throws
+         * std::runtime_error on anything else.
+         */
+        cpu_list parse_cpu_list(const std::string& str);
+        std::string to_string(const cpu_list& cpus);
+
+        // -1 if the CPU is not known to sysfs
+        int numa_node_of_cpu(int cpu);
+
+        // Empty if the node doesn't exist
+        cpu_list cpus_of_node(int node);
+
+        /**
+         * Restricts the calling thread to the given CPUs. Returns an empty
+         * string on success, the reason otherwise.
+         */
+        std::string pin_this_thread(const cpu_list& cpus);
+
+        /**
+         * Makes the calling thread allocate from the given node while it
+         * has memory free. Only touches the calling thread, buffers it hands
+         * to others stay where they were first touched.
+         */
+        std::string prefer_numa_node(int node);
+
+        /**
+         * Both of the above: pins the calling thread, and if all the CPUs
+         * are on one node, prefers that node's memory.
+         */
+        std::string place_this_thread(const cpu_list& cpus);
+
+        // Where a network interface sits and who serves its interrupts
+        struct nic_placement
+        {
+            std::string interface;
+
+            // -1 for virtual interfaces and single node machines
+            int node = -1;
+
+            // CPUs close to the NIC, and the ones its queues interrupt
+            cpu_list local_cpus;
+            cpu_list irq_cpus;
+        };
+
+        /**
+         * Throws std::runtime_error if the interface doesn't exist. Whatever
+         * sysfs doesn't tell, e.g. for a virtual interface, stays empty.
+         */
+        nic_placement inspect_interface(const std::string& name);
+
+        /**
+         * CPUs to put io threads on: the NIC's local ones that don't take its
+         * interrupts, so softirq work and TLS don't compete for a core. All
+         * local ones if that leaves none.
+         */
+        cpu_list io_cpus_for(const nic_placement& nic);
+    }
+}
+#endif
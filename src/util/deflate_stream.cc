@@ -0,0 +1,168 @@
+#include "deflate_stream.hpp"
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+    // Raw deflate, no zlib header, as RFC 8054 asks for
+    const int WINDOW_BITS = -15;
+    const int MEM_LEVEL = 8;
+
+    const size_t OUTPUT_STEP = 16 * 1024;
+
+    boost::system::error_code corrupt_stream()
+    {
+        return boost::system::errc::make_error_code(boost::system::errc::bad_message);
+    }
+
+    std::chrono::microseconds since(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start);
+    }
+}
+
+p2u::asio::compression_statistics& p2u::asio::compression_statistics::operator+=(const compression_statistics& other)
+{
+    sent += other.sent;
+    sent_compressed += other.sent_compressed;
+    received += other.received;
+    received_compressed += other.received_compressed;
+    cpu += other.cpu;
+    return *this;
+}
+
+p2u::asio::deflate_stream::deflate_stream(boost::asio::ip::tcp::socket& sock,
+                                          const read_function& read,
+                                          const write_function& write)
+    : m_sock(sock), m_read{read}, m_write{write},
+      m_level{Z_DEFAULT_COMPRESSION}, m_wanted_level{Z_DEFAULT_COMPRESSION}
+{
+    std::memset(&m_deflate, 0, sizeof(m_deflate));
+    std::memset(&m_inflate, 0, sizeof(m_inflate));
+
+    if (deflateInit2(&m_deflate, m_level, Z_DEFLATED, WINDOW_BITS, MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        throw std::runtime_error{"Could not set up deflate"};
+    }
+
+    if (inflateInit2(&m_inflate, WINDOW_BITS) != Z_OK)
+    {
+        deflateEnd(&m_deflate);
+        throw std::runtime_error{"Could not set up inflate"};
+    }
+}
+
+p2u::asio::deflate_stream::~deflate_stream()
+{
+    deflateEnd(&m_deflate);
+    inflateEnd(&m_inflate);
+}
+
+void p2u::asio::deflate_stream::set_level(int level)
+{
+    m_wanted_level = level;
+}
+
+const p2u::asio::compression_statistics& p2u::asio::deflate_stream::get_statistics() const
+{
+    return m_stats;
+}
+
+boost::asio::io_service& p2u::asio::deflate_stream::get_io_service()
+{
+    return m_sock.get_io_service();
+}
+
+size_t p2u::asio::deflate_stream::inflate_into(boost::asio::mutable_buffer buffer, boost::system::error_code& ec)
+{
+    size_t room = boost::asio::buffer_size(buffer);
+    if (m_pending.empty() || room == 0)
+    {
+        return 0;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    m_inflate.next_in = m_pending.data();
+    m_inflate.avail_in = static_cast<uInt>(m_pending.size());
+    m_inflate.next_out = boost::asio::buffer_cast<Bytef*>(buffer);
+    m_inflate.avail_out = static_cast<uInt>(room);
+
+    int ret = inflate(&m_inflate, Z_SYNC_FLUSH);
+    m_stats.cpu += since(start);
+
+    size_t consumed = m_pending.size() - m_inflate.avail_in;
+    size_t produced = room - m_inflate.avail_out;
+    m_pending.erase(m_pending.begin(), m_pending.begin() + consumed);
+    m_stats.received += produced;
+
+    if (ret == Z_STREAM_END)
+    {
+        // The server isn't supposed to end its side, and nothing can follow
+        if (produced == 0)
+        {
+            ec = boost::asio::error::eof;
+        }
+    }
+    else if (ret != Z_OK && ret != Z_BUF_ERROR)
+    {
+        ec = corrupt_stream();
+    }
+
+    return produced;
+}
+
+void p2u::asio::deflate_stream::deflate_begin(boost::system::error_code& ec)
+{
+    m_outbuf.clear();
+    if (m_wanted_level == m_level)
+    {
+        return;
+    }
+
+    // Everything before this was flushed by the last write, so this only
+    // ever needs a few bytes to close the current block
+    auto start = std::chrono::steady_clock::now();
+    m_outbuf.resize(OUTPUT_STEP);
+    m_deflate.next_in = nullptr;
+    m_deflate.avail_in = 0;
+    m_deflate.next_out = m_outbuf.data();
+    m_deflate.avail_out = static_cast<uInt>(m_outbuf.size());
+
+    int ret = deflateParams(&m_deflate, m_wanted_level, Z_DEFAULT_STRATEGY);
+    m_stats.cpu += since(start);
+    m_outbuf.resize(m_outbuf.size() - m_deflate.avail_out);
+
+    if (ret != Z_OK)
+    {
+        ec = corrupt_stream();
+        return;
+    }
+    m_level = m_wanted_level;
+}
+
+void p2u::asio::deflate_stream::deflate_some(const void* data, size_t size, int flush, boost::system::error_code& ec)
+{
+    auto start = std::chrono::steady_clock::now();
+    m_deflate.next_in = static_cast<Bytef*>(const_cast<void*>(data));
+    m_deflate.avail_in = static_cast<uInt>(size);
+
+    do
+    {
+        size_t used = m_outbuf.size();
+        m_outbuf.resize(used + OUTPUT_STEP);
+        m_deflate.next_out = m_outbuf.data() + used;
+        m_deflate.avail_out = static_cast<uInt>(OUTPUT_STEP);
+
+        int ret = deflate(&m_deflate, flush);
+        m_outbuf.resize(m_outbuf.size() - m_deflate.avail_out);
+
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            ec = corrupt_stream();
+            break;
+        }
+    } while (m_deflate.avail_in > 0 || m_deflate.avail_out == 0);
+
+    m_stats.cpu += since(start);
+}
@@ -0,0 +1,186 @@
+#ifndef UTIL_DEFLATE_STREAM_HPP_
+#define UTIL_DEFLATE_STREAM_HPP_
+
+/**
+ * The compression layer of NNTP COMPRESS DEFLATE (RFC 8054).
+ *
+ * Sits on top of whatever the connection talks through (plain socket, TLS
+ * or kernel TLS), which is handed in as a pair of functions. Both directions
+ * are raw deflate streams. Every write ends on a sync flush so the server
+ * can act on a command without waiting for more data.
+ *
+ * The level can be changed between writes, which is how article payloads
+ * (yEnc, which barely compresses) are sent as stored blocks while commands
+ * still get compressed.
+ */
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/version.hpp>
+#include <zlib.h>
+
+namespace p2u
+{
+    namespace asio
+    {
+        struct compression_statistics
+        {
+            // Before and after compression
+            std::uint64_t sent = 0;
+            std::uint64_t sent_compressed = 0;
+            std::uint64_t received = 0;
+            std::uint64_t received_compressed = 0;
+
+            // Spent in zlib, both directions
+            std::chrono::microseconds cpu{0};
+
+            compression_statistics& operator+=(const compression_statistics& other);
+        };
+
+        class deflate_stream : private boost::noncopyable
+        {
+            public:
+                using io_handler = std::function<void(const boost::system::error_code&, size_t)>;
+
+                // Reads some bytes from the layer below
+                using read_function = std::function<void(boost::asio::mutable_buffer, const io_handler&)>;
+
+                // Writes all of the buffer to the layer below
+                using write_function = std::function<void(boost::asio::const_buffer, const io_handler&)>;
+
+            private:
+                boost::asio::ip::tcp::socket& m_sock;
+                read_function m_read;
+                write_function m_write;
+
+                z_stream m_deflate;
+                z_stream m_inflate;
+                int m_level;
+                int m_wanted_level;
+
+                // Compressed bytes read but not inflated yet
+                std::vector<unsigned char> m_pending;
+                std::array<unsigned char, 16 * 1024> m_readchunk;
+                std::vector<unsigned char> m_outbuf;
+
+                compression_statistics m_stats;
+
+                size_t inflate_into(boost::asio::mutable_buffer buffer, boost::system::error_code& ec);
+                void deflate_begin(boost::system::error_code& ec);
+                void deflate_some(const void* data, size_t size, int flush, boost::system::error_code& ec);
+
+                template <class ReadHandler>
+                void do_read(boost::asio::mutable_buffer buffer, ReadHandler handler)
+                {
+                    boost::system::error_code ec;
+                    size_t produced = inflate_into(buffer, ec);
+                    if (ec || produced > 0 || boost::asio::buffer_size(buffer) == 0)
+                    {
+                        get_io_service().post([handler, ec, produced]() mutable { handler(ec, produced); });
+                        return;
+                    }
+
+                    // Nothing to hand out yet, wait for more from the server
+                    m_read(boost::asio::buffer(m_readchunk),
+                            [this, buffer, handler](const boost::system::error_code& ec, size_t bytes_read) mutable
+                            {
+                                if (ec)
+                                {
+                                    handler(ec, 0);
+                                    return;
+                                }
+
+                                m_pending.insert(m_pending.end(), m_readchunk.begin(), m_readchunk.begin() + bytes_read);
+                                m_stats.received_compressed += bytes_read;
+                                do_read(buffer, handler);
+                            });
+                }
+
+            public:
+                deflate_stream(boost::asio::ip::tcp::socket& sock,
+                               const read_function& read,
+                               const write_function& write);
+                ~deflate_stream();
+
+                /**
+                 * Level for the next writes, as in zlib. Z_NO_COMPRESSION
+                 * sends stored blocks: still framed, but no CPU spent.
+                 */
+                void set_level(int level);
+
+                const compression_statistics& get_statistics() const;
+
+                boost::asio::io_service& get_io_service();
+
+#if BOOST_VERSION >= 106600
+                using executor_type = boost::asio::ip::tcp::socket::executor_type;
+                executor_type get_executor()
+                {
+                    return m_sock.get_executor();
+                }
+#endif
+
+                template <class MutableBufferSequence, class ReadHandler>
+                void async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler)
+                {
+                    auto buffer = boost::asio::detail::buffer_sequence_adapter<
+                        boost::asio::mutable_buffer, MutableBufferSequence>::first(buffers);
+                    do_read(buffer, typename std::decay<ReadHandler>::type(std::forward<ReadHandler>(handler)));
+                }
+
+                /**
+                 * Compresses and writes all of buffers. The handler gets the
+                 * uncompressed byte count.
+                 */
+                template <class ConstBufferSequence, class WriteHandler>
+                void async_write(const ConstBufferSequence& buffers, WriteHandler handler)
+                {
+                    boost::system::error_code ec;
+                    size_t total = 0;
+
+#if BOOST_VERSION >= 106600
+                    auto begin = boost::asio::buffer_sequence_begin(buffers);
+                    auto end = boost::asio::buffer_sequence_end(buffers);
+#else
+                    auto begin = buffers.begin();
+                    auto end = buffers.end();
+#endif
+
+                    deflate_begin(ec);
+                    for (auto it = begin; !ec && it != end; ++it)
+                    {
+                        boost::asio::const_buffer part{*it};
+                        size_t size = boost::asio::buffer_size(part);
+                        deflate_some(boost::asio::buffer_cast<const void*>(part), size, Z_NO_FLUSH, ec);
+                        total += size;
+                    }
+
+                    if (!ec)
+                    {
+                        deflate_some(nullptr, 0, Z_SYNC_FLUSH, ec);
+                    }
+
+                    if (ec)
+                    {
+                        get_io_service().post([handler, ec]() mutable { handler(ec, 0); });
+                        return;
+                    }
+
+                    m_stats.sent += total;
+                    m_stats.sent_compressed += m_outbuf.size();
+                    m_write(boost::asio::buffer(m_outbuf),
+                            [handler, total](const boost::system::error_code& ec, size_t) mutable
+                            {
+                                handler(ec, ec ? 0 : total);
+                            });
+                }
+        };
+    }
+}
+#endif
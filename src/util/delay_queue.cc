@@ -0,0 +1,84 @@
+#include "delay_queue.hpp"
+#include <vector>
+
+p2u::asio::delay_queue::delay_queue(boost::asio::io_service& io_service)
+    : m_timer{io_service}
+{
+
+}
+
+p2u::asio::delay_queue::time_point p2u::asio::delay_queue::now()
+{
+    return boost::posix_time::microsec_clock::universal_time();
+}
+
+void p2u::asio::delay_queue::arm()
+{
+    // Must be called with m_lock held. Re-arming cancels the earlier wait,
+    // whose handler then sees operation_aborted.
+    m_timer.expires_at(m_items.begin()->first);
+    m_timer.async_wait([this](const boost::system::error_code& ec)
+            {
+                on_timer(ec);
+            });
+}
+
+void p2u::asio::delay_queue::schedule(std::chrono::milliseconds delay, const function& func)
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+
+    auto it = m_items.emplace(now() + boost::posix_time::milliseconds(delay.count()), func);
+    if (it == m_items.begin())
+    {
+        arm();
+    }
+}
+
+void p2u::asio::delay_queue::on_timer(const boost::system::error_code& ec)
+{
+    if (ec == boost::asio::error::operation_aborted)
+    {
+        return;
+    }
+
+    std::vector<function> due;
+    {
+        std::lock_guard<std::mutex> _lock{m_lock};
+        auto current = now();
+        auto end = m_items.upper_bound(current);
+        for (auto it = m_items.begin(); it != end; ++it)
+        {
+            due.push_back(std::move(it->second));
+        }
+        m_items.erase(m_items.begin(), end);
+
+        if (!m_items.empty())
+        {
+            arm();
+        }
+    }
+
+    // Outside the lock, these are free to schedule again
+    for (auto& func : due)
+    {
+        func();
+    }
+}
+
+size_t p2u::asio::delay_queue::size() const
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    return m_items.size();
+}
+
+bool p2u::asio::delay_queue::empty() const
+{
+    return size() == 0;
+}
+
+void p2u::asio::delay_queue::clear()
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    m_items.clear();
+    m_timer.cancel();
+}
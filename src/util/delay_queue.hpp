@@ -0,0 +1,56 @@
+#ifndef UTIL_DELAY_QUEUE_HPP_
+#define UTIL_DELAY_QUEUE_HPP_
+
+/**
+ * Runs functions on the io_service once their delay has passed.
+ *
+ * One timer serves the whole queue: it always waits for the earliest entry,
+ * so a few hundred pending retries don't mean a few hundred timers.
+ */
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+
+namespace p2u
+{
+    namespace asio
+    {
+        class delay_queue : private boost::noncopyable
+        {
+            public:
+                using function = std::function<void()>;
+
+            private:
+                using time_point = boost::posix_time::ptime;
+
+                boost::asio::deadline_timer m_timer;
+                mutable std::mutex m_lock;
+                std::multimap<time_point, function> m_items;
+
+                static time_point now();
+                void arm();
+                void on_timer(const boost::system::error_code& ec);
+
+            public:
+                delay_queue(boost::asio::io_service& io_service);
+
+                void schedule(std::chrono::milliseconds delay, const function& func);
+
+                /**
+                 * Entries that haven't run yet
+                 */
+                size_t size() const;
+                bool empty() const;
+
+                /**
+                 * Drops every pending entry without running it
+                 */
+                void clear();
+        };
+    }
+}
+#endif
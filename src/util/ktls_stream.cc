@@ -0,0 +1,113 @@
+#include "ktls_stream.hpp"
+#include <cerrno>
+
+p2u::asio::ktls_stream::ktls_stream(boost::asio::ip::tcp::socket& sock,
+                                    boost::asio::ssl::context& ctx)
+    : m_sock(sock), m_ssl{SSL_new(ctx.native_handle())}, m_kernel_send{false}
+{
+    if (!m_ssl)
+    {
+        throw std::runtime_error{"Could not allocate SSL object"};
+    }
+
+    // Both are needed because async_write_some may hand us a different
+    // (shorter) buffer after a partial write.
+    SSL_set_mode(m_ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                        SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+}
+
+p2u::asio::ktls_stream::~ktls_stream()
+{
+    SSL_free(m_ssl);
+}
+
+bool p2u::asio::ktls_stream::supported()
+{
+#ifdef P2U_HAVE_KTLS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void p2u::asio::ktls_stream::enable_on(boost::asio::ssl::context& ctx)
+{
+#ifdef P2U_HAVE_KTLS
+    SSL_CTX_set_options(ctx.native_handle(), SSL_OP_ENABLE_KTLS);
+#else
+    (void)ctx;
+#endif
+}
+
+bool p2u::asio::ktls_stream::kernel_send() const
+{
+    return m_kernel_send;
+}
+
+boost::asio::io_service& p2u::asio::ktls_stream::get_io_service()
+{
+    return m_sock.get_io_service();
+}
+
+boost::system::error_code p2u::asio::ktls_stream::last_error(int ret)
+{
+    int err = SSL_get_error(m_ssl, ret);
+
+    if (err == SSL_ERROR_ZERO_RETURN)
+    {
+        return boost::asio::error::eof;
+    }
+
+    if (err == SSL_ERROR_SYSCALL && ERR_peek_error() == 0)
+    {
+        if (errno == 0)
+        {
+            return boost::asio::error::eof;
+        }
+        return boost::system::error_code{errno, boost::system::system_category()};
+    }
+
+    return boost::system::error_code{static_cast<int>(ERR_get_error()),
+                                     boost::asio::error::get_ssl_category()};
+}
+
+void p2u::asio::ktls_stream::async_handshake(const handshake_handler& handler)
+{
+    boost::system::error_code ec;
+
+    // OpenSSL drives the socket itself, and must never block the io thread
+    m_sock.non_blocking(true, ec);
+    if (ec || SSL_set_fd(m_ssl, static_cast<int>(m_sock.native_handle())) != 1)
+    {
+        get_io_service().post([handler](){ handler(boost::asio::error::bad_descriptor); });
+        return;
+    }
+
+    SSL_set_connect_state(m_ssl);
+    do_handshake(handler);
+}
+
+void p2u::asio::ktls_stream::do_handshake(const handshake_handler& handler)
+{
+    ERR_clear_error();
+    int ret = SSL_do_handshake(m_ssl);
+
+    if (ret == 1)
+    {
+#ifdef P2U_HAVE_KTLS
+        m_kernel_send = BIO_get_ktls_send(SSL_get_wbio(m_ssl)) != 0;
+#endif
+        get_io_service().post([handler](){ handler(boost::system::error_code{}); });
+        return;
+    }
+
+    wait_then(ret, [this, handler](const boost::system::error_code& ec)
+            {
+                if (ec)
+                {
+                    handler(ec);
+                    return;
+                }
+                do_handshake(handler);
+            });
+}
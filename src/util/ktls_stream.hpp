@@ -0,0 +1,233 @@
+#ifndef UTIL_KTLS_STREAM_HPP_
+#define UTIL_KTLS_STREAM_HPP_
+
+/**
+ * A TLS client stream where OpenSSL talks to the socket directly instead of
+ * through asio's memory BIO pair.
+ *
+ * This matters because the kernel TLS offload (SSL_OP_ENABLE_KTLS) can only
+ * kick in when OpenSSL owns the file descriptor. Once the handshake is done
+ * and the kernel has accepted our TX keys, every write goes straight to the
+ * socket with a single gathering sendmsg: no user-space encryption and no
+ * copy of the article into OpenSSL's record buffer.
+ *
+ * If the kernel lacks the tls module (or OpenSSL was built without KTLS),
+ * writes go through SSL_write on the socket, which still saves the extra
+ * copy asio's BIO pair would make.
+ *
+ * Reads always go through SSL_read so that post-handshake records (session
+ * tickets and friends) are handled by OpenSSL.
+ */
+
+#include <functional>
+#include <type_traits>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/version.hpp>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define P2U_HAVE_KTLS 1
+#endif
+
+namespace p2u
+{
+    namespace asio
+    {
+        class ktls_stream : private boost::noncopyable
+        {
+            public:
+                using handshake_handler = std::function<void(const boost::system::error_code&)>;
+
+            private:
+                boost::asio::ip::tcp::socket& m_sock;
+                SSL* m_ssl;
+                bool m_kernel_send;
+
+                boost::system::error_code last_error(int ret);
+                void do_handshake(const handshake_handler& handler);
+
+                template <class Handler>
+                void wait_then(int ret, Handler retry)
+                {
+                    int err = SSL_get_error(m_ssl, ret);
+                    if (err == SSL_ERROR_WANT_READ)
+                    {
+                        m_sock.async_read_some(boost::asio::null_buffers(),
+                                [retry](const boost::system::error_code& ec, size_t) mutable
+                                {
+                                    retry(ec);
+                                });
+                    }
+                    else if (err == SSL_ERROR_WANT_WRITE)
+                    {
+                        m_sock.async_write_some(boost::asio::null_buffers(),
+                                [retry](const boost::system::error_code& ec, size_t) mutable
+                                {
+                                    retry(ec);
+                                });
+                    }
+                    else
+                    {
+                        auto ec = last_error(ret);
+                        get_io_service().post([retry, ec]() mutable { retry(ec); });
+                    }
+                }
+
+                static bool should_wait(int err)
+                {
+                    return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+                }
+
+                template <class ReadHandler>
+                void do_read(boost::asio::mutable_buffer buffer, ReadHandler handler)
+                {
+                    if (boost::asio::buffer_size(buffer) == 0)
+                    {
+                        // SSL_read treats a zero length read as an error
+                        get_io_service().post([handler]() mutable { handler(boost::system::error_code{}, 0); });
+                        return;
+                    }
+
+                    ERR_clear_error();
+                    int ret = SSL_read(m_ssl,
+                            boost::asio::buffer_cast<void*>(buffer),
+                            static_cast<int>(boost::asio::buffer_size(buffer)));
+
+                    if (ret > 0)
+                    {
+                        get_io_service().post([handler, ret]() mutable
+                                {
+                                    handler(boost::system::error_code{}, static_cast<size_t>(ret));
+                                });
+                    }
+                    else if (should_wait(SSL_get_error(m_ssl, ret)))
+                    {
+                        wait_then(ret, [this, buffer, handler](const boost::system::error_code& ec) mutable
+                                {
+                                    if (ec)
+                                    {
+                                        handler(ec, 0);
+                                        return;
+                                    }
+                                    do_read(buffer, handler);
+                                });
+                    }
+                    else
+                    {
+                        auto ec = last_error(ret);
+                        get_io_service().post([handler, ec]() mutable { handler(ec, 0); });
+                    }
+                }
+
+                template <class WriteHandler>
+                void do_write(boost::asio::const_buffer buffer, WriteHandler handler)
+                {
+                    if (boost::asio::buffer_size(buffer) == 0)
+                    {
+                        get_io_service().post([handler]() mutable { handler(boost::system::error_code{}, 0); });
+                        return;
+                    }
+
+                    ERR_clear_error();
+                    int ret = SSL_write(m_ssl,
+                            boost::asio::buffer_cast<const void*>(buffer),
+                            static_cast<int>(boost::asio::buffer_size(buffer)));
+
+                    if (ret > 0)
+                    {
+                        get_io_service().post([handler, ret]() mutable
+                                {
+                                    handler(boost::system::error_code{}, static_cast<size_t>(ret));
+                                });
+                    }
+                    else if (should_wait(SSL_get_error(m_ssl, ret)))
+                    {
+                        wait_then(ret, [this, buffer, handler](const boost::system::error_code& ec) mutable
+                                {
+                                    if (ec)
+                                    {
+                                        handler(ec, 0);
+                                        return;
+                                    }
+                                    do_write(buffer, handler);
+                                });
+                    }
+                    else
+                    {
+                        auto ec = last_error(ret);
+                        get_io_service().post([handler, ec]() mutable { handler(ec, 0); });
+                    }
+                }
+
+            public:
+                ktls_stream(boost::asio::ip::tcp::socket& sock,
+                            boost::asio::ssl::context& ctx);
+                ~ktls_stream();
+
+                /**
+                 * Whether this build can hand TX keys to the kernel at all.
+                 */
+                static bool supported();
+
+                /**
+                 * Enables KTLS on a context. Must be called before any stream
+                 * is created from it.
+                 */
+                static void enable_on(boost::asio::ssl::context& ctx);
+
+                void async_handshake(const handshake_handler& handler);
+
+                /**
+                 * True once the handshake finished and the kernel took over
+                 * encrypting our writes.
+                 */
+                bool kernel_send() const;
+
+                boost::asio::io_service& get_io_service();
+
+#if BOOST_VERSION >= 106600
+                // Newer asio composed operations look for an executor instead
+                using executor_type = boost::asio::ip::tcp::socket::executor_type;
+                executor_type get_executor()
+                {
+                    return m_sock.get_executor();
+                }
+#endif
+
+                // Handlers are taken by reference on purpose: asio's composed
+                // operations move themselves into the handler argument, and
+                // taking it by value could do so before the buffer sequence
+                // argument has been evaluated.
+                template <class MutableBufferSequence, class ReadHandler>
+                void async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler)
+                {
+                    // SSL_read only deals with one contiguous buffer, same as
+                    // asio's own ssl engine.
+                    auto buffer = boost::asio::detail::buffer_sequence_adapter<
+                        boost::asio::mutable_buffer, MutableBufferSequence>::first(buffers);
+                    do_read(buffer, typename std::decay<ReadHandler>::type(std::forward<ReadHandler>(handler)));
+                }
+
+                template <class ConstBufferSequence, class WriteHandler>
+                void async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler)
+                {
+                    if (m_kernel_send)
+                    {
+                        // The kernel frames and encrypts records for us, so the
+                        // whole buffer sequence goes out in one sendmsg.
+                        m_sock.async_write_some(buffers, std::forward<WriteHandler>(handler));
+                    }
+                    else
+                    {
+                        auto buffer = boost::asio::detail::buffer_sequence_adapter<
+                            boost::asio::const_buffer, ConstBufferSequence>::first(buffers);
+                        do_write(buffer, typename std::decay<WriteHandler>::type(std::forward<WriteHandler>(handler)));
+                    }
+                }
+        };
+    }
+}
+#endif
@@ -0,0 +1,165 @@
+#ifndef UTIL_MPMC_RING_HPP_
+#define UTIL_MPMC_RING_HPP_
+
+/**
+ * A bounded lock-free queue for any number of producers and consumers.
+ *
+ * This is Dmitry Vyukov's array based queue: every cell carries a sequence
+ * number that says whose turn it is, so a producer and a consumer only ever
+ * contend on the cell they are about to use, plus one CAS on their end of
+ * the ring. No allocation happens after construction.
+ *
+ * Pushing into a full ring fails rather than blocking; what to do then is
+ * up to the caller.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <boost/noncopyable.hpp>
+
+namespace p2u
+{
+    namespace util
+    {
+        template <class T>
+        class mpmc_ring : private boost::noncopyable
+        {
+            private:
+                struct cell
+                {
+                    std::atomic<size_t> sequence;
+                    T value;
+                };
+
+                // Keeps the two ends of the ring off each other's cache line
+                static const size_t CACHE_LINE = 64;
+
+                std::unique_ptr<cell[]> m_cells;
+                size_t m_mask;
+
+                // Padding rather than alignas, which plain new doesn't honour
+                // before C++17
+                char m_pad0[CACHE_LINE];
+                std::atomic<size_t> m_tail;
+                char m_pad1[CACHE_LINE];
+                std::atomic<size_t> m_head;
+                char m_pad2[CACHE_LINE];
+
+                static size_t round_up(size_t capacity)
+                {
+                    size_t size = 2;
+                    while (size < capacity)
+                    {
+                        size <<= 1;
+                    }
+                    return size;
+                }
+
+            public:
+                /**
+                 * Capacity is rounded up to a power of two
+                 */
+                explicit mpmc_ring(size_t capacity)
+                    : m_cells{new cell[round_up(capacity)]},
+                      m_mask{round_up(capacity) - 1}, m_tail{0}, m_head{0}
+                {
+                    for (size_t i = 0; i <= m_mask; ++i)
+                    {
+                        m_cells[i].sequence.store(i, std::memory_order_relaxed);
+                    }
+                }
+
+                size_t capacity() const
+                {
+                    return m_mask + 1;
+                }
+
+                bool try_push(T&& value)
+                {
+                    size_t pos = m_tail.load(std::memory_order_relaxed);
+                    cell* target;
+                    while (true)
+                    {
+                        target = &m_cells[pos & m_mask];
+                        size_t seq = target->sequence.load(std::memory_order_acquire);
+                        auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+                        if (diff == 0)
+                        {
+                            if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                            {
+                                break;
+                            }
+                        }
+                        else if (diff < 0)
+                        {
+                            // A whole lap behind the consumers: full
+                            return false;
+                        }
+                        else
+                        {
+                            pos = m_tail.load(std::memory_order_relaxed);
+                        }
+                    }
+
+                    target->value = std::move(value);
+                    target->sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+
+                bool try_push(const T& value)
+                {
+                    T copy{value};
+                    return try_push(std::move(copy));
+                }
+
+                bool try_pop(T& value)
+                {
+                    size_t pos = m_head.load(std::memory_order_relaxed);
+                    cell* target;
+                    while (true)
+                    {
+                        target = &m_cells[pos & m_mask];
+                        size_t seq = target->sequence.load(std::memory_order_acquire);
+                        auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+                        if (diff == 0)
+                        {
+                            if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                            {
+                                break;
+                            }
+                        }
+                        else if (diff < 0)
+                        {
+                            // Nothing has been written there yet: empty
+                            return false;
+                        }
+                        else
+                        {
+                            pos = m_head.load(std::memory_order_relaxed);
+                        }
+                    }
+
+                    value = std::move(target->value);
+
+                    // Don't keep whatever it referenced alive until the cell
+                    // comes around again
+                    target->value = T{};
+                    target->sequence.store(pos + m_mask + 1, std::memory_order_release);
+                    return true;
+                }
+
+                /**
+                 * Only a snapshot, other threads may change it right away
+                 */
+                size_t size_approx() const
+                {
+                    size_t tail = m_tail.load(std::memory_order_acquire);
+                    size_t head = m_head.load(std::memory_order_acquire);
+                    return tail > head ? tail - head : 0;
+                }
+        };
+    }
+}
+#endif
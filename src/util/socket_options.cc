@@ -0,0 +1,121 @@
+#include "socket_options.hpp"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+
+namespace
+{
+    void set_int_option(boost::asio::ip::tcp::socket& sock, int level, int name,
+                        int value, const char* label, std::vector<std::string>& failed)
+    {
+        if (::setsockopt(sock.native_handle(), level, name, &value, sizeof(value)) != 0)
+        {
+            failed.push_back(std::string{label} + ": " + std::strerror(errno));
+        }
+    }
+
+    template <class Option>
+    void set_option(boost::asio::ip::tcp::socket& sock, const Option& option,
+                    const char* label, std::vector<std::string>& failed)
+    {
+        boost::system::error_code ec;
+        sock.set_option(option, ec);
+        if (ec)
+        {
+            failed.push_back(std::string{label} + ": " + ec.message());
+        }
+    }
+}
+
+std::vector<std::string> p2u::asio::apply_socket_options(boost::asio::ip::tcp::socket& sock,
+                                                         const socket_options& options)
+{
+    std::vector<std::string> failed;
+
+    if (options.send_buffer > 0)
+    {
+        set_option(sock, boost::asio::socket_base::send_buffer_size(options.send_buffer),
+                "SO_SNDBUF", failed);
+    }
+
+    if (options.receive_buffer > 0)
+    {
+        set_option(sock, boost::asio::socket_base::receive_buffer_size(options.receive_buffer),
+                "SO_RCVBUF", failed);
+    }
+
+    if (options.no_delay)
+    {
+        set_option(sock, boost::asio::ip::tcp::no_delay(true), "TCP_NODELAY", failed);
+    }
+
+    if (options.keepalive_idle > 0)
+    {
+        set_option(sock, boost::asio::socket_base::keep_alive(true), "SO_KEEPALIVE", failed);
+#ifdef TCP_KEEPIDLE
+        set_int_option(sock, IPPROTO_TCP, TCP_KEEPIDLE, options.keepalive_idle,
+                "TCP_KEEPIDLE", failed);
+#endif
+    }
+
+    if (options.notsent_lowat > 0)
+    {
+#ifdef TCP_NOTSENT_LOWAT
+        set_int_option(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, options.notsent_lowat,
+                "TCP_NOTSENT_LOWAT", failed);
+#else
+        failed.push_back("TCP_NOTSENT_LOWAT: not supported on this platform");
+#endif
+    }
+
+    if (options.user_timeout_ms > 0)
+    {
+#ifdef TCP_USER_TIMEOUT
+        set_int_option(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, options.user_timeout_ms,
+                "TCP_USER_TIMEOUT", failed);
+#else
+        failed.push_back("TCP_USER_TIMEOUT: not supported on this platform");
+#endif
+    }
+
+    if (!options.congestion.empty())
+    {
+#ifdef TCP_CONGESTION
+        if (::setsockopt(sock.native_handle(), IPPROTO_TCP, TCP_CONGESTION,
+                    options.congestion.c_str(), options.congestion.length()) != 0)
+        {
+            failed.push_back("TCP_CONGESTION=" + options.congestion + ": " + std::strerror(errno));
+        }
+#else
+        failed.push_back("TCP_CONGESTION: not supported on this platform");
+#endif
+    }
+
+    return failed;
+}
+
+boost::system::error_code p2u::asio::set_max_pacing_rate(boost::asio::ip::tcp::socket& sock,
+                                                         std::uint64_t bytes_per_second)
+{
+#ifdef SO_MAX_PACING_RATE
+    // Older kernels only take 32 bits, which is plenty for one connection
+    unsigned int rate = std::numeric_limits<unsigned int>::max();
+    if (bytes_per_second > 0 && bytes_per_second < rate)
+    {
+        rate = static_cast<unsigned int>(bytes_per_second);
+    }
+
+    if (::setsockopt(sock.native_handle(), SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) != 0)
+    {
+        return boost::system::error_code{errno, boost::system::system_category()};
+    }
+    return boost::system::error_code{};
+#else
+    (void)sock;
+    (void)bytes_per_second;
+    return boost::asio::error::operation_not_supported;
+#endif
+}
@@ -0,0 +1,65 @@
+#ifndef UTIL_SOCKET_OPTIONS_HPP_
+#define UTIL_SOCKET_OPTIONS_HPP_
+
+/**
+ * Per-server TCP tuning.
+ *
+ * The defaults leave everything to the kernel. On long fat pipes the
+ * autotuned buffers and an unbounded amount of unsent data in the socket
+ * cap what a single connection can push, which is what this is for.
+ *
+ * Options have to be set after the socket is opened but before it connects:
+ * the window scale is negotiated in the SYN, so a larger receive buffer set
+ * later doesn't help.
+ */
+
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace p2u
+{
+    namespace asio
+    {
+        struct socket_options
+        {
+            // Zero means kernel default for all of the numeric ones
+            int send_buffer = 0;
+            int receive_buffer = 0;
+            bool no_delay = false;
+
+            // Bytes of not yet sent data the kernel may hold before the
+            // socket stops being writable.
+            int notsent_lowat = 0;
+
+            // e.g. "bbr", must be listed in
+            // /proc/sys/net/ipv4/tcp_allowed_congestion_control
+            std::string congestion;
+
+            // How long sent data may stay unacknowledged before the kernel
+            // gives up on the connection.
+            int user_timeout_ms = 0;
+
+            // Idle seconds before the first keepalive probe
+            int keepalive_idle = 0;
+        };
+
+        /**
+         * Applies every option that differs from the kernel default. Options
+         * the kernel refuses don't stop the others from being set; they are
+         * returned as "NAME: reason".
+         */
+        std::vector<std::string> apply_socket_options(boost::asio::ip::tcp::socket& sock,
+                                                      const socket_options& options);
+
+        /**
+         * Asks the kernel to pace the socket at no more than this many
+         * bytes per second (SO_MAX_PACING_RATE). Works on a connected
+         * socket too. Zero lifts the cap.
+         */
+        boost::system::error_code set_max_pacing_rate(boost::asio::ip::tcp::socket& sock,
+                                                      std::uint64_t bytes_per_second);
+    }
+}
+#endif
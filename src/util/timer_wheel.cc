@@ -0,0 +1,247 @@
+#include "timer_wheel.hpp"
+#include <ostream>
+
+p2u::asio::timer_wheel::entry::entry(timer_wheel& wheel, const std::function<void()>& on_expire)
+    : m_wheel(wheel), m_on_expire{on_expire}, m_deadline{0}, m_armed{false},
+      m_linked{false}, m_slot{0}
+{
+
+}
+
+p2u::asio::timer_wheel::entry::~entry()
+{
+    std::lock_guard<std::mutex> _lock{m_wheel.m_lock};
+    if (m_armed)
+    {
+        --m_wheel.m_armed;
+        m_armed = false;
+    }
+    m_wheel.unlink(*this);
+}
+
+void p2u::asio::timer_wheel::entry::arm(std::chrono::milliseconds timeout)
+{
+    m_wheel.arm(*this, timeout);
+}
+
+void p2u::asio::timer_wheel::entry::disarm()
+{
+    m_wheel.disarm(*this);
+}
+
+p2u::asio::timer_wheel::timer_wheel(boost::asio::io_service& io_service,
+                                    std::chrono::milliseconds tick,
+                                    size_t num_slots)
+    : m_timer{io_service}, m_tick{tick}, m_epoch{clock::now()}, m_slots(num_slots),
+      m_processed{0}, m_armed{0}, m_ticking{false}
+{
+
+}
+
+std::uint64_t p2u::asio::timer_wheel::now_tick() const
+{
+    return static_cast<std::uint64_t>((clock::now() - m_epoch) / m_tick);
+}
+
+void p2u::asio::timer_wheel::link(entry& e)
+{
+    e.m_slot = e.m_deadline % m_slots.size();
+    auto& slot = m_slots[e.m_slot];
+    e.m_pos = slot.insert(slot.end(), &e);
+    e.m_linked = true;
+}
+
+void p2u::asio::timer_wheel::unlink(entry& e)
+{
+    if (e.m_linked)
+    {
+        m_slots[e.m_slot].erase(e.m_pos);
+        e.m_linked = false;
+    }
+}
+
+void p2u::asio::timer_wheel::arm(entry& e, std::chrono::milliseconds timeout)
+{
+    if (timeout.count() < 1)
+    {
+        disarm(e);
+        return;
+    }
+
+    std::lock_guard<std::mutex> _lock{m_lock};
+    ++m_stats.arms;
+
+    // Rounded up from the time it is now, not from the start of the current
+    // tick, which may be most of a tick ago. Expiring up to a tick late is
+    // fine, early is not.
+    auto now = now_tick();
+    auto deadline = clock::now() - m_epoch + std::chrono::duration_cast<clock::duration>(timeout);
+    e.m_deadline = static_cast<std::uint64_t>((deadline + m_tick - clock::duration{1}) / m_tick);
+
+    if (!e.m_armed)
+    {
+        e.m_armed = true;
+        ++m_armed;
+    }
+
+    if (e.m_linked)
+    {
+        // Still sitting in a slot from an earlier arm. That's fine as long as
+        // the slot comes around before the new deadline; the tick will move
+        // it along. Otherwise move it now.
+        auto n = m_slots.size();
+        auto next_visit = now + 1 + (e.m_slot + n - (now + 1) % n) % n;
+        if (e.m_deadline < next_visit)
+        {
+            unlink(e);
+            link(e);
+            ++m_stats.relinks;
+        }
+    }
+    else
+    {
+        link(e);
+    }
+
+    start_ticking();
+}
+
+void p2u::asio::timer_wheel::disarm(entry& e)
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+
+    // Left in its slot on purpose, the next arm will most likely reuse it
+    if (e.m_armed)
+    {
+        e.m_armed = false;
+        --m_armed;
+    }
+}
+
+void p2u::asio::timer_wheel::start_ticking()
+{
+    // Must be called with m_lock held
+    if (m_ticking)
+    {
+        return;
+    }
+
+    m_ticking = true;
+
+    // Nothing happened while we weren't ticking
+    m_processed = now_tick();
+    schedule_tick();
+}
+
+void p2u::asio::timer_wheel::schedule_tick()
+{
+    // Must be called with m_lock held
+    m_timer.expires_from_now(boost::posix_time::microseconds(
+                std::chrono::duration_cast<std::chrono::microseconds>(m_tick).count()));
+    m_timer.async_wait([this](const boost::system::error_code& ec)
+            {
+                on_tick(ec);
+            });
+}
+
+void p2u::asio::timer_wheel::on_tick(const boost::system::error_code& ec)
+{
+    if (ec)
+    {
+        return;
+    }
+
+    std::vector<entry*> expired;
+
+    {
+        std::lock_guard<std::mutex> _lock{m_lock};
+        ++m_stats.ticks;
+
+        auto now = now_tick();
+
+        // Catch up on every slot that passed since the last tick, but never
+        // go around the wheel more than once.
+        if (now - m_processed > m_slots.size())
+        {
+            m_processed = now - m_slots.size();
+        }
+
+        for (; m_processed < now; ++m_processed)
+        {
+            auto& slot = m_slots[(m_processed + 1) % m_slots.size()];
+            for (auto it = slot.begin(); it != slot.end();)
+            {
+                entry* e = *it;
+                if (!e->m_armed)
+                {
+                    it = slot.erase(it);
+                    e->m_linked = false;
+                }
+                else if (e->m_deadline <= now)
+                {
+                    it = slot.erase(it);
+                    e->m_linked = false;
+                    e->m_armed = false;
+                    --m_armed;
+                    expired.push_back(e);
+                }
+                else if (e->m_deadline % m_slots.size() != e->m_slot)
+                {
+                    // Re-armed since it was linked here
+                    it = slot.erase(it);
+                    link(*e);
+                    ++m_stats.relinks;
+                }
+                else
+                {
+                    // A later round of the same slot
+                    ++it;
+                }
+            }
+        }
+
+        m_stats.expirations += expired.size();
+
+        // Picks up where this tick left off. Starting over from now_tick()
+        // would skip a slot if a tick boundary passed in between.
+        if (m_armed > 0)
+        {
+            schedule_tick();
+        }
+        else
+        {
+            m_ticking = false;
+        }
+    }
+
+    for (auto e : expired)
+    {
+        e->m_on_expire();
+    }
+}
+
+p2u::asio::timer_wheel::statistics p2u::asio::timer_wheel::get_statistics()
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    return m_stats;
+}
+
+p2u::asio::timer_wheel::statistics& p2u::asio::timer_wheel::statistics::operator+=(const statistics& other)
+{
+    arms += other.arms;
+    relinks += other.relinks;
+    ticks += other.ticks;
+    expirations += other.expirations;
+    return *this;
+}
+
+std::ostream& p2u::asio::operator<<(std::ostream& stream, const timer_wheel::statistics& stats)
+{
+    // Every arm used to be its own async_wait on a deadline_timer, the wheel
+    // waits once per tick. What either costs, see misc/bench_timer_wheel.
+    stream << "timeouts armed: " << stats.arms
+        << ", timer waits: " << stats.ticks
+        << ", relinks: " << stats.relinks
+        << ", expirations: " << stats.expirations;
+    return stream;
+}
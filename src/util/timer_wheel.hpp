@@ -0,0 +1,110 @@
+#ifndef UTIL_TIMER_WHEEL_HPP_
+#define UTIL_TIMER_WHEEL_HPP_
+
+/**
+ * A coarse hashed timer wheel for operation timeouts.
+ *
+ * Connections arm a timeout before nearly every read and write and disarm it
+ * right after. Doing that with a deadline_timer means a new async_wait (and a
+ * handler allocation, and a timer queue insertion) per operation, all for
+ * timers that almost never fire.
+ *
+ * Here arming is just writing a deadline into the entry. A single
+ * deadline_timer ticks the wheel, and each tick looks at one slot:
+ * disarmed entries are dropped, entries whose deadline was pushed back are
+ * moved to their new slot, and only entries that really expired get their
+ * callback run.
+ *
+ * The wheel only ticks while something is armed, so it never keeps an
+ * io_service from running out of work.
+ */
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <list>
+#include <mutex>
+#include <vector>
+
+namespace p2u
+{
+    namespace asio
+    {
+        class timer_wheel : private boost::noncopyable
+        {
+            public:
+                class entry : private boost::noncopyable
+                {
+                    friend class timer_wheel;
+
+                    timer_wheel& m_wheel;
+                    std::function<void()> m_on_expire;
+
+                    std::uint64_t m_deadline;
+                    bool m_armed;
+                    bool m_linked;
+                    size_t m_slot;
+                    std::list<entry*>::iterator m_pos;
+
+                    public:
+                        entry(timer_wheel& wheel, const std::function<void()>& on_expire);
+                        ~entry();
+
+                        /**
+                         * (Re)starts the timeout. It expires no sooner than
+                         * that, and up to a tick later. Values < 1 disarm
+                         * instead.
+                         */
+                        void arm(std::chrono::milliseconds timeout);
+                        void disarm();
+                };
+
+                struct statistics
+                {
+                    std::uint64_t arms = 0;
+                    std::uint64_t relinks = 0;
+                    std::uint64_t ticks = 0;
+                    std::uint64_t expirations = 0;
+
+                    statistics& operator+=(const statistics& other);
+                };
+
+            private:
+                using clock = std::chrono::steady_clock;
+
+                boost::asio::deadline_timer m_timer;
+                clock::duration m_tick;
+                clock::time_point m_epoch;
+                std::vector<std::list<entry*>> m_slots;
+
+                std::mutex m_lock;
+                std::uint64_t m_processed;
+                size_t m_armed;
+                bool m_ticking;
+                statistics m_stats;
+
+                std::uint64_t now_tick() const;
+                void link(entry& e);
+                void unlink(entry& e);
+                void start_ticking();
+                void schedule_tick();
+                void on_tick(const boost::system::error_code& ec);
+
+                void arm(entry& e, std::chrono::milliseconds timeout);
+                void disarm(entry& e);
+
+            public:
+                timer_wheel(boost::asio::io_service& io_service,
+                            std::chrono::milliseconds tick = std::chrono::milliseconds{250},
+                            size_t num_slots = 512);
+
+                statistics get_statistics();
+        };
+
+        std::ostream& operator<<(std::ostream& stream, const timer_wheel::statistics& stats);
+    }
+}
+#endif
@@ -0,0 +1,68 @@
+#include "token_bucket.hpp"
+#include <algorithm>
+
+p2u::asio::token_bucket::token_bucket(std::uint64_t bytes_per_second)
+    : m_rate{bytes_per_second}, m_tokens{0}, m_last{clock::now()}, m_held_back{0}
+{
+    m_tokens = burst();
+}
+
+double p2u::asio::token_bucket::burst() const
+{
+    return static_cast<double>(m_rate) * BURST_MS / 1000;
+}
+
+void p2u::asio::token_bucket::refill(clock::time_point now)
+{
+    // Must be called with m_lock held
+    auto elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(now - m_last).count();
+    m_tokens = std::min(burst(), m_tokens + elapsed * m_rate);
+    m_last = now;
+}
+
+void p2u::asio::token_bucket::set_rate(std::uint64_t bytes_per_second)
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    refill(clock::now());
+    m_rate = bytes_per_second;
+
+    // Debt run up at the old rate would otherwise be paid off at the new one
+    m_tokens = std::max(0.0, std::min(burst(), m_tokens));
+}
+
+std::uint64_t p2u::asio::token_bucket::get_rate() const
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    return m_rate;
+}
+
+bool p2u::asio::token_bucket::limited() const
+{
+    return get_rate() > 0;
+}
+
+std::chrono::microseconds p2u::asio::token_bucket::take(std::size_t bytes)
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    if (m_rate == 0)
+    {
+        return std::chrono::microseconds{0};
+    }
+
+    refill(clock::now());
+    m_tokens -= static_cast<double>(bytes);
+    if (m_tokens >= 0)
+    {
+        return std::chrono::microseconds{0};
+    }
+
+    std::chrono::microseconds wait{static_cast<std::int64_t>(-m_tokens * 1000000 / m_rate)};
+    m_held_back += wait;
+    return wait;
+}
+
+std::chrono::microseconds p2u::asio::token_bucket::get_held_back() const
+{
+    std::lock_guard<std::mutex> _lock{m_lock};
+    return m_held_back;
+}
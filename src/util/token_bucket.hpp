@@ -0,0 +1,69 @@
+#ifndef UTIL_TOKEN_BUCKET_HPP_
+#define UTIL_TOKEN_BUCKET_HPP_
+
+/**
+ * Caps the rate at which bytes may be sent.
+ *
+ * Senders take what they are about to send out of the bucket and are told
+ * how long to wait before sending it. The bucket is allowed to go into debt,
+ * so writers sharing one bucket line up behind each other instead of all
+ * polling for tokens, and the aggregate comes out smooth.
+ *
+ * The burst is kept small (BURST_MS worth of bytes) on purpose: providers
+ * that throttle bursty accounts look at short windows.
+ */
+
+#include <boost/noncopyable.hpp>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace p2u
+{
+    namespace asio
+    {
+        class token_bucket : private boost::noncopyable
+        {
+            public:
+                using clock = std::chrono::steady_clock;
+
+                // How much the bucket may hold, in milliseconds of its rate
+                static const int BURST_MS = 50;
+
+            private:
+                mutable std::mutex m_lock;
+
+                // Bytes per second, zero is unlimited
+                std::uint64_t m_rate;
+                double m_tokens;
+                clock::time_point m_last;
+
+                std::chrono::microseconds m_held_back;
+
+                double burst() const;
+                void refill(clock::time_point now);
+
+            public:
+                token_bucket(std::uint64_t bytes_per_second = 0);
+
+                /**
+                 * Takes effect for the next take(). Zero lifts the limit.
+                 */
+                void set_rate(std::uint64_t bytes_per_second);
+                std::uint64_t get_rate() const;
+                bool limited() const;
+
+                /**
+                 * Takes bytes out of the bucket and returns how long the
+                 * caller has to wait before sending them.
+                 */
+                std::chrono::microseconds take(std::size_t bytes);
+
+                /**
+                 * All the waiting take() has asked for so far
+                 */
+                std::chrono::microseconds get_held_back() const;
+        };
+    }
+}
+#endif
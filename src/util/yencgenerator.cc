@@ -1,10 +1,12 @@
+#include <algorithm>
 #include <sstream>
 #include <boost/crc.hpp>
 #include "yencgenerator.hpp"
 
 p2u::util::yencgenerator::yencgenerator(const boost::filesystem::path& path,
                                         size_t articlesize, size_t linesize)
-    : m_filepath{path}, m_articlesize{articlesize}, m_linesize{linesize}
+    : m_filepath{path}, m_name{path.filename().generic_string()},
+      m_articlesize{articlesize}, m_linesize{linesize}, m_in_memory{false}
 {
     if (!boost::filesystem::exists(path) ||
             !boost::filesystem::is_regular(path))
@@ -26,16 +28,46 @@ p2u::util::yencgenerator::yencgenerator(const boost::filesystem::path& path,
 
 }
 
+p2u::util::yencgenerator::yencgenerator(const std::string& name, payload_type data,
+                                        size_t articlesize, size_t linesize)
+    : m_filepath{name}, m_name{name}, m_articlesize{articlesize}, m_linesize{linesize},
+      m_filesize{data.size()}, m_buffer(std::move(data)), m_in_memory{true}
+{
+    m_numparts = m_filesize / m_articlesize;
+    if (m_filesize % m_articlesize != 0) {
+        ++m_numparts;
+    }
+}
+
 size_t p2u::util::yencgenerator::num_parts() const
 {
     return m_numparts;
 }
 
+size_t p2u::util::yencgenerator::size() const
+{
+    return m_filesize;
+}
+
+void p2u::util::yencgenerator::read_part(size_t offset, payload_type& buf)
+{
+    if (m_in_memory)
+    {
+        auto end = std::min(offset + m_articlesize, m_buffer.size());
+        buf.assign(m_buffer.begin() + std::min(offset, end), m_buffer.begin() + end);
+        return;
+    }
+
+    buf.resize(m_articlesize);
+    m_file.seekg(offset);
+    m_file.read(&buf[0], m_articlesize);
+    buf.resize(m_file.gcount());
+}
+
 p2u::util::yencgenerator::payload_type
 p2u::util::yencgenerator::get_part(size_t partnumber)
 {
     auto part_offset = partnumber * m_articlesize;
-    m_file.seekg(part_offset);
 
     p2u::util::yencgenerator::payload_type ret;
     p2u::util::yencgenerator::payload_type buf;
@@ -44,14 +76,14 @@ p2u::util::yencgenerator::get_part(size_t partnumber)
 
     boost::crc_32_type summer;
 
-    m_file.read(&buf[0], m_articlesize);
-    size_t bytes_read = m_file.gcount();
+    read_part(part_offset, buf);
+    size_t bytes_read = buf.size();
 
     std::ostringstream stream;
     stream << "=ybegin part=" << partnumber+1 << " total=" << num_parts()
         << " line=" << m_linesize
         << " size=" << m_filesize
-        << " name=" << m_filepath.filename().generic_string() << "\r\n";
+        << " name=" << m_name << "\r\n";
     std::string line = stream.str();
     ret.insert(ret.end(), line.begin(), line.end());
 
@@ -67,7 +99,7 @@ p2u::util::yencgenerator::get_part(size_t partnumber)
 
     auto data_end = buf.begin() + bytes_read;
 
-    summer.process_bytes(&buf[0], bytes_read);
+    summer.process_bytes(buf.data(), bytes_read);
 
     p2u::yenc::encode_block(buf.begin(), data_end, std::back_inserter(ret),
             m_linesize);
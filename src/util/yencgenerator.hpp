@@ -3,6 +3,7 @@
 
 #include <boost/filesystem.hpp>
 #include <fstream>
+#include <string>
 #include <vector>
 #include "../yenc/yenc.hpp"
 
@@ -17,6 +18,7 @@ namespace p2u
 
             private:
                 boost::filesystem::path m_filepath;
+                std::string m_name;
                 size_t m_articlesize;
                 size_t m_linesize;
 
@@ -25,12 +27,29 @@ namespace p2u
 
                 std::ifstream m_file;
 
+                // What is posted when it doesn't come from a file
+                payload_type m_buffer;
+                bool m_in_memory;
+
+                // Up to one article's worth of input at offset
+                void read_part(size_t offset, payload_type& buf);
+
             public:
                 yencgenerator(const boost::filesystem::path& path,
                               size_t articlesize,
                               size_t linesize);
 
+                /**
+                 * Encodes data that is already in memory, posted as if it
+                 * came from a file called name.
+                 */
+                yencgenerator(const std::string& name,
+                              payload_type data,
+                              size_t articlesize,
+                              size_t linesize);
+
                 size_t num_parts() const;
+                size_t size() const;
                 payload_type get_part(size_t i);
 
         };
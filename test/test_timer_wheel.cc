@@ -0,0 +1,87 @@
+/**
+ * Arms timeouts at different points within a tick of the wheel and checks
+ * that none of them fires before its time is up, nor much later.
+ */
+
+#include "../src/util/timer_wheel.hpp"
+#include <boost/asio.hpp>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <thread>
+
+namespace
+{
+    const std::chrono::milliseconds TICK{50};
+
+    // Not a whole number of ticks, and one that is
+    const std::chrono::milliseconds TIMEOUTS[] = {
+        std::chrono::milliseconds{120},
+        std::chrono::milliseconds{100}
+    };
+
+    // How far into a tick each timeout is armed
+    const int PHASES = 10;
+
+    // Late by up to a tick by design, plus whatever the scheduler adds
+    const std::chrono::milliseconds LATENESS = TICK * 2 + std::chrono::milliseconds{100};
+}
+
+int main()
+{
+    using clock = std::chrono::steady_clock;
+
+    boost::asio::io_service iosvc;
+    boost::asio::io_service::work work{iosvc};
+    std::thread runner([&iosvc]()
+            {
+                iosvc.run();
+            });
+
+    p2u::asio::timer_wheel wheel{iosvc, TICK, 64};
+    int failures = 0;
+
+    // Keeps the wheel ticking at its own pace, like the other connections
+    // of a shard do. An idle wheel starts ticking when it's armed, which
+    // would line the ticks up with every timeout.
+    p2u::asio::timer_wheel::entry keeper{wheel, [](){}};
+    keeper.arm(std::chrono::hours{1});
+
+    for (auto timeout : TIMEOUTS)
+    {
+        for (int phase = 0; phase < PHASES; ++phase)
+        {
+            std::this_thread::sleep_for(TICK * phase / PHASES);
+
+            std::promise<clock::time_point> fired;
+            p2u::asio::timer_wheel::entry entry{wheel, [&fired]()
+                {
+                    fired.set_value(clock::now());
+                }};
+
+            auto armed = clock::now();
+            entry.arm(timeout);
+            auto took = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    fired.get_future().get() - armed);
+
+            if (took < timeout || took > timeout + LATENESS)
+            {
+                std::cerr << "FAIL: a timeout of " << timeout.count() << " ms fired after "
+                    << took.count() << " ms" << std::endl;
+                ++failures;
+            }
+        }
+    }
+
+    keeper.disarm();
+    iosvc.stop();
+    runner.join();
+
+    if (failures > 0)
+    {
+        return 1;
+    }
+
+    std::cout << "OK" << std::endl;
+    return 0;
+}
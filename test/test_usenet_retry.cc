@@ -0,0 +1,227 @@
+/**
+ * Posts a few articles over one connection to a local server that turns
+ * the last of them away once with "436 Try again later". The retry must
+ * still go out before the job winds down.
+ */
+
+#include "../src/nntp/message.hpp"
+#include "../src/nntp/usenet.hpp"
+#include <boost/algorithm/string.hpp>
+#include <boost/asio.hpp>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using boost::asio::ip::tcp;
+
+namespace
+{
+    const size_t NUM_ARTICLES = 5;
+
+    // Accepts any login and posting, except that the first attempt at
+    // reject_msgid gets a transient failure
+    class flaky_server
+    {
+        private:
+            boost::asio::io_service m_iosvc;
+            tcp::acceptor m_acceptor;
+            std::string m_reject_msgid;
+            std::atomic<bool> m_rejected;
+            std::atomic<bool> m_stopping;
+            std::mutex m_lock;
+            std::vector<std::thread> m_sessions;
+            std::thread m_thread;
+
+            static std::string read_line(tcp::socket& socket, boost::asio::streambuf& buf)
+            {
+                size_t n = boost::asio::read_until(socket, buf, "\r\n");
+                auto data = buf.data();
+                std::string line(boost::asio::buffers_begin(data), boost::asio::buffers_begin(data) + n);
+                buf.consume(n);
+                return line;
+            }
+
+            void reply(tcp::socket& socket, const std::string& line)
+            {
+                boost::asio::write(socket, boost::asio::buffer(line + "\r\n"));
+            }
+
+            void session(tcp::socket socket)
+            {
+                try
+                {
+                    boost::asio::streambuf buf;
+                    reply(socket, "200 Welcome");
+                    while (true)
+                    {
+                        auto line = read_line(socket, buf);
+                        if (boost::starts_with(line, "AUTHINFO USER"))
+                        {
+                            reply(socket, "381 PASS required");
+                        }
+                        else if (boost::starts_with(line, "AUTHINFO PASS"))
+                        {
+                            reply(socket, "281 Ok");
+                        }
+                        else if (boost::starts_with(line, "DATE"))
+                        {
+                            reply(socket, "111 20260101000000");
+                        }
+                        else if (boost::starts_with(line, "QUIT"))
+                        {
+                            reply(socket, "205 Bye");
+                            return;
+                        }
+                        else if (boost::starts_with(line, "POST"))
+                        {
+                            reply(socket, "340 Send article");
+                            bool reject = false;
+                            for (line = read_line(socket, buf); line != ".\r\n"; line = read_line(socket, buf))
+                            {
+                                if (boost::contains(line, m_reject_msgid) && !m_rejected.exchange(true))
+                                {
+                                    reject = true;
+                                }
+                            }
+                            reply(socket, reject ? "436 Try again later" : "240 Article received");
+                        }
+                        else
+                        {
+                            reply(socket, "500 What?");
+                        }
+                    }
+                }
+                catch (const boost::system::system_error&)
+                {
+                    // The client went away
+                }
+            }
+
+            void accept()
+            {
+                while (true)
+                {
+                    tcp::socket socket{m_iosvc};
+                    boost::system::error_code ec;
+                    m_acceptor.accept(socket, ec);
+                    if (ec || m_stopping)
+                    {
+                        return;
+                    }
+
+                    std::lock_guard<std::mutex> _lock{m_lock};
+                    m_sessions.emplace_back(&flaky_server::session, this, std::move(socket));
+                }
+            }
+
+        public:
+            explicit flaky_server(const std::string& reject_msgid)
+                : m_acceptor{m_iosvc, tcp::endpoint{boost::asio::ip::address_v4::loopback(), 0}},
+                  m_reject_msgid{reject_msgid}, m_rejected{false}, m_stopping{false}
+            {
+                m_thread = std::thread(&flaky_server::accept, this);
+            }
+
+            ~flaky_server()
+            {
+                // Closing the acceptor doesn't wake a blocking accept, a
+                // last connection does
+                m_stopping = true;
+                tcp::socket wakeup{m_iosvc};
+                boost::system::error_code ignored;
+                wakeup.connect(m_acceptor.local_endpoint(), ignored);
+                m_thread.join();
+                for (auto& session : m_sessions)
+                {
+                    session.join();
+                }
+            }
+
+            std::uint16_t port() const
+            {
+                return m_acceptor.local_endpoint().port();
+            }
+
+            bool rejected() const
+            {
+                return m_rejected.load();
+            }
+    };
+
+    std::shared_ptr<p2u::nntp::article> make_article(size_t i)
+    {
+        p2u::nntp::header header;
+        header.from = "test <test@example.com>";
+        header.newsgroups = {"alt.binaries.test"};
+        header.subject = "retry test " + std::to_string(i);
+        header.msgid = "<retry" + std::to_string(i) + "@example.com>";
+
+        auto msg = std::make_shared<p2u::nntp::article>(std::move(header));
+        msg->add_payload_piece(std::vector<char>(1000, 'x'));
+        return msg;
+    }
+}
+
+int main()
+{
+    // join() would return early instead, but don't hang if it doesn't
+    std::thread([]()
+            {
+                std::this_thread::sleep_for(std::chrono::seconds(60));
+                std::cerr << "FAIL: timed out" << std::endl;
+                std::_Exit(1);
+            }).detach();
+
+    flaky_server server{"<retry" + std::to_string(NUM_ARTICLES - 1) + "@example.com>"};
+
+    p2u::nntp::usenet usenet{1};
+    usenet.set_operation_timeout(10);
+    usenet.set_retry_policy(3, std::chrono::milliseconds(50), std::chrono::milliseconds(100));
+
+    p2u::nntp::connection_info info;
+    info.serveraddr = "127.0.0.1";
+    info.port = server.port();
+    info.tls = false;
+    info.username = "user";
+    info.password = "pass";
+    usenet.add_connections(info, 1);
+
+    std::atomic<size_t> posted{0};
+    std::atomic<size_t> failed{0};
+    usenet.set_post_finished_callback([&posted](const std::shared_ptr<p2u::nntp::article>&)
+            {
+                ++posted;
+            });
+    usenet.set_post_failed_callback([&failed](const std::shared_ptr<p2u::nntp::article>&)
+            {
+                ++failed;
+            });
+
+    usenet.start();
+    for (size_t i = 0; i < NUM_ARTICLES; ++i)
+    {
+        usenet.enqueue_post(make_article(i));
+    }
+    usenet.stop();
+    usenet.join();
+
+    if (!server.rejected())
+    {
+        std::cerr << "FAIL: the last article was never turned away" << std::endl;
+        return 1;
+    }
+
+    if (posted != NUM_ARTICLES || failed != 0)
+    {
+        std::cerr << "FAIL: posted " << posted << ", failed " << failed
+            << " of " << NUM_ARTICLES << std::endl;
+        return 1;
+    }
+
+    std::cout << "OK" << std::endl;
+    return 0;
+}